@@ -0,0 +1,62 @@
+// Source file for the batch grid files
+
+// Include files
+
+#include "GridFile.h"
+
+
+
+R2Affine GridWorldToGrid(RNScalar x0, RNScalar y0, RNScalar dx, RNScalar dy)
+{
+  // Scale and translate, so that (x0, y0) is grid point (0, 0)
+  R3Matrix world_to_grid(1.0 / dx, 0, -x0 / dx,
+                         0, 1.0 / dy, -y0 / dy,
+                         0, 0, 1);
+  return R2Affine(world_to_grid);
+}
+
+
+
+int WriteGridFile(const R2Grid& grid, const char *filename, int verbose)
+{
+  // Start statistics
+  RNTime start_time;
+  start_time.Read();
+
+  // Parse output filename extension
+  const char *extension = strrchr(filename, '.');
+  if (!extension) {
+    fprintf(stderr, "Output file has no extension (e.g., .pfm, .jpg): %s\n", filename);
+    return 0;
+  }
+
+  // Write file of appropriate type
+  if (!strcmp(extension, ".pfm") || !strcmp(extension, ".raw") || !strcmp(extension, ".grd")) {
+    // Write raw grid values
+    if (!grid.WriteFile(filename)) return 0;
+  }
+  else {
+    // Colormap grid values the same way DrawSphere does
+    R2Image image(grid.XResolution(), grid.YResolution(), 3);
+    for (int ix = 0; ix < grid.XResolution(); ix++) {
+      for (int iy = 0; iy < grid.YResolution(); iy++) {
+        RNScalar value = grid.GridValue(ix, iy);
+        if (value > 1.0) value = 1.0;
+        if (value < 0.0) value = 0.0;
+        image.SetPixelRGB(ix, iy, RNRgb(0.0, value, 1.0 - value));
+      }
+    }
+    if (!image.Write(filename)) return 0;
+  }
+
+  // Print statistics
+  if (verbose) {
+    printf("Wrote grid to %s ...\n", filename);
+    printf("  Time = %.2f seconds\n", start_time.Elapsed());
+    printf("  Resolution = %d %d\n", grid.XResolution(), grid.YResolution());
+    fflush(stdout);
+  }
+
+  // Return success
+  return 1;
+}
@@ -0,0 +1,18 @@
+#ifndef __GRIDFILE__H__
+#define __GRIDFILE__H__
+
+#include "R2Shapes/R2Shapes.h"
+
+// Files written by the batch modes of radiation and radiationbf. Grid point
+// (ix, iy) of an nx by ny field is at world position (x0 + ix * dx,
+// y0 + iy * dy) on the z = 0 plane, and the R2Grid holding the field maps
+// world positions to grid coordinates, so its files carry that placement.
+
+// returns the transformation from world positions to grid coordinates
+R2Affine GridWorldToGrid(RNScalar x0, RNScalar y0, RNScalar dx, RNScalar dy);
+
+// writes the values of grid to filename if its extension is .pfm, .raw or
+//   .grd, and otherwise an image coloring values from 0 (blue) to 1 (green)
+int WriteGridFile(const R2Grid& grid, const char *filename, int verbose);
+
+#endif
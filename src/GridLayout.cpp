@@ -0,0 +1,113 @@
+// Source file for the grid layout
+
+// Include files
+
+#include "GridLayout.h"
+
+
+
+GridLayout::
+GridLayout(void)
+  : type(GRIDLAYOUT_ROWS),
+    nx(0),
+    ny(0),
+    ntx(0),
+    nty(0),
+    nentries(0),
+    nblocks(0),
+    tile_rank(NULL),
+    tile_order(NULL)
+{
+}
+
+
+
+GridLayout::
+~GridLayout(void)
+{
+  if (tile_rank) delete [] tile_rank;
+  if (tile_order) delete [] tile_order;
+}
+
+
+
+// interleaves the bits of x and y, y in the lower bit of each pair
+static unsigned int MortonCode(unsigned int x, unsigned int y)
+{
+  unsigned int code = 0;
+  for (int bit = 0; bit < 16; bit++)
+    code |= (((x >> bit) & 1) << (2 * bit + 1)) | (((y >> bit) & 1) << (2 * bit));
+  return code;
+}
+
+// orders tiles by keys holding the Morton code above the tile index, for qsort
+static int CompareTileKeys(const void *data1, const void *data2)
+{
+  unsigned long long key1 = *((const unsigned long long *) data1);
+  unsigned long long key2 = *((const unsigned long long *) data2);
+  if (key1 < key2) return -1;
+  else if (key1 > key2) return 1;
+  else return 0;
+}
+
+
+
+void GridLayout::
+Setup(int type, int nx, int ny)
+{
+  this->type = type;
+  this->nx = nx;
+  this->ny = ny;
+  if (tile_rank) delete [] tile_rank;
+  if (tile_order) delete [] tile_order;
+  tile_rank = tile_order = NULL;
+  ntx = nty = 0;
+
+  if (type == GRIDLAYOUT_ROWS)
+  {
+    nentries = nx * ny;
+    nblocks = nx;
+    return;
+  }
+
+  // a grid that is not a power of two tiles across leaves gaps in the curve,
+  //   so rank the tiles by their codes instead of using the codes directly
+  ntx = (nx + GRIDLAYOUT_TILE_SIZE - 1) >> GRIDLAYOUT_TILE_SHIFT;
+  nty = (ny + GRIDLAYOUT_TILE_SIZE - 1) >> GRIDLAYOUT_TILE_SHIFT;
+  nblocks = ntx * nty;
+  nentries = nblocks * GRIDLAYOUT_TILE_SIZE * GRIDLAYOUT_TILE_SIZE;
+  unsigned long long *keys = new unsigned long long [nblocks];
+  for (int tx = 0; tx < ntx; tx++)
+    for (int ty = 0; ty < nty; ty++)
+      keys[tx * nty + ty] = ((unsigned long long) MortonCode(tx, ty) << 32) | (tx * nty + ty);
+  qsort(keys, nblocks, sizeof(unsigned long long), CompareTileKeys);
+  tile_rank = new int [nblocks];
+  tile_order = new int [nblocks];
+  for (int rank = 0; rank < nblocks; rank++)
+  {
+    tile_order[rank] = (int) (keys[rank] & 0xFFFFFFFF);
+    tile_rank[tile_order[rank]] = rank;
+  }
+  delete [] keys;
+}
+
+
+
+void GridLayout::
+Block(int k, int *ix0, int *iy0, int *ix1, int *iy1) const
+{
+  if (type == GRIDLAYOUT_ROWS)
+  {
+    *ix0 = k;
+    *ix1 = k + 1;
+    *iy0 = 0;
+    *iy1 = ny;
+    return;
+  }
+
+  int tile = tile_order[k];
+  *ix0 = (tile / nty) << GRIDLAYOUT_TILE_SHIFT;
+  *iy0 = (tile % nty) << GRIDLAYOUT_TILE_SHIFT;
+  *ix1 = (*ix0 + GRIDLAYOUT_TILE_SIZE < nx) ? *ix0 + GRIDLAYOUT_TILE_SIZE : nx;
+  *iy1 = (*iy0 + GRIDLAYOUT_TILE_SIZE < ny) ? *iy0 + GRIDLAYOUT_TILE_SIZE : ny;
+}
@@ -0,0 +1,60 @@
+#ifndef __GRIDLAYOUT__H__
+#define __GRIDLAYOUT__H__
+
+#include "RNBasics/RNBasics.h"
+
+// Grid layouts
+#define GRIDLAYOUT_ROWS 0   // point (ix, iy) stored at ix * ny + iy
+#define GRIDLAYOUT_TILES 1  // square tiles of points, tiles along a Z-curve
+
+// Width of a tile, in grid points (a power of two)
+#define GRIDLAYOUT_TILE_SHIFT 3
+#define GRIDLAYOUT_TILE_SIZE (1 << GRIDLAYOUT_TILE_SHIFT)
+
+// Storage and traversal order of the points of an nx by ny grid. A grid is
+// traversed in blocks: rows in the row layout, and tiles in the tiled layout.
+// Tiles follow a Z-curve (Morton order) over the grid, with the points of a
+// tile stored together like a small row-major grid, so that points visited
+// one after another are close in space as well as in memory. Tiles on the
+// upper edges are padded to full size; padding is never visited, but is part
+// of NEntries so that whole arrays can still be cleared or summed.
+class GridLayout {
+    public:
+        GridLayout(void);
+        ~GridLayout(void);
+
+        // Access functions
+        int Type(void) const { return type; }
+        int NEntries(void) const { return nentries; }
+        int Index(int ix, int iy) const;
+
+        // Traversal functions
+        int NBlocks(void) const { return nblocks; }
+        // sets the points of block k to ix0 <= ix < ix1, iy0 <= iy < iy1
+        void Block(int k, int *ix0, int *iy0, int *ix1, int *iy1) const;
+
+        // Manipulation functions
+        void Setup(int type, int nx, int ny);
+
+    private:
+        int type;
+        int nx, ny;
+        int ntx, nty;
+        int nentries;
+        int nblocks;
+        int *tile_rank;   // rank along the Z-curve of tile (tx, ty), at tx * nty + ty
+        int *tile_order;  // tile at each rank, as tx * nty + ty
+};
+
+
+
+inline int GridLayout::
+Index(int ix, int iy) const
+{
+  if (type == GRIDLAYOUT_ROWS) return ix * ny + iy;
+  int tile = tile_rank[(ix >> GRIDLAYOUT_TILE_SHIFT) * nty + (iy >> GRIDLAYOUT_TILE_SHIFT)];
+  int mask = GRIDLAYOUT_TILE_SIZE - 1;
+  return (((tile << GRIDLAYOUT_TILE_SHIFT) + (ix & mask)) << GRIDLAYOUT_TILE_SHIFT) + (iy & mask);
+}
+
+#endif
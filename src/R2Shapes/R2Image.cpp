@@ -50,7 +50,7 @@ R2Image(int width, int height, int ncomponents)
   pixels = new unsigned char [nbytes];
   assert(pixels);
   unsigned char *p = pixels;
-  while (--nbytes) *(p++) = 0;
+  while (nbytes-- > 0) *(p++) = 0;
 }
 
 
@@ -70,7 +70,7 @@ R2Image(int width, int height, int ncomponents, unsigned char *data)
   pixels = new unsigned char [nbytes];
   assert(pixels);
   unsigned char *p = pixels;
-  while (--nbytes) *(p++) = *(data++);
+  while (nbytes-- > 0) *(p++) = *(data++);
 }
 
 
@@ -89,7 +89,7 @@ R2Image(const R2Image& image)
   assert(pixels);
   unsigned char *p = pixels;
   unsigned char *data = image.pixels;
-  while (--nbytes) *(p++) = *(data++);
+  while (nbytes-- > 0) *(p++) = *(data++);
 }
 
 
@@ -10,6 +10,7 @@
 class R3Scene;
 class R3SceneNode;
 class R3SceneElement;
+class R3SceneQueryContext;
 class R3Model;
 class Radiator;
 
@@ -55,7 +56,9 @@ class Radiator;
 
 /* Scene include files */
 
+#include "R3Graphics/R3SceneQueryContext.h"
 #include "R3Graphics/R3SceneElement.h"
+#include "R3Graphics/R3SceneTree.h"
 #include "R3Graphics/R3SceneNode.h"
 #include "R3Graphics/R3Scene.h"
 
@@ -5,6 +5,11 @@
 /* Include files */
 
 #include "R3Graphics.h"
+#if (RN_OS != RN_WINDOWS)
+#   include <fcntl.h>
+#   include <sys/stat.h>
+#   include <sys/mman.h>
+#endif
 
 /* Member functions */
 
@@ -136,13 +141,27 @@ SetViewer(const R3Viewer& viewer)
 
 
 
+void R3Scene::
+PrepareQueries(void) const
+{
+  // Update bounding boxes and trees that queries would otherwise build on first use
+  for (int i = 0; i < nodes.NEntries(); i++) {
+    R3SceneNode *node = nodes.Kth(i);
+    node->BBox();
+    node->Tree();
+  }
+}
+
+
+
 RNBoolean R3Scene::
 Intersects(const R3Ray& ray, 
   R3SceneNode **hit_node, R3SceneElement **hit_element, R3Shape **hit_shape,
-  R3Point *hit_point, R3Vector *hit_normal, RNScalar *hit_t) const
+  R3Point *hit_point, R3Vector *hit_normal, RNScalar *hit_t,
+  R3SceneQueryContext *context) const
 {
   // Intersect with root node
-  if (!root->Intersects(ray, hit_node, hit_element, hit_shape, hit_point, hit_normal, hit_t)) return FALSE;
+  if (!root->Intersects(ray, hit_node, hit_element, hit_shape, hit_point, hit_normal, hit_t, context)) return FALSE;
 
   // Normalize normal vector
   if (hit_normal) hit_normal->Normalize();
@@ -152,6 +171,71 @@ Intersects(const R3Ray& ray,
 }
 
 
+static int
+CompareIntervals(const void *data1, const void *data2)
+{
+  const R3SceneInterval *interval1 = (const R3SceneInterval *) data1;
+  const R3SceneInterval *interval2 = (const R3SceneInterval *) data2;
+  if (interval1->t1 < interval2->t1) return -1;
+  else if (interval1->t1 > interval2->t1) return 1;
+  else return 0;
+}
+
+
+
+int R3Scene::
+Intervals(const R3Span& span, R3SceneInterval *intervals, int max_intervals,
+  R3SceneQueryContext *context) const
+{
+  // Collect intervals in one traversal from the root
+  int nintervals = root->Intervals(span, intervals, max_intervals, context);
+
+  // Sort the stored intervals along the span
+  int nstored = (nintervals < max_intervals) ? nintervals : max_intervals;
+  qsort(intervals, nstored, sizeof(R3SceneInterval), CompareIntervals);
+
+  // Return number of intervals
+  return nintervals;
+}
+
+
+
+void R3Scene::
+Intervals(int nspans, const R3Span *spans, R3SceneInterval *intervals, int max_intervals, int *nintervals,
+  R3SceneQueryContext *context) const
+{
+  // Use a context of this call only if not given one
+  R3SceneQueryContext call_context;
+  R3SceneQueryContext& query_context = (context) ? *context : call_context;
+  query_context.nqueries += nspans;
+
+  // Collect intervals of each packet of spans in one traversal from the root
+  for (int i = 0; i < nspans; i++) nintervals[i] = 0;
+  for (int first = 0; first < nspans; first += R3_SCENE_TREE_PACKET_SIZE) {
+    int n = nspans - first;
+    if (n > R3_SCENE_TREE_PACKET_SIZE) n = R3_SCENE_TREE_PACKET_SIZE;
+    R3SceneTreePacket packet(n, spans + first);
+    root->Intervals(packet, (1 << n) - 1, intervals + first * max_intervals, max_intervals, nintervals + first, query_context);
+  }
+
+  // Sort the stored intervals of each span along it
+  for (int i = 0; i < nspans; i++) {
+    int nstored = (nintervals[i] < max_intervals) ? nintervals[i] : max_intervals;
+    qsort(intervals + i * max_intervals, nstored, sizeof(R3SceneInterval), CompareIntervals);
+  }
+}
+
+
+
+RNBoolean R3Scene::
+IsOccluded(const R3Span& span, R3SceneQueryContext *context) const
+{
+  // Check from root node
+  return root->Occludes(span, context);
+}
+
+
+
 void R3Scene::
 Draw(const R3DrawFlags draw_flags, RNBoolean set_camera, RNBoolean set_lights) const
 {
@@ -218,6 +302,9 @@ ReadFile(const char *filename)
   else if (!strncmp(extension, ".rct", 4)) {
     if (!ReadRectangleFile(filename)) return 0;
   }
+  else if (!strncmp(extension, ".scb", 4)) {
+    if (!ReadBinaryFile(filename)) return 0;
+  }
   else {
     fprintf(stderr, "Unable to read file %s (unrecognized extension: %s)\n", filename, extension);
     return 0;
@@ -280,6 +367,9 @@ WriteFile(const char *filename) const
   else if (!strncmp(extension, ".obj", 4)) {
     if (!WriteObjFile(filename)) return 0;
   }
+  else if (!strncmp(extension, ".scb", 4)) {
+    if (!WriteBinaryFile(filename)) return 0;
+  }
   else {
     fprintf(stderr, "Unable to write file %s (unrecognized extension: %s)\n", filename, extension);
     return 0;
@@ -911,7 +1001,7 @@ ReadPrinceton(R3Scene *scene, R3SceneNode *node, const char *filename)
       }
 
       // Create source
-      Radiator *source = new Radiator(s, p1);
+      Radiator *source = new Radiator(p1, s);
 
       // Insert into scene
       scene->InsertRadiator(source);
@@ -1860,5 +1950,828 @@ ReadRectangleFile(const char *filename)
 
 
 
+////////////////////////////////////////////////////////////////////////
+// BINARY SCENE FILE I/O FUNCTIONS
+////////////////////////////////////////////////////////////////////////
+
+// A binary scene file (.scb) holds the whole scene flattened into arrays of
+// fixed-size records, so it is read without parsing text or opening included
+// files. Each array starts at an offset from the start of the file (a
+// multiple of 8), and records refer to each other by index, so the file can
+// be mapped anywhere in memory. Nodes are stored parents first, from the root.
+// Numbers are stored as in memory, so files are read only by machines with
+// the same byte order, which the header records.
+
+#define R3_SCENE_BINARY_VERSION 1
+#define R3_SCENE_BINARY_BYTE_ORDER 0x01020304
+
+// Sections of the file
+enum {
+  R3_SCENE_BINARY_TEXTURES,
+  R3_SCENE_BINARY_MATERIALS,
+  R3_SCENE_BINARY_NODES,
+  R3_SCENE_BINARY_ELEMENTS,
+  R3_SCENE_BINARY_SHAPES,
+  R3_SCENE_BINARY_VERTICES,
+  R3_SCENE_BINARY_TRIANGLES,
+  R3_SCENE_BINARY_LIGHTS,
+  R3_SCENE_BINARY_RADIATORS,
+  R3_SCENE_BINARY_PIXELS,
+  R3_SCENE_BINARY_NAMES,
+  R3_SCENE_BINARY_NSECTIONS
+};
+
+// Shape and light types
+enum {
+  R3_SCENE_BINARY_BOX,
+  R3_SCENE_BINARY_SPHERE,
+  R3_SCENE_BINARY_CYLINDER,
+  R3_SCENE_BINARY_CONE,
+  R3_SCENE_BINARY_TRIANGLE,
+  R3_SCENE_BINARY_TRIANGLE_ARRAY
+};
+
+enum {
+  R3_SCENE_BINARY_DIRECTIONAL_LIGHT,
+  R3_SCENE_BINARY_POINT_LIGHT,
+  R3_SCENE_BINARY_SPOT_LIGHT,
+  R3_SCENE_BINARY_AREA_LIGHT
+};
+
+struct R3SceneBinaryHeader {
+  char magic[8];
+  int version;
+  int byte_order;
+  long long file_size;
+  long long offsets[R3_SCENE_BINARY_NSECTIONS];
+  long long counts[R3_SCENE_BINARY_NSECTIONS];  // records, or bytes of pixels and names
+  double camera[13];  // origin, towards, up, xfov, yfov, near, far
+  double ambient[3];
+  double background[3];
+};
+
+struct R3SceneBinaryTexture {
+  int width, height, ncomponents, rowsize;
+  long long pixels;  // offset in pixels section
+};
+
+struct R3SceneBinaryMaterial {
+  double ambient[3], diffuse[3], specular[3], transmission[3], emission[3];
+  double shininess, indexofrefraction;
+  int texture;  // -1 if none
+  int name;     // offset in names section, -1 if none
+};
+
+struct R3SceneBinaryNode {
+  double matrix[16];
+  int mirror;
+  int parent;  // -1 for the root
+  int first_element, nelements;
+  int name;
+};
+
+struct R3SceneBinaryElement {
+  int material;  // -1 if none
+  int first_shape, nshapes;
+};
+
+struct R3SceneBinaryShape {
+  int type;
+  int first_vertex, nvertices;    // triangles and triangle arrays
+  int first_triangle, ntriangles;
+  double data[7];                 // box corners, sphere center and radius, or axis ends and radius
+};
+
+struct R3SceneBinaryVertex {
+  double position[3], normal[3], texcoords[2];
+  unsigned int flags;
+};
+
+struct R3SceneBinaryTriangle {
+  int vertices[3];  // indices from the first vertex of the shape
+};
+
+struct R3SceneBinaryLight {
+  int type, active;
+  double color[3], intensity;
+  double position[3], direction[3];
+  double radius, dropoffrate, cutoffangle;
+  double attenuation[3];  // constant, linear, quadratic
+};
+
+struct R3SceneBinaryRadiator {
+  double position[3], strength;
+};
+
+static const long long R3scene_binary_record_sizes[R3_SCENE_BINARY_NSECTIONS] = {
+  sizeof(R3SceneBinaryTexture), sizeof(R3SceneBinaryMaterial), sizeof(R3SceneBinaryNode),
+  sizeof(R3SceneBinaryElement), sizeof(R3SceneBinaryShape), sizeof(R3SceneBinaryVertex),
+  sizeof(R3SceneBinaryTriangle), sizeof(R3SceneBinaryLight), sizeof(R3SceneBinaryRadiator), 1, 1
+};
+
+static const char R3scene_binary_magic[8] = { 'R', '3', 'S', 'C', 'E', 'N', 'E', '\0' };
+
+
+
+static long long
+BinaryPaddedSize(long long nbytes)
+{
+  // Return nbytes rounded up to a multiple of 8
+  return (nbytes + 7) & ~((long long) 7);
+}
+
+
+
+static int
+FindBinaryIndex(RNArray<const void *>& array, const void *data, RNBoolean insert)
+{
+  // Return index of data in array, inserting it if not there and asked to
+  if (!data) return -1;
+  RNArrayEntry *entry = array.FindEntry(data);
+  if (entry) return array.EntryIndex(entry);
+  if (!insert) return -1;
+  array.Insert(data);
+  return array.NEntries() - 1;
+}
+
+
+
+static int
+InsertBinaryName(char *names, long long& nnames, const char *name)
+{
+  // Copy name to names section, and return its offset
+  if (!name) return -1;
+  int offset = (int) nnames;
+  int length = strlen(name) + 1;
+  if (names) memcpy(names + nnames, name, length);
+  nnames += length;
+  return offset;
+}
+
+
+
+int R3Scene::
+WriteBinaryFile(const char *filename) const
+{
+  // List nodes parents first, from the root, with the index of each parent
+  RNArray<R3SceneNode *> scene_nodes;
+  scene_nodes.Insert(root);
+  for (int i = 0; i < scene_nodes.NEntries(); i++) {
+    R3SceneNode *node = scene_nodes.Kth(i);
+    for (int j = 0; j < node->NChildren(); j++) scene_nodes.Insert(node->Child(j));
+  }
+  int *parents = new int [ scene_nodes.NEntries() ];
+  parents[0] = -1;
+  for (int i = 0, nchildren = 1; i < scene_nodes.NEntries(); i++) {
+    for (int j = 0; j < scene_nodes.Kth(i)->NChildren(); j++) parents[nchildren++] = i;
+  }
+
+  // Count records, and list materials and textures
+  R3SceneBinaryHeader header;
+  memset(&header, 0, sizeof(header));
+  RNArray<const void *> materials, textures;
+  long long nelements = 0, nshapes = 0, nvertices = 0, ntriangles = 0, npixels = 0, nnames = 0;
+  for (int i = 0; i < scene_nodes.NEntries(); i++) {
+    R3SceneNode *node = scene_nodes.Kth(i);
+    InsertBinaryName(NULL, nnames, node->Name());
+    for (int j = 0; j < node->NElements(); j++) {
+      R3SceneElement *element = node->Element(j);
+      R3Material *material = element->Material();
+      if (material && (FindBinaryIndex(materials, material, FALSE) < 0)) {
+        FindBinaryIndex(materials, material, TRUE);
+        InsertBinaryName(NULL, nnames, material->Name());
+        const R2Texture *texture = material->Texture();
+        if (texture && (FindBinaryIndex(textures, texture, FALSE) < 0)) {
+          if (!texture->Image()) {
+            fprintf(stderr, "Unable to write texture without image to %s\n", filename);
+            delete [] parents;
+            return 0;
+          }
+          FindBinaryIndex(textures, texture, TRUE);
+          npixels += BinaryPaddedSize(texture->Image()->RowSize() * texture->Image()->Height());
+        }
+      }
+      for (int k = 0; k < element->NShapes(); k++) {
+        R3Shape *shape = element->Shape(k);
+        if (shape->ClassID() == R3Triangle::CLASS_ID()) {
+          nvertices += 3;
+          ntriangles += 1;
+        }
+        else if (shape->ClassID() == R3TriangleArray::CLASS_ID()) {
+          nvertices += ((R3TriangleArray *) shape)->NVertices();
+          ntriangles += ((R3TriangleArray *) shape)->NTriangles();
+        }
+        else if ((shape->ClassID() != R3Box::CLASS_ID()) && (shape->ClassID() != R3Sphere::CLASS_ID()) &&
+                 (shape->ClassID() != R3Cylinder::CLASS_ID()) && (shape->ClassID() != R3Cone::CLASS_ID())) {
+          fprintf(stderr, "Unable to write shape of class %s to %s\n", shape->ClassName(), filename);
+          delete [] parents;
+          return 0;
+        }
+      }
+      nshapes += element->NShapes();
+    }
+    nelements += node->NElements();
+  }
+  header.counts[R3_SCENE_BINARY_TEXTURES] = textures.NEntries();
+  header.counts[R3_SCENE_BINARY_MATERIALS] = materials.NEntries();
+  header.counts[R3_SCENE_BINARY_NODES] = scene_nodes.NEntries();
+  header.counts[R3_SCENE_BINARY_ELEMENTS] = nelements;
+  header.counts[R3_SCENE_BINARY_SHAPES] = nshapes;
+  header.counts[R3_SCENE_BINARY_VERTICES] = nvertices;
+  header.counts[R3_SCENE_BINARY_TRIANGLES] = ntriangles;
+  header.counts[R3_SCENE_BINARY_LIGHTS] = NLights();
+  header.counts[R3_SCENE_BINARY_RADIATORS] = NRadSources();
+  header.counts[R3_SCENE_BINARY_PIXELS] = npixels;
+  header.counts[R3_SCENE_BINARY_NAMES] = nnames;
+
+  // Fill in header
+  memcpy(header.magic, R3scene_binary_magic, 8);
+  header.version = R3_SCENE_BINARY_VERSION;
+  header.byte_order = R3_SCENE_BINARY_BYTE_ORDER;
+  long long offset = BinaryPaddedSize(sizeof(header));
+  for (int s = 0; s < R3_SCENE_BINARY_NSECTIONS; s++) {
+    header.offsets[s] = offset;
+    offset += BinaryPaddedSize(header.counts[s] * R3scene_binary_record_sizes[s]);
+  }
+  header.file_size = offset;
+  const R3Camera& camera = Camera();
+  double camera_values[13] = {
+    camera.Origin().X(), camera.Origin().Y(), camera.Origin().Z(),
+    camera.Towards().X(), camera.Towards().Y(), camera.Towards().Z(),
+    camera.Up().X(), camera.Up().Y(), camera.Up().Z(),
+    camera.XFOV(), camera.YFOV(), camera.Near(), camera.Far() };
+  memcpy(header.camera, camera_values, sizeof(camera_values));
+  for (int c = 0; c < 3; c++) {
+    header.ambient[c] = ambient[c];
+    header.background[c] = background[c];
+  }
+
+  // Allocate memory for the sections, zeroed so that padding is written as 0
+  char *body = (char *) calloc(header.file_size - header.offsets[0] + 1, 1);
+  if (!body) {
+    fprintf(stderr, "Unable to allocate memory for %s\n", filename);
+    delete [] parents;
+    return 0;
+  }
+  char *sections[R3_SCENE_BINARY_NSECTIONS];
+  for (int s = 0; s < R3_SCENE_BINARY_NSECTIONS; s++)
+    sections[s] = body + (header.offsets[s] - header.offsets[0]);
+  R3SceneBinaryTexture *texture_records = (R3SceneBinaryTexture *) sections[R3_SCENE_BINARY_TEXTURES];
+  R3SceneBinaryMaterial *material_records = (R3SceneBinaryMaterial *) sections[R3_SCENE_BINARY_MATERIALS];
+  R3SceneBinaryNode *node_records = (R3SceneBinaryNode *) sections[R3_SCENE_BINARY_NODES];
+  R3SceneBinaryElement *element_records = (R3SceneBinaryElement *) sections[R3_SCENE_BINARY_ELEMENTS];
+  R3SceneBinaryShape *shape_records = (R3SceneBinaryShape *) sections[R3_SCENE_BINARY_SHAPES];
+  R3SceneBinaryVertex *vertex_records = (R3SceneBinaryVertex *) sections[R3_SCENE_BINARY_VERTICES];
+  R3SceneBinaryTriangle *triangle_records = (R3SceneBinaryTriangle *) sections[R3_SCENE_BINARY_TRIANGLES];
+  R3SceneBinaryLight *light_records = (R3SceneBinaryLight *) sections[R3_SCENE_BINARY_LIGHTS];
+  R3SceneBinaryRadiator *radiator_records = (R3SceneBinaryRadiator *) sections[R3_SCENE_BINARY_RADIATORS];
+  char *pixels = sections[R3_SCENE_BINARY_PIXELS];
+  char *names = sections[R3_SCENE_BINARY_NAMES];
+
+  // Fill in textures
+  npixels = 0;
+  for (int i = 0; i < textures.NEntries(); i++) {
+    const R2Image *image = ((const R2Texture *) textures.Kth(i))->Image();
+    R3SceneBinaryTexture& record = texture_records[i];
+    record.width = image->Width();
+    record.height = image->Height();
+    record.ncomponents = image->NComponents();
+    record.rowsize = image->RowSize();
+    record.pixels = npixels;
+    memcpy(pixels + npixels, image->Pixels(), record.rowsize * record.height);
+    npixels += BinaryPaddedSize(record.rowsize * record.height);
+  }
+
+  // Fill in materials
+  nnames = 0;
+  for (int i = 0; i < materials.NEntries(); i++) {
+    const R3Material *material = (const R3Material *) materials.Kth(i);
+    const R3Brdf *brdf = (material->Brdf()) ? material->Brdf() : &R3default_brdf;
+    R3SceneBinaryMaterial& record = material_records[i];
+    for (int c = 0; c < 3; c++) {
+      record.ambient[c] = brdf->Ambient()[c];
+      record.diffuse[c] = brdf->Diffuse()[c];
+      record.specular[c] = brdf->Specular()[c];
+      record.transmission[c] = brdf->Transmission()[c];
+      record.emission[c] = brdf->Emission()[c];
+    }
+    record.shininess = brdf->Shininess();
+    record.indexofrefraction = brdf->IndexOfRefraction();
+    record.texture = FindBinaryIndex(textures, material->Texture(), FALSE);
+    record.name = InsertBinaryName(names, nnames, material->Name());
+  }
+
+  // Fill in nodes, elements, and shapes
+  nelements = nshapes = nvertices = ntriangles = 0;
+  for (int i = 0; i < scene_nodes.NEntries(); i++) {
+    R3SceneNode *node = scene_nodes.Kth(i);
+    R3SceneBinaryNode& node_record = node_records[i];
+    const R4Matrix& matrix = node->Transformation().Matrix();
+    for (int j = 0; j < 16; j++) node_record.matrix[j] = matrix[j / 4][j % 4];
+    node_record.mirror = node->Transformation().HasMirror();
+    node_record.parent = parents[i];
+    node_record.first_element = nelements;
+    node_record.nelements = node->NElements();
+    node_record.name = InsertBinaryName(names, nnames, node->Name());
+    for (int j = 0; j < node->NElements(); j++) {
+      R3SceneElement *element = node->Element(j);
+      R3SceneBinaryElement& element_record = element_records[nelements++];
+      element_record.material = FindBinaryIndex(materials, element->Material(), FALSE);
+      element_record.first_shape = nshapes;
+      element_record.nshapes = element->NShapes();
+      for (int k = 0; k < element->NShapes(); k++) {
+        R3Shape *shape = element->Shape(k);
+        R3SceneBinaryShape& shape_record = shape_records[nshapes++];
+        shape_record.first_vertex = nvertices;
+        shape_record.first_triangle = ntriangles;
+        if (shape->ClassID() == R3Box::CLASS_ID()) {
+          R3Box *box = (R3Box *) shape;
+          shape_record.type = R3_SCENE_BINARY_BOX;
+          for (int c = 0; c < 3; c++) {
+            shape_record.data[c] = box->Min()[c];
+            shape_record.data[3 + c] = box->Max()[c];
+          }
+        }
+        else if (shape->ClassID() == R3Sphere::CLASS_ID()) {
+          R3Sphere *sphere = (R3Sphere *) shape;
+          shape_record.type = R3_SCENE_BINARY_SPHERE;
+          for (int c = 0; c < 3; c++) shape_record.data[c] = sphere->Center()[c];
+          shape_record.data[3] = sphere->Radius();
+        }
+        else if ((shape->ClassID() == R3Cylinder::CLASS_ID()) || (shape->ClassID() == R3Cone::CLASS_ID())) {
+          RNBoolean cylinder = (shape->ClassID() == R3Cylinder::CLASS_ID());
+          const R3Span& axis = (cylinder) ? ((R3Cylinder *) shape)->Axis() : ((R3Cone *) shape)->Axis();
+          shape_record.type = (cylinder) ? R3_SCENE_BINARY_CYLINDER : R3_SCENE_BINARY_CONE;
+          for (int c = 0; c < 3; c++) {
+            shape_record.data[c] = axis.Start()[c];
+            shape_record.data[3 + c] = axis.End()[c];
+          }
+          shape_record.data[6] = (cylinder) ? ((R3Cylinder *) shape)->Radius() : ((R3Cone *) shape)->Radius();
+        }
+        else {
+          // Triangle, or triangle array
+          RNArray<R3TriangleVertex *> shape_vertices;
+          RNArray<R3Triangle *> shape_triangles;
+          if (shape->ClassID() == R3Triangle::CLASS_ID()) {
+            R3Triangle *triangle = (R3Triangle *) shape;
+            shape_record.type = R3_SCENE_BINARY_TRIANGLE;
+            for (int v = 0; v < 3; v++) shape_vertices.Insert(triangle->Vertex(v));
+            shape_triangles.Insert(triangle);
+          }
+          else {
+            R3TriangleArray *array = (R3TriangleArray *) shape;
+            shape_record.type = R3_SCENE_BINARY_TRIANGLE_ARRAY;
+            for (int v = 0; v < array->NVertices(); v++) shape_vertices.Insert(array->Vertex(v));
+            for (int t = 0; t < array->NTriangles(); t++) shape_triangles.Insert(array->Triangle(t));
+          }
+          for (int v = 0; v < shape_vertices.NEntries(); v++) {
+            R3TriangleVertex *vertex = shape_vertices.Kth(v);
+            R3SceneBinaryVertex& vertex_record = vertex_records[nvertices++];
+            for (int c = 0; c < 3; c++) {
+              vertex_record.position[c] = vertex->Position()[c];
+              vertex_record.normal[c] = vertex->Normal()[c];
+            }
+            vertex_record.texcoords[0] = vertex->TextureCoords()[0];
+            vertex_record.texcoords[1] = vertex->TextureCoords()[1];
+            vertex_record.flags = (unsigned int) (unsigned long) vertex->Flags();
+            vertex->SetMark(v);
+          }
+          for (int t = 0; t < shape_triangles.NEntries(); t++) {
+            R3Triangle *triangle = shape_triangles.Kth(t);
+            R3SceneBinaryTriangle& triangle_record = triangle_records[ntriangles++];
+            for (int v = 0; v < 3; v++) triangle_record.vertices[v] = triangle->Vertex(v)->Mark();
+          }
+          shape_record.nvertices = shape_vertices.NEntries();
+          shape_record.ntriangles = shape_triangles.NEntries();
+        }
+      }
+    }
+  }
+
+  // Fill in lights
+  for (int i = 0; i < NLights(); i++) {
+    R3Light *light = Light(i);
+    R3SceneBinaryLight& record = light_records[i];
+    record.active = light->IsActive();
+    record.intensity = light->Intensity();
+    for (int c = 0; c < 3; c++) record.color[c] = light->Color()[c];
+    record.attenuation[0] = 1;
+    if (light->ClassID() == R3DirectionalLight::CLASS_ID()) {
+      R3DirectionalLight *directional_light = (R3DirectionalLight *) light;
+      record.type = R3_SCENE_BINARY_DIRECTIONAL_LIGHT;
+      for (int c = 0; c < 3; c++) record.direction[c] = directional_light->Direction()[c];
+    }
+    else if ((light->ClassID() == R3PointLight::CLASS_ID()) || (light->ClassID() == R3SpotLight::CLASS_ID())) {
+      R3PointLight *point_light = (R3PointLight *) light;
+      record.type = R3_SCENE_BINARY_POINT_LIGHT;
+      for (int c = 0; c < 3; c++) record.position[c] = point_light->Position()[c];
+      record.attenuation[0] = point_light->ConstantAttenuation();
+      record.attenuation[1] = point_light->LinearAttenuation();
+      record.attenuation[2] = point_light->QuadraticAttenuation();
+      if (light->ClassID() == R3SpotLight::CLASS_ID()) {
+        R3SpotLight *spot_light = (R3SpotLight *) light;
+        record.type = R3_SCENE_BINARY_SPOT_LIGHT;
+        for (int c = 0; c < 3; c++) record.direction[c] = spot_light->Direction()[c];
+        record.dropoffrate = spot_light->DropOffRate();
+        record.cutoffangle = spot_light->CutOffAngle();
+      }
+    }
+    else if (light->ClassID() == R3AreaLight::CLASS_ID()) {
+      R3AreaLight *area_light = (R3AreaLight *) light;
+      record.type = R3_SCENE_BINARY_AREA_LIGHT;
+      for (int c = 0; c < 3; c++) {
+        record.position[c] = area_light->Position()[c];
+        record.direction[c] = area_light->Direction()[c];
+      }
+      record.radius = area_light->Radius();
+      record.attenuation[0] = area_light->ConstantAttenuation();
+      record.attenuation[1] = area_light->LinearAttenuation();
+      record.attenuation[2] = area_light->QuadraticAttenuation();
+    }
+    else {
+      fprintf(stderr, "Unable to write light of class %s to %s\n", light->ClassName(), filename);
+      delete [] parents;
+      free(body);
+      return 0;
+    }
+  }
+
+  // Fill in radiation sources
+  for (int i = 0; i < NRadSources(); i++) {
+    Radiator *source = RadSource(i);
+    R3SceneBinaryRadiator& record = radiator_records[i];
+    for (int c = 0; c < 3; c++) record.position[c] = source->Position()[c];
+    record.strength = source->Strength();
+  }
+
+  // Write file
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open file %s\n", filename);
+    delete [] parents;
+    free(body);
+    return 0;
+  }
+  char padding[8] = { 0 };
+  size_t body_size = header.file_size - header.offsets[0];
+  if ((fwrite(&header, sizeof(header), 1, fp) != 1) ||
+      (fwrite(padding, header.offsets[0] - sizeof(header), 1, fp) > 1) ||
+      (fwrite(body, 1, body_size, fp) != body_size)) {
+    fprintf(stderr, "Unable to write file %s\n", filename);
+    fclose(fp);
+    delete [] parents;
+    free(body);
+    return 0;
+  }
+  fclose(fp);
+
+  // Delete temporary memory
+  delete [] parents;
+  free(body);
+
+  // Return success
+  return 1;
+}
+
+
+
+static const char *
+MapBinaryFile(const char *filename, long long *size)
+{
+  // Map file into memory read-only, or read it on systems without mmap
+#if (RN_OS == RN_WINDOWS)
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) return NULL;
+  fseek(fp, 0, SEEK_END);
+  *size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *data = (char *) malloc(*size + 1);
+  if (data && (fread(data, 1, *size, fp) != (size_t) *size)) { free(data); data = NULL; }
+  fclose(fp);
+  return data;
+#else
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat status;
+  if ((fstat(fd, &status) < 0) || (status.st_size == 0)) { close(fd); return NULL; }
+  *size = status.st_size;
+  void *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  return (data != MAP_FAILED) ? (const char *) data : NULL;
+#endif
+}
+
+
+
+static void
+UnmapBinaryFile(const char *data, long long size)
+{
+  // Release memory of MapBinaryFile
+#if (RN_OS == RN_WINDOWS)
+  free((char *) data);
+#else
+  munmap((void *) data, size);
+#endif
+}
+
+
+
+static int
+CheckBinaryFile(const char *data, long long size, const char *filename)
+{
+  // Check header
+  const R3SceneBinaryHeader *header = (const R3SceneBinaryHeader *) data;
+  if ((size < (long long) sizeof(R3SceneBinaryHeader)) || memcmp(header->magic, R3scene_binary_magic, 8)) {
+    fprintf(stderr, "File %s is not a binary scene file\n", filename);
+    return 0;
+  }
+  if ((header->version != R3_SCENE_BINARY_VERSION) || (header->byte_order != R3_SCENE_BINARY_BYTE_ORDER)) {
+    fprintf(stderr, "Binary scene file %s has version %d, or another byte order\n", filename, header->version);
+    return 0;
+  }
+  if (header->file_size != size) {
+    fprintf(stderr, "Binary scene file %s is truncated\n", filename);
+    return 0;
+  }
+
+  // Check that sections lie within the file
+  for (int s = 0; s < R3_SCENE_BINARY_NSECTIONS; s++) {
+    long long offset = header->offsets[s], count = header->counts[s];
+    if ((offset < (long long) sizeof(R3SceneBinaryHeader)) || (offset % 8) || (count < 0) || (count > INT_MAX) ||
+        (offset + count * R3scene_binary_record_sizes[s] > size)) {
+      fprintf(stderr, "Binary scene file %s has an invalid section %d\n", filename, s);
+      return 0;
+    }
+  }
+
+  // Check that names end within the names section
+  long long nnames = header->counts[R3_SCENE_BINARY_NAMES];
+  if ((nnames > 0) && (data[header->offsets[R3_SCENE_BINARY_NAMES] + nnames - 1] != '\0')) {
+    fprintf(stderr, "Binary scene file %s has invalid names\n", filename);
+    return 0;
+  }
+
+  // Return success
+  return 1;
+}
+
+
+
+static int
+CheckBinaryIndex(long long index, long long first, long long count, const char *filename)
+{
+  // Check that index is in [first, first + count), or print an error
+  if ((index >= first) && (index < first + count)) return 1;
+  fprintf(stderr, "Binary scene file %s has an invalid index %lld\n", filename, index);
+  return 0;
+}
+
+
+
+static int
+CheckBinaryRange(long long first, long long n, long long count, const char *filename)
+{
+  // Check that [first, first + n) is empty or inside [0, count)
+  if (n < 0) return CheckBinaryIndex(n, 0, 1, filename);
+  if (n == 0) return 1;
+  return CheckBinaryIndex(first, 0, count, filename) && CheckBinaryIndex(first + n - 1, 0, count, filename);
+}
+
+
+
+int R3Scene::
+ReadBinaryFile(const char *filename)
+{
+  // Map file
+  long long size = 0;
+  const char *data = MapBinaryFile(filename, &size);
+  if (!data) {
+    fprintf(stderr, "Unable to open file %s\n", filename);
+    return 0;
+  }
+
+  // Check header and sections
+  if (!CheckBinaryFile(data, size, filename)) {
+    UnmapBinaryFile(data, size);
+    return 0;
+  }
+
+  // Get sections
+  const R3SceneBinaryHeader *header = (const R3SceneBinaryHeader *) data;
+  const R3SceneBinaryTexture *texture_records = (const R3SceneBinaryTexture *) (data + header->offsets[R3_SCENE_BINARY_TEXTURES]);
+  const R3SceneBinaryMaterial *material_records = (const R3SceneBinaryMaterial *) (data + header->offsets[R3_SCENE_BINARY_MATERIALS]);
+  const R3SceneBinaryNode *node_records = (const R3SceneBinaryNode *) (data + header->offsets[R3_SCENE_BINARY_NODES]);
+  const R3SceneBinaryElement *element_records = (const R3SceneBinaryElement *) (data + header->offsets[R3_SCENE_BINARY_ELEMENTS]);
+  const R3SceneBinaryShape *shape_records = (const R3SceneBinaryShape *) (data + header->offsets[R3_SCENE_BINARY_SHAPES]);
+  const R3SceneBinaryVertex *vertex_records = (const R3SceneBinaryVertex *) (data + header->offsets[R3_SCENE_BINARY_VERTICES]);
+  const R3SceneBinaryTriangle *triangle_records = (const R3SceneBinaryTriangle *) (data + header->offsets[R3_SCENE_BINARY_TRIANGLES]);
+  const R3SceneBinaryLight *light_records = (const R3SceneBinaryLight *) (data + header->offsets[R3_SCENE_BINARY_LIGHTS]);
+  const R3SceneBinaryRadiator *radiator_records = (const R3SceneBinaryRadiator *) (data + header->offsets[R3_SCENE_BINARY_RADIATORS]);
+  const char *pixels = data + header->offsets[R3_SCENE_BINARY_PIXELS];
+  const char *names = data + header->offsets[R3_SCENE_BINARY_NAMES];
+  int ntextures = header->counts[R3_SCENE_BINARY_TEXTURES];
+  int nmaterials = header->counts[R3_SCENE_BINARY_MATERIALS];
+  int nnodes = header->counts[R3_SCENE_BINARY_NODES];
+  int nelements = header->counts[R3_SCENE_BINARY_ELEMENTS];
+  int nshapes = header->counts[R3_SCENE_BINARY_SHAPES];
+  int nvertices = header->counts[R3_SCENE_BINARY_VERTICES];
+  int ntriangles = header->counts[R3_SCENE_BINARY_TRIANGLES];
+  long long npixels = header->counts[R3_SCENE_BINARY_PIXELS];
+  long long nnames = header->counts[R3_SCENE_BINARY_NAMES];
+
+  // Check indices, so that the scene can be built without further checks
+  int status = (nnodes > 0) && (node_records[0].parent == -1);
+  for (int i = 0; status && (i < ntextures); i++) {
+    const R3SceneBinaryTexture& record = texture_records[i];
+    // R2Image copies rowsize * height bytes with rows padded to 4 bytes
+    long long rowsize = ((long long) record.width * record.ncomponents + 3) / 4 * 4;
+    status = (record.width > 0) && (record.height > 0) && (record.ncomponents > 0) &&
+      (record.rowsize == rowsize) &&
+      CheckBinaryRange(record.pixels, (long long) record.rowsize * record.height, npixels, filename);
+  }
+  for (int i = 0; status && (i < nmaterials); i++) {
+    const R3SceneBinaryMaterial& record = material_records[i];
+    status = CheckBinaryIndex(record.texture, -1, ntextures + 1, filename) &&
+      CheckBinaryIndex(record.name, -1, nnames + 1, filename);
+  }
+  for (int i = 1; status && (i < nnodes); i++)
+    status = CheckBinaryIndex(node_records[i].parent, 0, i, filename);
+  for (int i = 0; status && (i < nnodes); i++) {
+    const R3SceneBinaryNode& record = node_records[i];
+    status = CheckBinaryIndex(record.name, -1, nnames + 1, filename) &&
+      CheckBinaryRange(record.first_element, record.nelements, nelements, filename);
+  }
+  for (int i = 0; status && (i < nelements); i++) {
+    const R3SceneBinaryElement& record = element_records[i];
+    status = CheckBinaryIndex(record.material, -1, nmaterials + 1, filename) &&
+      CheckBinaryRange(record.first_shape, record.nshapes, nshapes, filename);
+  }
+  for (int i = 0; status && (i < nshapes); i++) {
+    const R3SceneBinaryShape& record = shape_records[i];
+    status = CheckBinaryIndex(record.type, R3_SCENE_BINARY_BOX, R3_SCENE_BINARY_TRIANGLE_ARRAY + 1, filename);
+    if (status && (record.type >= R3_SCENE_BINARY_TRIANGLE)) {
+      status = ((record.type == R3_SCENE_BINARY_TRIANGLE_ARRAY) || ((record.nvertices == 3) && (record.ntriangles == 1))) &&
+        CheckBinaryRange(record.first_vertex, record.nvertices, nvertices, filename) &&
+        CheckBinaryRange(record.first_triangle, record.ntriangles, ntriangles, filename);
+      for (int t = 0; status && (t < record.ntriangles); t++) {
+        for (int v = 0; status && (v < 3); v++)
+          status = CheckBinaryIndex(triangle_records[record.first_triangle + t].vertices[v], 0, record.nvertices, filename);
+      }
+    }
+  }
+  if (!status) {
+    fprintf(stderr, "Invalid binary scene file %s\n", filename);
+    UnmapBinaryFile(data, size);
+    return 0;
+  }
+
+  // Create textures
+  R2Texture **textures = new R2Texture * [ ntextures + 1 ];
+  for (int i = 0; i < ntextures; i++) {
+    const R3SceneBinaryTexture& record = texture_records[i];
+    R2Image *image = new R2Image(record.width, record.height, record.ncomponents, (unsigned char *) (pixels + record.pixels));
+    textures[i] = new R2Texture(image);
+  }
+
+  // Create materials
+  R3Material **materials = new R3Material * [ nmaterials + 1 ];
+  for (int i = 0; i < nmaterials; i++) {
+    const R3SceneBinaryMaterial& record = material_records[i];
+    RNRgb ka(record.ambient), kd(record.diffuse), ks(record.specular), kt(record.transmission), e(record.emission);
+    R3Brdf *brdf = new R3Brdf(ka, kd, ks, kt, e, record.shininess, record.indexofrefraction);
+    R2Texture *texture = (record.texture >= 0) ? textures[record.texture] : NULL;
+    materials[i] = new R3Material(brdf, texture, (record.name >= 0) ? names + record.name : NULL);
+  }
+
+  // Create vertices and triangles, in one block each (the scene keeps its
+  // shapes for its whole life)
+  R3TriangleVertex *vertices = new R3TriangleVertex [ nvertices + 1 ];
+  for (int i = 0; i < nvertices; i++) {
+    const R3SceneBinaryVertex& record = vertex_records[i];
+    R3TriangleVertex& vertex = vertices[i];
+    vertex.position.Reset(record.position[0], record.position[1], record.position[2]);
+    vertex.normal.Reset(record.normal[0], record.normal[1], record.normal[2]);
+    vertex.texcoords.Reset(record.texcoords[0], record.texcoords[1]);
+    vertex.flags = RNFlags(record.flags);
+  }
+  R3Triangle *triangles = new R3Triangle [ ntriangles + 1 ];
+
+  // Create other shapes, in one block per type
+  int ntypes[R3_SCENE_BINARY_TRIANGLE_ARRAY + 1] = { 0 };
+  for (int i = 0; i < nshapes; i++) ntypes[shape_records[i].type]++;
+  R3Box *boxes = new R3Box [ ntypes[R3_SCENE_BINARY_BOX] + 1 ];
+  R3Sphere *spheres = new R3Sphere [ ntypes[R3_SCENE_BINARY_SPHERE] + 1 ];
+  R3Cylinder *cylinders = new R3Cylinder [ ntypes[R3_SCENE_BINARY_CYLINDER] + 1 ];
+  R3Cone *cones = new R3Cone [ ntypes[R3_SCENE_BINARY_CONE] + 1 ];
+  R3Shape **shapes = new R3Shape * [ nshapes + 1 ];
+  int nboxes = 0, nspheres = 0, ncylinders = 0, ncones = 0;
+  for (int i = 0; i < nshapes; i++) {
+    const R3SceneBinaryShape& record = shape_records[i];
+    R3Point p1(record.data[0], record.data[1], record.data[2]);
+    R3Point p2(record.data[3], record.data[4], record.data[5]);
+    if (record.type == R3_SCENE_BINARY_BOX) {
+      boxes[nboxes] = R3Box(p1, p2);
+      shapes[i] = &boxes[nboxes++];
+    }
+    else if (record.type == R3_SCENE_BINARY_SPHERE) {
+      spheres[nspheres] = R3Sphere(p1, record.data[3]);
+      shapes[i] = &spheres[nspheres++];
+    }
+    else if (record.type == R3_SCENE_BINARY_CYLINDER) {
+      cylinders[ncylinders] = R3Cylinder(p1, p2, record.data[6]);
+      shapes[i] = &cylinders[ncylinders++];
+    }
+    else if (record.type == R3_SCENE_BINARY_CONE) {
+      cones[ncones] = R3Cone(p1, p2, record.data[6]);
+      shapes[i] = &cones[ncones++];
+    }
+    else {
+      R3TriangleVertex *shape_vertices = vertices + record.first_vertex;
+      for (int t = record.first_triangle; t < record.first_triangle + record.ntriangles; t++) {
+        const int *v = triangle_records[t].vertices;
+        triangles[t].Reset(&shape_vertices[v[0]], &shape_vertices[v[1]], &shape_vertices[v[2]]);
+      }
+      if (record.type == R3_SCENE_BINARY_TRIANGLE) {
+        shapes[i] = &triangles[record.first_triangle];
+      }
+      else {
+        RNArray<R3TriangleVertex *> array_vertices;
+        RNArray<R3Triangle *> array_triangles;
+        for (int v = 0; v < record.nvertices; v++) array_vertices.Insert(&shape_vertices[v]);
+        for (int t = 0; t < record.ntriangles; t++) array_triangles.Insert(&triangles[record.first_triangle + t]);
+        shapes[i] = new R3TriangleArray(array_vertices, array_triangles);
+      }
+    }
+  }
+
+  // Create elements
+  R3SceneElement *elements = new R3SceneElement [ nelements + 1 ];
+  for (int i = 0; i < nelements; i++) {
+    const R3SceneBinaryElement& record = element_records[i];
+    R3SceneElement *element = &elements[i];
+    if (record.material >= 0) element->SetMaterial(materials[record.material]);
+    for (int k = record.first_shape; k < record.first_shape + record.nshapes; k++)
+      element->InsertShape(shapes[k]);
+  }
+
+  // Create nodes, with the first as the root
+  R3SceneNode **nodes = new R3SceneNode * [ nnodes ];
+  for (int i = 0; i < nnodes; i++) {
+    const R3SceneBinaryNode& record = node_records[i];
+    R3SceneNode *node = (i == 0) ? root : new R3SceneNode(this);
+    if (i > 0) nodes[record.parent]->InsertChild(node);
+    R3Affine transformation(R4Matrix(record.matrix), record.mirror);
+    if (!transformation.IsIdentity()) node->SetTransformation(transformation);
+    if (record.name >= 0) node->SetName(names + record.name);
+    for (int j = record.first_element; j < record.first_element + record.nelements; j++)
+      node->InsertElement(&elements[j]);
+    nodes[i] = node;
+  }
+
+  // Create lights
+  for (int i = 0; i < (int) header->counts[R3_SCENE_BINARY_LIGHTS]; i++) {
+    const R3SceneBinaryLight& record = light_records[i];
+    RNRgb color(record.color);
+    R3Point position(record.position[0], record.position[1], record.position[2]);
+    R3Vector direction(record.direction[0], record.direction[1], record.direction[2]);
+    const double *a = record.attenuation;
+    R3Light *light = NULL;
+    if (record.type == R3_SCENE_BINARY_DIRECTIONAL_LIGHT)
+      light = new R3DirectionalLight(direction, color, record.intensity, record.active);
+    else if (record.type == R3_SCENE_BINARY_POINT_LIGHT)
+      light = new R3PointLight(position, color, record.intensity, record.active, a[0], a[1], a[2]);
+    else if (record.type == R3_SCENE_BINARY_SPOT_LIGHT)
+      light = new R3SpotLight(position, direction, color, record.dropoffrate, record.cutoffangle, record.intensity, record.active, a[0], a[1], a[2]);
+    else if (record.type == R3_SCENE_BINARY_AREA_LIGHT)
+      light = new R3AreaLight(position, record.radius, direction, color, record.intensity, record.active, a[0], a[1], a[2]);
+    if (light) InsertLight(light);
+  }
+
+  // Create radiation sources
+  for (int i = 0; i < (int) header->counts[R3_SCENE_BINARY_RADIATORS]; i++) {
+    const R3SceneBinaryRadiator& record = radiator_records[i];
+    R3Point position(record.position[0], record.position[1], record.position[2]);
+    InsertRadiator(new Radiator(position, record.strength));
+  }
+
+  // Set camera and colors
+  const double *c = header->camera;
+  SetCamera(R3Camera(R3Point(c[0], c[1], c[2]), R3Vector(c[3], c[4], c[5]), R3Vector(c[6], c[7], c[8]), c[9], c[10], c[11], c[12]));
+  SetAmbient(RNRgb(header->ambient));
+  SetBackground(RNRgb(header->background));
+
+  // Delete temporary memory
+  delete [] textures;
+  delete [] materials;
+  delete [] shapes;
+  delete [] nodes;
+  UnmapBinaryFile(data, size);
+
+  // Return success
+  return 1;
+}
+
+
+
 
 
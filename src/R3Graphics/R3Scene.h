@@ -48,10 +48,28 @@ public:
   void SetAmbient(const RNRgb& ambient);
   void SetBackground(const RNRgb& background);
 
+  // Query preparation functions (builds every bounding box and node tree, after
+  //   which queries only read the scene, and can run from several threads at once)
+  void PrepareQueries(void) const;
+
   // Ray intersection functions
   RNBoolean Intersects(const R3Ray& ray, 
     R3SceneNode **hit_node = NULL, R3SceneElement **hit_element = NULL, R3Shape **hit_shape = NULL,
-    R3Point *hit_point = NULL, R3Vector *hit_normal = NULL, RNScalar *hit_t = NULL) const;
+    R3Point *hit_point = NULL, R3Vector *hit_normal = NULL, RNScalar *hit_t = NULL,
+    R3SceneQueryContext *context = NULL) const;
+
+  // Segment interval functions (returns number of intervals, of which the first
+  //   max_intervals are stored sorted by t1; call again with more room if larger)
+  int Intervals(const R3Span& span, R3SceneInterval *intervals, int max_intervals,
+    R3SceneQueryContext *context = NULL) const;
+  // (same for many spans, traversed in packets of neighbouring spans; intervals of
+  //   span k are stored from intervals[k * max_intervals], and counted in nintervals[k])
+  void Intervals(int nspans, const R3Span *spans, R3SceneInterval *intervals, int max_intervals, int *nintervals,
+    R3SceneQueryContext *context = NULL) const;
+
+  // Occlusion functions (returns whether any opaque shape blocks span, stopping
+  //   at the first found, so it is faster than finding the closest hit)
+  RNBoolean IsOccluded(const R3Span& span, R3SceneQueryContext *context = NULL) const;
 
   // I/O functions
   int ReadFile(const char *filename);
@@ -62,12 +80,14 @@ public:
   int ReadSupportHierarchyFile(const char *filename);
   int ReadGrammarHierarchyFile(const char *filename);
   int ReadRectangleFile(const char *filename);
+  int ReadBinaryFile(const char *filename);
   int WriteFile(const char *filename) const;
   int WriteObjFile(const char *filename) const;
   int WritePrincetonFile(const char *filename) const;
   int WriteParseFile(const char *filename) const;
   int WriteSupportHierarchyFile(const char *filename) const;
   int WriteGrammarHierarchyFile(const char *filename) const;
+  int WriteBinaryFile(const char *filename) const;
 
   // Draw functions
   void Draw(const R3DrawFlags draw_flags = R3_DEFAULT_DRAW_FLAGS,
@@ -49,8 +49,9 @@ InsertShape(R3Shape *shape)
   // Insert shape
   shapes.Insert(shape);
 
-  // Invalidate bounding box
+  // Invalidate bounding box and node's tree
   InvalidateBBox();
+  if (node) node->InvalidateTree();
 }
 
 
@@ -61,8 +62,9 @@ RemoveShape(R3Shape *shape)
   // Remove shape
   shapes.Remove(shape);
 
-  // Invalidate bounding box
+  // Invalidate bounding box and node's tree
   InvalidateBBox();
+  if (node) node->InvalidateTree();
 }
 
 
@@ -97,6 +99,292 @@ Intersects(const R3Ray& ray, R3Shape **hit_shape,
 
 
 
+static int
+AddInterval(R3SceneInterval *intervals, int max_intervals, int nintervals, RNScalar t1, RNScalar t2)
+{
+  // Store interval if there is room, and count it either way
+  if (nintervals < max_intervals) {
+    intervals[nintervals].t1 = t1;
+    intervals[nintervals].t2 = t2;
+  }
+  return nintervals + 1;
+}
+
+
+
+static int
+SpanBoxIntervals(const R3Box& box, const R3Point& p1, const R3Point& p2, 
+  R3SceneInterval *intervals, int max_intervals)
+{
+  // Clip parameters against slabs
+  RNScalar lo = 0, hi = 1;
+  for (RNDimension dim = RN_X; dim <= RN_Z; dim++) {
+    RNScalar d = p2[dim] - p1[dim];
+    if (d == 0) {
+      if ((p1[dim] < box.Min()[dim]) || (p1[dim] > box.Max()[dim])) return 0;
+      continue;
+    }
+    RNScalar ta = (box.Min()[dim] - p1[dim]) / d;
+    RNScalar tb = (box.Max()[dim] - p1[dim]) / d;
+    if (ta > tb) { RNScalar swap = ta; ta = tb; tb = swap; }
+    if (ta > lo) lo = ta;
+    if (tb < hi) hi = tb;
+  }
+
+  // Return interval
+  if (hi <= lo) return 0;
+  return AddInterval(intervals, max_intervals, 0, lo, hi);
+}
+
+
+
+static int
+QuadraticIntervals(RNScalar a, RNScalar b, RNScalar c, RNScalar lo, RNScalar hi, 
+  R3SceneInterval *intervals, int max_intervals)
+{
+  // Find where a t^2 + b t + c <= 0, as up to two intervals (+-RN_INFINITY if unbounded)
+  RNScalar t[4];
+  int n = 0;
+  RNScalar disc = b * b - 4 * a * c;
+  if (a == 0) {
+    if (b > 0) { t[0] = -RN_INFINITY; t[1] = -c / b; n = 2; }
+    else if (b < 0) { t[0] = -c / b; t[1] = RN_INFINITY; n = 2; }
+    else if (c <= 0) { t[0] = -RN_INFINITY; t[1] = RN_INFINITY; n = 2; }
+  }
+  else if (disc <= 0) {
+    if (a < 0) { t[0] = -RN_INFINITY; t[1] = RN_INFINITY; n = 2; }
+  }
+  else {
+    // Stable roots
+    RNScalar q = (b < 0) ? -0.5 * (b - sqrt(disc)) : -0.5 * (b + sqrt(disc));
+    RNScalar r1 = q / a, r2 = (q != 0) ? c / q : r1;
+    if (r1 > r2) { RNScalar swap = r1; r1 = r2; r2 = swap; }
+    if (a > 0) { t[0] = r1; t[1] = r2; n = 2; }
+    else { t[0] = -RN_INFINITY; t[1] = r1; t[2] = r2; t[3] = RN_INFINITY; n = 4; }
+  }
+
+  // Clip to [lo, hi]
+  int nintervals = 0;
+  for (int k = 0; k < n; k += 2) {
+    RNScalar t1 = (t[k] > lo) ? t[k] : lo;
+    RNScalar t2 = (t[k+1] < hi) ? t[k+1] : hi;
+    if (t2 > t1) nintervals = AddInterval(intervals, max_intervals, nintervals, t1, t2);
+  }
+  return nintervals;
+}
+
+
+
+static int
+SpanSphereIntervals(const R3Sphere& sphere, const R3Point& p1, const R3Point& p2, 
+  R3SceneInterval *intervals, int max_intervals)
+{
+  // Solve |p1 + t (p2 - p1) - center|^2 <= radius^2
+  R3Vector d = p2 - p1;
+  R3Vector e = p1 - sphere.Center();
+  RNScalar a = d.Dot(d);
+  RNScalar b = 2 * d.Dot(e);
+  RNScalar c = e.Dot(e) - sphere.Radius() * sphere.Radius();
+  return QuadraticIntervals(a, b, c, 0, 1, intervals, max_intervals);
+}
+
+
+
+static int
+SpanAxisIntervals(const R3Span& axis, RNLength radius, RNBoolean cone, const R3Point& p1, const R3Point& p2, 
+  R3SceneInterval *intervals, int max_intervals)
+{
+  // Height along the axis, h(t) = he + t hd, must be in [0, length]
+  const R3Vector& v = axis.Vector();
+  RNLength length = axis.Length();
+  if (length == 0) return 0;
+  R3Vector d = p2 - p1;
+  R3Vector e = p1 - axis.Start();
+  RNScalar hd = d.Dot(v), he = e.Dot(v);
+  RNScalar lo = 0, hi = 1;
+  if (hd == 0) {
+    if ((he < 0) || (he > length)) return 0;
+  }
+  else {
+    RNScalar ta = -he / hd, tb = (length - he) / hd;
+    if (ta > tb) { RNScalar swap = ta; ta = tb; tb = swap; }
+    if (ta > lo) lo = ta;
+    if (tb < hi) hi = tb;
+    if (hi <= lo) return 0;
+  }
+
+  // Distance from the axis must be at most the radius at that height,
+  //   k0 + t k1 (constant for a cylinder, shrinking to the apex for a cone)
+  R3Vector dr = d - hd * v;
+  R3Vector er = e - he * v;
+  RNScalar k0 = (cone) ? radius * (1 - he / length) : radius;
+  RNScalar k1 = (cone) ? -radius * hd / length : 0;
+  RNScalar a = dr.Dot(dr) - k1 * k1;
+  RNScalar b = 2 * (dr.Dot(er) - k0 * k1);
+  RNScalar c = er.Dot(er) - k0 * k0;
+  return QuadraticIntervals(a, b, c, lo, hi, intervals, max_intervals);
+}
+
+
+
+static int
+CompareScalars(const void *data1, const void *data2)
+{
+  RNScalar t1 = *((const RNScalar *) data1);
+  RNScalar t2 = *((const RNScalar *) data2);
+  if (t1 < t2) return -1;
+  else if (t1 > t2) return 1;
+  else return 0;
+}
+
+
+
+static int
+SpanTriangleArrayIntervals(const R3TriangleArray& array, const R3Point& p1, const R3Point& p2, 
+  R3SceneInterval *intervals, int max_intervals)
+{
+  // Collect crossings of the closed surface along the whole ray
+  RNLength length = R3Distance(p1, p2);
+  if (length == 0) return 0;
+  R3Ray ray(p1, p2);
+  RNScalar buffer[64];
+  RNScalar *crossings = buffer;
+  int ncrossings = 0, nallocated = 64;
+  for (int i = 0; i < array.NTriangles(); i++) {
+    RNScalar t;
+    if (!R3Intersects(ray, *(array.Triangle(i)), NULL, NULL, &t)) continue;
+    if (ncrossings == nallocated) {
+      RNScalar *grown = new RNScalar [2 * nallocated];
+      for (int k = 0; k < ncrossings; k++) grown[k] = crossings[k];
+      if (crossings != buffer) delete [] crossings;
+      crossings = grown;
+      nallocated *= 2;
+    }
+    crossings[ncrossings++] = t / length;
+  }
+
+  // Merge crossings of an edge shared by two triangles
+  qsort(crossings, ncrossings, sizeof(RNScalar), CompareScalars);
+  int nunique = 0;
+  for (int i = 0; i < ncrossings; i++) {
+    if ((nunique > 0) && (crossings[i] - crossings[nunique-1] < RN_EPSILON / length)) continue;
+    crossings[nunique++] = crossings[i];
+  }
+
+  // The start is inside if the ray crosses an odd number of times
+  int nintervals = 0;
+  RNBoolean inside = (nunique % 2) ? TRUE : FALSE;
+  RNScalar previous = 0;
+  for (int i = 0; (i < nunique) && (previous < 1); i++) {
+    RNScalar t = (crossings[i] < 1) ? crossings[i] : 1;
+    if (inside && (t > previous)) nintervals = AddInterval(intervals, max_intervals, nintervals, previous, t);
+    inside = !inside;
+    previous = t;
+  }
+  if (inside && (previous < 1)) nintervals = AddInterval(intervals, max_intervals, nintervals, previous, 1);
+
+  // Return number of intervals
+  if (crossings != buffer) delete [] crossings;
+  return nintervals;
+}
+
+
+
+int R3SceneElement::
+ShapeIntervals(int k, const R3Span& span, R3SceneInterval *intervals, int max_intervals) const
+{
+  // Compute intervals of kth shape (triangles have no volume and add none)
+  const R3Point& p1 = span.Start();
+  const R3Point& p2 = span.End();
+  R3Shape *shape = Shape(k);
+  int n = 0;
+  if (shape->ClassID() == R3Box::CLASS_ID()) 
+    n = SpanBoxIntervals(*((R3Box *) shape), p1, p2, intervals, max_intervals);
+  else if (shape->ClassID() == R3Sphere::CLASS_ID()) 
+    n = SpanSphereIntervals(*((R3Sphere *) shape), p1, p2, intervals, max_intervals);
+  else if (shape->ClassID() == R3Cylinder::CLASS_ID()) 
+    n = SpanAxisIntervals(((R3Cylinder *) shape)->Axis(), ((R3Cylinder *) shape)->Radius(), FALSE, p1, p2, intervals, max_intervals);
+  else if (shape->ClassID() == R3Cone::CLASS_ID()) 
+    n = SpanAxisIntervals(((R3Cone *) shape)->Axis(), ((R3Cone *) shape)->Radius(), TRUE, p1, p2, intervals, max_intervals);
+  else if (shape->ClassID() == R3TriangleArray::CLASS_ID()) 
+    n = SpanTriangleArrayIntervals(*((R3TriangleArray *) shape), p1, p2, intervals, max_intervals);
+
+  // Fill in element
+  for (int i = 0; (i < n) && (i < max_intervals); i++)
+    intervals[i].element = (R3SceneElement *) this;
+
+  // Return number of intervals
+  return n;
+}
+
+
+
+int R3SceneElement::
+Intervals(const R3Span& span, R3SceneInterval *intervals, int max_intervals) const
+{
+  // Collect intervals of all shapes
+  int nintervals = 0;
+  for (int i = 0; i < NShapes(); i++) {
+    int room = (nintervals < max_intervals) ? max_intervals - nintervals : 0;
+    nintervals += ShapeIntervals(i, span, intervals + max_intervals - room, room);
+  }
+
+  // Return number of intervals
+  return nintervals;
+}
+
+
+
+RNBoolean R3SceneElement::
+ShapeOccludes(int k, const R3Span& span) const
+{
+  // Check material
+  if (material && material->IsTransparent()) return FALSE;
+
+  // Check whether span passes through kth shape, without computing hit points
+  const R3Point& p1 = span.Start();
+  const R3Point& p2 = span.End();
+  R3Shape *shape = Shape(k);
+  R3SceneInterval interval;
+  if (shape->ClassID() == R3Box::CLASS_ID()) 
+    return (SpanBoxIntervals(*((R3Box *) shape), p1, p2, &interval, 1) > 0);
+  else if (shape->ClassID() == R3Sphere::CLASS_ID()) 
+    return (SpanSphereIntervals(*((R3Sphere *) shape), p1, p2, &interval, 1) > 0);
+  else if (shape->ClassID() == R3Cylinder::CLASS_ID()) 
+    return (SpanAxisIntervals(((R3Cylinder *) shape)->Axis(), ((R3Cylinder *) shape)->Radius(), FALSE, p1, p2, &interval, 1) > 0);
+  else if (shape->ClassID() == R3Cone::CLASS_ID()) 
+    return (SpanAxisIntervals(((R3Cone *) shape)->Axis(), ((R3Cone *) shape)->Radius(), TRUE, p1, p2, &interval, 1) > 0);
+
+  // Check whether span crosses any triangle of a mesh, stopping at the first
+  RNScalar t;
+  if (shape->ClassID() == R3TriangleArray::CLASS_ID()) {
+    const R3TriangleArray *array = (R3TriangleArray *) shape;
+    for (int i = 0; i < array->NTriangles(); i++) {
+      if (R3Intersects(span.Ray(), *(array->Triangle(i)), NULL, NULL, &t) && (t <= span.Length())) return TRUE;
+    }
+    return FALSE;
+  }
+
+  // Check whether span crosses any other shape
+  return (shape->Intersects(span.Ray(), NULL, NULL, &t) && (t <= span.Length()));
+}
+
+
+
+RNBoolean R3SceneElement::
+Occludes(const R3Span& span) const
+{
+  // Check shapes until one blocks span
+  for (int i = 0; i < NShapes(); i++) {
+    if (ShapeOccludes(i, span)) return TRUE;
+  }
+
+  // Return not occluded
+  return FALSE;
+}
+
+
+
 void R3SceneElement::
 Draw(const R3DrawFlags draw_flags) const
 {
@@ -4,6 +4,14 @@
 
 /* Class definitions */
 
+// Part of a segment inside a solid, as parameters from 0 at the start to 1
+// at the end (unchanged by affine transformations), and the element whose
+// material fills it
+struct R3SceneInterval {
+  RNScalar t1, t2;
+  class R3SceneElement *element;
+};
+
 class R3SceneElement {
 public:
   // Constructor functions
@@ -29,6 +37,15 @@ public:
   RNBoolean Intersects(const R3Ray& ray, R3Shape **hit_shape = NULL,
     R3Point *hit_point = NULL, R3Vector *hit_normal = NULL, RNScalar *hit_t = NULL) const;
 
+  // Segment interval functions
+  int Intervals(const R3Span& span, R3SceneInterval *intervals, int max_intervals) const;
+  int ShapeIntervals(int k, const R3Span& span, R3SceneInterval *intervals, int max_intervals) const;
+
+  // Occlusion functions (whether span passes through a shape, unless the
+  //   material is transparent; solids block it inside, meshes where it crosses)
+  RNBoolean Occludes(const R3Span& span) const;
+  RNBoolean ShapeOccludes(int k, const R3Span& span) const;
+
   // Draw functions
   void Draw(const R3DrawFlags draw_flags = R3_DEFAULT_DRAW_FLAGS) const;
 
@@ -12,6 +12,24 @@
 
 
 
+////////////////////////////////////////////////////////////////////////
+// PRIVATE VARIABLES
+////////////////////////////////////////////////////////////////////////
+
+// Nodes with fewer elements' shapes and children than this are searched
+// linearly, without building a tree
+static const int R3_SCENE_NODE_MIN_TREE_ITEMS = 8;
+
+// Tree states
+#define R3_SCENE_NODE_TREE_VALID   0
+#define R3_SCENE_NODE_TREE_REFIT   1
+#define R3_SCENE_NODE_TREE_REBUILD 2
+
+// Ray queries made from outside the node traversal (when profiling)
+static RNProfileCounter R3scene_node_intersects("R3SceneNode::Intersects");
+
+
+
 ////////////////////////////////////////////////////////////////////////
 // PKG INITIALIZATION FUNCTIONS
 ////////////////////////////////////////////////////////////////////////
@@ -45,9 +63,12 @@ R3SceneNode(R3Scene *scene)
     children(),
     elements(),
     transformation(R3identity_affine),
+    identity(TRUE),
     bbox(FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX),
     name(NULL),
-    data(NULL)
+    data(NULL),
+    tree(NULL),
+    tree_state(R3_SCENE_NODE_TREE_REBUILD)
 {
   // Insert node into scene
   if (scene) {
@@ -84,6 +105,9 @@ R3SceneNode::
 
   // Delete name
   if (name) free(name);
+
+  // Delete tree
+  if (tree) delete tree;
 }
 
 
@@ -102,8 +126,9 @@ InsertChild(R3SceneNode *node)
   node->parent_index = children.NEntries();
   children.Insert(node);
 
-  // Invalidate bounding box
+  // Invalidate bounding box and tree
   InvalidateBBox();
+  InvalidateTree();
 }
 
 
@@ -122,8 +147,9 @@ RemoveChild(R3SceneNode *node)
   node->parent = NULL;
   node->parent_index = -1;
 
-  // Invalidate bounding box
+  // Invalidate bounding box and tree
   InvalidateBBox();
+  InvalidateTree();
 }
 
 
@@ -138,8 +164,9 @@ InsertElement(R3SceneElement *element)
   // Insert element
   elements.Insert(element);
 
-  // Invalidate bounding box
+  // Invalidate bounding box and tree
   InvalidateBBox();
+  InvalidateTree();
 }
 
 
@@ -154,8 +181,9 @@ RemoveElement(R3SceneElement *element)
   // Remove element
   elements.Remove(element);
 
-  // Invalidate bounding box
+  // Invalidate bounding box and tree
   InvalidateBBox();
+  InvalidateTree();
 }
 
 
@@ -166,6 +194,10 @@ SetTransformation(const R3Affine& transformation)
   // Set transformation
   this->transformation = transformation;
 
+  // Remember whether it is the identity, and compute its inverse now rather than in queries
+  identity = transformation.IsIdentity();
+  this->transformation.InverseMatrix();
+
   // Invalidate bounding box
   InvalidateBBox();
 }
@@ -192,13 +224,81 @@ SetData(void *data)
 
 
 
+// Closest hit found so far while walking a node's tree
+struct R3SceneNodeHit {
+  const R3Ray *ray;
+  const R3SceneTreeRay *tree_ray;
+  R3SceneQueryContext *context;
+  R3SceneNode *node;
+  R3SceneElement *element;
+  R3Shape *shape;
+  R3Point point;
+  R3Vector normal;
+};
+
+
+
+static RNBoolean
+IntersectItem(const R3SceneTreeItem& item, RNScalar *closest_t, void *data)
+{
+  // Intersect ray with shape or child node, keeping the closer hit
+  R3SceneNodeHit *hit = (R3SceneNodeHit *) data;
+  R3SceneNode *node;
+  R3SceneElement *element;
+  R3Shape *shape;
+  R3Point point;
+  R3Vector normal;
+  RNScalar t;
+  if (item.child) {
+    if (!item.child->Intersects(*(hit->ray), *(hit->tree_ray), &node, &element, &shape, &point, &normal, &t, *(hit->context))) return TRUE;
+  }
+  else {
+    hit->context->nshapes++;
+    element = item.element;
+    node = element->Node();
+    shape = element->Shape(item.shape_index);
+    if (!shape->Intersects(*(hit->ray), &point, &normal, &t)) return TRUE;
+  }
+  if (t < *closest_t) {
+    hit->node = node;
+    hit->element = element;
+    hit->shape = shape;
+    hit->point = point;
+    hit->normal = normal;
+    *closest_t = t;
+  }
+  return TRUE;
+}
+
+
+
 RNBoolean R3SceneNode::
 Intersects(const R3Ray& ray, 
   R3SceneNode **hit_node, R3SceneElement **hit_element, R3Shape **hit_shape,
-  R3Point *hit_point, R3Vector *hit_normal, RNScalar *hit_t) const
+  R3Point *hit_point, R3Vector *hit_normal, RNScalar *hit_t,
+  R3SceneQueryContext *context) const
+{
+  // Use a context of this call only if not given one
+  R3SceneQueryContext call_context;
+  R3SceneQueryContext& query_context = (context) ? *context : call_context;
+  query_context.nqueries++;
+  R3scene_node_intersects.Add();
+
+  // Prepare ray for box tests once for the whole traversal
+  return Intersects(ray, R3SceneTreeRay(ray), hit_node, hit_element, hit_shape, hit_point, hit_normal, hit_t, query_context);
+}
+
+
+
+RNBoolean R3SceneNode::
+Intersects(const R3Ray& ray, const R3SceneTreeRay& tree_ray,
+  R3SceneNode **hit_node, R3SceneElement **hit_element, R3Shape **hit_shape,
+  R3Point *hit_point, R3Vector *hit_normal, RNScalar *hit_t, R3SceneQueryContext& context) const
 {
   // Check if ray intersects bounding box
-  if (!R3Intersects(ray, BBox())) return FALSE;
+  RNScalar t;
+  context.nnodes++;
+  if (!tree_ray.Enters(BBox(), FLT_MAX, &t)) return FALSE;
 
   // Temporary variables
   R3SceneNode *closest_node = NULL;
@@ -209,15 +309,39 @@ Intersects(const R3Ray& ray,
   R3Shape *shape;
   R3Point point;
   R3Vector normal;
-  RNScalar t;
 
-  // Apply inverse transformation to ray
-  R3Ray node_ray = ray;
-  node_ray.InverseTransform(transformation);
+  // Apply inverse transformation to ray (identity nodes use the parent's)
+  R3Ray transformed_ray;
+  if (!identity) {
+    transformed_ray = ray;
+    transformed_ray.InverseTransform(transformation);
+  }
+  const R3Ray& node_ray = (identity) ? ray : transformed_ray;
+  R3SceneTreeRay node_tree_ray = (identity) ? tree_ray : R3SceneTreeRay(transformed_ray);
+
+  // Search tree, if node has one
+  const R3SceneTree *tree = Tree();
+  if (tree) {
+    R3SceneNodeHit hit;
+    hit.ray = &node_ray;
+    hit.tree_ray = &node_tree_ray;
+    hit.context = &context;
+    hit.node = NULL;
+    tree->Walk(node_tree_ray, &closest_t, IntersectItem, &hit);
+    if (hit.node) {
+      if (hit_node) *hit_node = hit.node;
+      if (hit_element) *hit_element = hit.element;
+      if (hit_shape) *hit_shape = hit.shape; 
+      if (hit_normal) *hit_normal = hit.normal; 
+      closest_node = hit.node;
+      closest_point = hit.point;
+    }
+  }
 
   // Find closest element intersection
-  for (int i = 0; i < elements.NEntries(); i++) {
+  for (int i = 0; !tree && (i < elements.NEntries()); i++) {
     R3SceneElement *element = elements.Kth(i);
+    context.nshapes += element->NShapes();
     if (element->Intersects(node_ray, &shape, &point, &normal, &t)) {
       if (t < closest_t) {
         if (hit_node) *hit_node = (R3SceneNode *) this;
@@ -232,9 +356,9 @@ Intersects(const R3Ray& ray,
   }
 
   // Find closest node intersection
-  for (int i = 0; i < children.NEntries(); i++) {
+  for (int i = 0; !tree && (i < children.NEntries()); i++) {
     R3SceneNode *child = children.Kth(i);
-    if (child->Intersects(node_ray, &node, &element, &shape, &point, &normal, &t)) {
+    if (child->Intersects(node_ray, node_tree_ray, &node, &element, &shape, &point, &normal, &t, context)) {
       if (t < closest_t) {
         if (hit_node) *hit_node = node;
         if (hit_element) *hit_element = element;
@@ -250,6 +374,13 @@ Intersects(const R3Ray& ray,
   // Check if found hit
   if (!closest_node) return FALSE;
 
+  // Hit is already in parent's coordinate system if transformation is identity
+  if (identity) {
+    if (hit_point) *hit_point = closest_point;
+    if (hit_t) *hit_t = ray.T(closest_point);
+    return TRUE;
+  }
+
   // Transform hit point into parent's coordinate system
   if (hit_t || hit_point) {
     closest_point.Transform(transformation); 
@@ -268,6 +399,294 @@ Intersects(const R3Ray& ray,
 
 
 
+// Intervals collected so far while walking a node's tree
+struct R3SceneNodeIntervals {
+  const R3Span *span;
+  const R3SceneTreeRay *tree_ray;
+  R3SceneQueryContext *context;
+  R3SceneInterval *intervals;
+  int max_intervals;
+  int nintervals;
+};
+
+
+
+static RNBoolean
+CollectItemIntervals(const R3SceneTreeItem& item, RNScalar *max_t, void *data)
+{
+  // Add intervals of shape or child node
+  R3SceneNodeIntervals *collection = (R3SceneNodeIntervals *) data;
+  int room = (collection->nintervals < collection->max_intervals) ? collection->max_intervals - collection->nintervals : 0;
+  R3SceneInterval *intervals = collection->intervals + collection->max_intervals - room;
+  if (item.child) {
+    collection->nintervals += item.child->Intervals(*(collection->span), *(collection->tree_ray), intervals, room, *(collection->context));
+  }
+  else {
+    collection->context->nshapes++;
+    collection->nintervals += item.element->ShapeIntervals(item.shape_index, *(collection->span), intervals, room);
+  }
+  return TRUE;
+}
+
+
+
+int R3SceneNode::
+Intervals(const R3Span& span, R3SceneInterval *intervals, int max_intervals,
+  R3SceneQueryContext *context) const
+{
+  // Use a context of this call only if not given one
+  R3SceneQueryContext call_context;
+  R3SceneQueryContext& query_context = (context) ? *context : call_context;
+  query_context.nqueries++;
+
+  // Prepare span's ray for box tests once for the whole traversal
+  return Intervals(span, R3SceneTreeRay(span.Ray()), intervals, max_intervals, query_context);
+}
+
+
+
+int R3SceneNode::
+Intervals(const R3Span& span, const R3SceneTreeRay& tree_ray, R3SceneInterval *intervals, int max_intervals,
+  R3SceneQueryContext& context) const
+{
+  // Check if span intersects bounding box
+  RNScalar t;
+  context.nnodes++;
+  if (!tree_ray.Enters(BBox(), span.Length(), &t)) return 0;
+
+  // Apply inverse transformation to span, unless identity (parameters along it are unchanged)
+  R3Span transformed_span;
+  if (!identity) {
+    transformed_span = span;
+    transformed_span.InverseTransform(transformation);
+  }
+  const R3Span& node_span = (identity) ? span : transformed_span;
+  R3SceneTreeRay node_tree_ray = (identity) ? tree_ray : R3SceneTreeRay(transformed_span.Ray());
+
+  // Collect intervals of items whose boxes the span crosses, if node has a tree
+  const R3SceneTree *tree = Tree();
+  if (tree) {
+    R3SceneNodeIntervals collection;
+    collection.span = &node_span;
+    collection.tree_ray = &node_tree_ray;
+    collection.context = &context;
+    collection.intervals = intervals;
+    collection.max_intervals = max_intervals;
+    collection.nintervals = 0;
+    RNScalar max_t = node_span.Length();
+    tree->Walk(node_tree_ray, &max_t, CollectItemIntervals, &collection);
+    return collection.nintervals;
+  }
+
+  // Collect intervals of elements and children
+  int nintervals = 0;
+  for (int i = 0; i < elements.NEntries(); i++) {
+    R3SceneElement *element = elements.Kth(i);
+    int room = (nintervals < max_intervals) ? max_intervals - nintervals : 0;
+    context.nshapes += element->NShapes();
+    nintervals += element->Intervals(node_span, intervals + max_intervals - room, room);
+  }
+  for (int i = 0; i < children.NEntries(); i++) {
+    R3SceneNode *child = children.Kth(i);
+    int room = (nintervals < max_intervals) ? max_intervals - nintervals : 0;
+    nintervals += child->Intervals(node_span, node_tree_ray, intervals + max_intervals - room, room, context);
+  }
+
+  // Return number of intervals
+  return nintervals;
+}
+
+
+
+// Intervals collected so far for each lane of a packet while walking a node's tree
+struct R3SceneNodePacketIntervals {
+  const R3SceneTreePacket *packet;
+  R3SceneQueryContext *context;
+  R3SceneInterval *intervals;
+  int max_intervals;
+  int *nintervals;
+};
+
+
+
+static void
+AddShapePacketIntervals(const R3SceneElement *element, int k, const R3SceneTreePacket& packet, int mask,
+  R3SceneInterval *intervals, int max_intervals, int *nintervals)
+{
+  // Add intervals of shape to each lane in mask (intervals of lane i start at i * max_intervals)
+  for (int lane = 0; lane < packet.nspans; lane++) {
+    if (!(mask & (1 << lane))) continue;
+    int room = (nintervals[lane] < max_intervals) ? max_intervals - nintervals[lane] : 0;
+    R3SceneInterval *lane_intervals = intervals + (lane + 1) * max_intervals - room;
+    nintervals[lane] += element->ShapeIntervals(k, packet.spans[lane], lane_intervals, room);
+  }
+}
+
+
+
+static void
+CollectItemPacketIntervals(const R3SceneTreeItem& item, int mask, void *data)
+{
+  // Add intervals of child node, or of shape for lanes entering its box
+  R3SceneNodePacketIntervals *collection = (R3SceneNodePacketIntervals *) data;
+  const R3SceneTreePacket& packet = *(collection->packet);
+  if (item.child) {
+    item.child->Intervals(packet, mask, collection->intervals, collection->max_intervals, collection->nintervals, *(collection->context));
+  }
+  else {
+    mask = packet.Enters(item.bbox, mask);
+    if (!mask) return;
+    collection->context->nshapes++;
+    AddShapePacketIntervals(item.element, item.shape_index, packet, mask, 
+      collection->intervals, collection->max_intervals, collection->nintervals);
+  }
+}
+
+
+
+void R3SceneNode::
+Intervals(const R3SceneTreePacket& packet, int mask, R3SceneInterval *intervals, int max_intervals, int *nintervals,
+  R3SceneQueryContext& context) const
+{
+  // Find lanes whose spans intersect bounding box
+  context.nnodes++;
+  mask = packet.Enters(BBox(), mask);
+  if (!mask) return;
+
+  // Apply inverse transformation to spans of those lanes, unless identity
+  if (!identity) {
+    R3Span transformed_spans[R3_SCENE_TREE_PACKET_SIZE];
+    for (int lane = 0; lane < packet.nspans; lane++) {
+      transformed_spans[lane] = packet.spans[lane];
+      if (mask & (1 << lane)) transformed_spans[lane].InverseTransform(transformation);
+    }
+    LocalIntervals(R3SceneTreePacket(packet.nspans, transformed_spans), mask, intervals, max_intervals, nintervals, context);
+  }
+  else {
+    LocalIntervals(packet, mask, intervals, max_intervals, nintervals, context);
+  }
+}
+
+
+
+void R3SceneNode::
+LocalIntervals(const R3SceneTreePacket& node_packet, int mask, R3SceneInterval *intervals, int max_intervals, int *nintervals,
+  R3SceneQueryContext& context) const
+{
+  // Collect intervals of items whose boxes the lanes cross, if node has a tree
+  const R3SceneTree *tree = Tree();
+  if (tree) {
+    R3SceneNodePacketIntervals collection;
+    collection.packet = &node_packet;
+    collection.context = &context;
+    collection.intervals = intervals;
+    collection.max_intervals = max_intervals;
+    collection.nintervals = nintervals;
+    tree->Walk(node_packet, mask, CollectItemPacketIntervals, &collection);
+    return;
+  }
+
+  // Collect intervals of elements and children
+  for (int i = 0; i < elements.NEntries(); i++) {
+    R3SceneElement *element = elements.Kth(i);
+    context.nshapes += element->NShapes();
+    for (int k = 0; k < element->NShapes(); k++) 
+      AddShapePacketIntervals(element, k, node_packet, mask, intervals, max_intervals, nintervals);
+  }
+  for (int i = 0; i < children.NEntries(); i++) {
+    R3SceneNode *child = children.Kth(i);
+    child->Intervals(node_packet, mask, intervals, max_intervals, nintervals, context);
+  }
+}
+
+
+
+// Span checked for occlusion while walking a node's tree
+struct R3SceneNodeOcclusion {
+  const R3Span *span;
+  const R3SceneTreeRay *tree_ray;
+  R3SceneQueryContext *context;
+  RNBoolean occluded;
+};
+
+
+
+static RNBoolean
+CheckItemOccludes(const R3SceneTreeItem& item, RNScalar *max_t, void *data)
+{
+  // Stop walking at the first shape or child node that blocks the span
+  R3SceneNodeOcclusion *occlusion = (R3SceneNodeOcclusion *) data;
+  if (item.child) {
+    occlusion->occluded = item.child->Occludes(*(occlusion->span), *(occlusion->tree_ray), *(occlusion->context));
+  }
+  else {
+    occlusion->context->nshapes++;
+    occlusion->occluded = item.element->ShapeOccludes(item.shape_index, *(occlusion->span));
+  }
+  return !occlusion->occluded;
+}
+
+
+
+RNBoolean R3SceneNode::
+Occludes(const R3Span& span, R3SceneQueryContext *context) const
+{
+  // Use a context of this call only if not given one
+  R3SceneQueryContext call_context;
+  R3SceneQueryContext& query_context = (context) ? *context : call_context;
+  query_context.nqueries++;
+
+  // Prepare span's ray for box tests once for the whole traversal
+  return Occludes(span, R3SceneTreeRay(span.Ray()), query_context);
+}
+
+
+
+RNBoolean R3SceneNode::
+Occludes(const R3Span& span, const R3SceneTreeRay& tree_ray, R3SceneQueryContext& context) const
+{
+  // Check if span intersects bounding box
+  RNScalar t;
+  context.nnodes++;
+  if (!tree_ray.Enters(BBox(), span.Length(), &t)) return FALSE;
+
+  // Apply inverse transformation to span, unless identity
+  R3Span transformed_span;
+  if (!identity) {
+    transformed_span = span;
+    transformed_span.InverseTransform(transformation);
+  }
+  const R3Span& node_span = (identity) ? span : transformed_span;
+  R3SceneTreeRay node_tree_ray = (identity) ? tree_ray : R3SceneTreeRay(transformed_span.Ray());
+
+  // Check items whose boxes the span crosses, nearest first, if node has a tree
+  const R3SceneTree *tree = Tree();
+  if (tree) {
+    R3SceneNodeOcclusion occlusion;
+    occlusion.span = &node_span;
+    occlusion.tree_ray = &node_tree_ray;
+    occlusion.context = &context;
+    occlusion.occluded = FALSE;
+    RNScalar max_t = node_span.Length();
+    tree->Walk(node_tree_ray, &max_t, CheckItemOccludes, &occlusion);
+    return occlusion.occluded;
+  }
+
+  // Check elements and children
+  for (int i = 0; i < elements.NEntries(); i++) {
+    context.nshapes += elements.Kth(i)->NShapes();
+    if (elements.Kth(i)->Occludes(node_span)) return TRUE;
+  }
+  for (int i = 0; i < children.NEntries(); i++) {
+    if (children.Kth(i)->Occludes(node_span, node_tree_ray, context)) return TRUE;
+  }
+
+  // Return not occluded
+  return FALSE;
+}
+
+
+
 void R3SceneNode::
 Draw(const R3DrawFlags draw_flags) const
 {
@@ -318,12 +737,55 @@ UpdateBBox(void)
 
 
 
+const R3SceneTree *R3SceneNode::
+Tree(void) const
+{
+  // Return tree if up to date (NULL for nodes searched linearly)
+  if (tree_state == R3_SCENE_NODE_TREE_VALID) return tree;
+  RNBoolean rebuild = (tree_state == R3_SCENE_NODE_TREE_REBUILD);
+  R3SceneNode *node = (R3SceneNode *) this;
+
+  // Check number of items
+  int nitems = children.NEntries();
+  for (int i = 0; i < elements.NEntries(); i++)
+    nitems += elements.Kth(i)->NShapes();
+  if (nitems < R3_SCENE_NODE_MIN_TREE_ITEMS) {
+    if (tree) delete tree;
+    node->tree = NULL;
+    node->tree_state = R3_SCENE_NODE_TREE_VALID;
+    return NULL;
+  }
+
+  // Build tree on first query, then rebuild or refit it after changes
+  if (!tree) { node->tree = new R3SceneTree(); rebuild = TRUE; }
+  if (rebuild) node->tree->Build(this);
+  else node->tree->Refit();
+
+  // Mark tree up to date only once it is complete
+  node->tree_state = R3_SCENE_NODE_TREE_VALID;
+  return tree;
+}
+
+
+
+void R3SceneNode::
+InvalidateTree(void)
+{
+  // Mark tree for rebuilding (items were inserted or removed)
+  tree_state = R3_SCENE_NODE_TREE_REBUILD;
+}
+
+
+
 void R3SceneNode::
 InvalidateBBox(void)
 {
   // Invalidate bounding box
   bbox[0][0] = FLT_MAX;
 
+  // Boxes of items may have changed, so tree needs at least a refit
+  if (tree_state == R3_SCENE_NODE_TREE_VALID) tree_state = R3_SCENE_NODE_TREE_REFIT;
+
   // Invalidate parent's bounding box
   if (parent) parent->InvalidateBBox();
 }
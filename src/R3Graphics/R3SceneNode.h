@@ -44,7 +44,25 @@ public:
   // Ray intersection functions
   RNBoolean Intersects(const R3Ray& ray, 
     R3SceneNode **hit_node = NULL, R3SceneElement **hit_element = NULL, R3Shape **hit_shape = NULL,
-    R3Point *hit_point = NULL, R3Vector *hit_normal = NULL, RNScalar *hit_t = NULL) const;
+    R3Point *hit_point = NULL, R3Vector *hit_normal = NULL, RNScalar *hit_t = NULL,
+    R3SceneQueryContext *context = NULL) const;
+
+  // Segment interval functions
+  int Intervals(const R3Span& span, R3SceneInterval *intervals, int max_intervals,
+    R3SceneQueryContext *context = NULL) const;
+
+  // Occlusion functions
+  RNBoolean Occludes(const R3Span& span, R3SceneQueryContext *context = NULL) const;
+
+  // Query functions for a ray already prepared for box tests
+  RNBoolean Intersects(const R3Ray& ray, const R3SceneTreeRay& tree_ray,
+    R3SceneNode **hit_node, R3SceneElement **hit_element, R3Shape **hit_shape,
+    R3Point *hit_point, R3Vector *hit_normal, RNScalar *hit_t, R3SceneQueryContext& context) const;
+  int Intervals(const R3Span& span, const R3SceneTreeRay& tree_ray, R3SceneInterval *intervals, int max_intervals,
+    R3SceneQueryContext& context) const;
+  void Intervals(const R3SceneTreePacket& packet, int mask, R3SceneInterval *intervals, int max_intervals, int *nintervals,
+    R3SceneQueryContext& context) const;
+  RNBoolean Occludes(const R3Span& span, const R3SceneTreeRay& tree_ray, R3SceneQueryContext& context) const;
 
   // Draw functions
   void Draw(const R3DrawFlags draw_flags = R3_DEFAULT_DRAW_FLAGS) const;
@@ -52,7 +70,13 @@ public:
 public:
   // Internal update functions
   void InvalidateBBox(void);
+  void InvalidateTree(void);
   void UpdateBBox(void);
+  const R3SceneTree *Tree(void) const;
+
+private:
+  void LocalIntervals(const R3SceneTreePacket& node_packet, int mask, R3SceneInterval *intervals, int max_intervals, int *nintervals,
+    R3SceneQueryContext& context) const;
 
 private:
   friend class R3Scene;
@@ -63,9 +87,12 @@ private:
   RNArray<R3SceneNode *> children;
   RNArray<R3SceneElement *> elements;
   R3Affine transformation;
+  RNBoolean identity;
   R3Box bbox;
   char *name;
   void *data;
+  R3SceneTree *tree;
+  int tree_state;
 };
 
 
@@ -0,0 +1,46 @@
+/* Include file for the R3 scene query context class */
+
+
+
+/* Class definition */
+
+// State of the queries made by one thread. Once R3Scene::PrepareQueries has
+// built every bounding box and tree, queries only read the scene, so several
+// threads can query it at once, each passing its own context
+class R3SceneQueryContext {
+public:
+  // Constructor functions
+  R3SceneQueryContext(void);
+
+  // Statistics functions
+  void ResetStatistics(void);
+
+public:
+  // Statistics (counted since construction or the last reset)
+  long long nqueries;  // rays and spans queried
+  long long nnodes;    // scene nodes whose bounding box was tested
+  long long nshapes;   // shapes tested
+};
+
+
+
+/* Inline functions */
+
+inline R3SceneQueryContext::
+R3SceneQueryContext(void)
+  : nqueries(0),
+    nnodes(0),
+    nshapes(0)
+{
+}
+
+
+
+inline void R3SceneQueryContext::
+ResetStatistics(void)
+{
+  // Reset counters
+  nqueries = 0;
+  nnodes = 0;
+  nshapes = 0;
+}
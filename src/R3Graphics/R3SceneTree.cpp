@@ -0,0 +1,385 @@
+/* Source file for the R3 scene tree class */
+
+
+
+////////////////////////////////////////////////////////////////////////
+// INCLUDE FILES
+////////////////////////////////////////////////////////////////////////
+
+#include "R3Graphics.h"
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+
+////////////////////////////////////////////////////////////////////////
+// HELPER FUNCTIONS
+////////////////////////////////////////////////////////////////////////
+
+static RNScalar
+HalfArea(const R3Box& box)
+{
+  // Return half the surface area (enough to compare costs)
+  if (box.IsEmpty()) return 0;
+  RNLength dx = box.XLength(), dy = box.YLength(), dz = box.ZLength();
+  return dx*dy + dy*dz + dz*dx;
+}
+
+
+
+static int
+CompareItems(const R3SceneTreeItem *item1, const R3SceneTreeItem *item2, RNDimension dim)
+{
+  // Compare centers of bounding boxes along dim
+  RNScalar c1 = item1->bbox.Min()[dim] + item1->bbox.Max()[dim];
+  RNScalar c2 = item2->bbox.Min()[dim] + item2->bbox.Max()[dim];
+  if (c1 < c2) return -1;
+  else if (c1 > c2) return 1;
+  else return 0;
+}
+
+
+
+static int CompareItemsX(const void *data1, const void *data2)
+{ return CompareItems((const R3SceneTreeItem *) data1, (const R3SceneTreeItem *) data2, RN_X); }
+static int CompareItemsY(const void *data1, const void *data2)
+{ return CompareItems((const R3SceneTreeItem *) data1, (const R3SceneTreeItem *) data2, RN_Y); }
+static int CompareItemsZ(const void *data1, const void *data2)
+{ return CompareItems((const R3SceneTreeItem *) data1, (const R3SceneTreeItem *) data2, RN_Z); }
+static int (*compare_items[3])(const void *, const void *) = { CompareItemsX, CompareItemsY, CompareItemsZ };
+
+
+
+////////////////////////////////////////////////////////////////////////
+// PACKET FUNCTIONS
+////////////////////////////////////////////////////////////////////////
+
+R3SceneTreePacket::
+R3SceneTreePacket(int nspans, const R3Span *spans)
+  : nspans(nspans),
+    spans(spans)
+{
+  // Fill lanes, repeating the first span in unused ones
+  assert((nspans > 0) && (nspans <= R3_SCENE_TREE_PACKET_SIZE));
+  for (int lane = 0; lane < R3_SCENE_TREE_PACKET_SIZE; lane++) {
+    const R3Span& span = spans[(lane < nspans) ? lane : 0];
+    for (int dim = RN_X; dim <= RN_Z; dim++) {
+      // Along an axis the span does not move, DBL_MAX makes the slab keep or
+      //   reject it whole without the NaN that an infinite reciprocal gives on a side
+      RNScalar d = span.Vector()[dim];
+      start[dim][lane] = span.Start()[dim];
+      inverse_vector[dim][lane] = (d != 0) ? 1.0 / d : DBL_MAX;
+    }
+    length[lane] = span.Length();
+  }
+}
+
+
+
+// Thin wrappers so the packet slab test reads the same for both instruction sets
+#if defined(__AVX__)
+typedef __m256d R3SceneTreeLanes;
+static const int R3_SCENE_TREE_LANE_WIDTH = 4;
+static inline R3SceneTreeLanes Set1(RNScalar a) { return _mm256_set1_pd(a); }
+static inline R3SceneTreeLanes Load(const RNScalar *p) { return _mm256_loadu_pd(p); }
+static inline R3SceneTreeLanes Sub(R3SceneTreeLanes a, R3SceneTreeLanes b) { return _mm256_sub_pd(a, b); }
+static inline R3SceneTreeLanes Mul(R3SceneTreeLanes a, R3SceneTreeLanes b) { return _mm256_mul_pd(a, b); }
+static inline R3SceneTreeLanes Min(R3SceneTreeLanes a, R3SceneTreeLanes b) { return _mm256_min_pd(a, b); }
+static inline R3SceneTreeLanes Max(R3SceneTreeLanes a, R3SceneTreeLanes b) { return _mm256_max_pd(a, b); }
+static inline int LessOrEqual(R3SceneTreeLanes a, R3SceneTreeLanes b) { return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LE_OQ)); }
+#elif defined(__SSE2__)
+typedef __m128d R3SceneTreeLanes;
+static const int R3_SCENE_TREE_LANE_WIDTH = 2;
+static inline R3SceneTreeLanes Set1(RNScalar a) { return _mm_set1_pd(a); }
+static inline R3SceneTreeLanes Load(const RNScalar *p) { return _mm_loadu_pd(p); }
+static inline R3SceneTreeLanes Sub(R3SceneTreeLanes a, R3SceneTreeLanes b) { return _mm_sub_pd(a, b); }
+static inline R3SceneTreeLanes Mul(R3SceneTreeLanes a, R3SceneTreeLanes b) { return _mm_mul_pd(a, b); }
+static inline R3SceneTreeLanes Min(R3SceneTreeLanes a, R3SceneTreeLanes b) { return _mm_min_pd(a, b); }
+static inline R3SceneTreeLanes Max(R3SceneTreeLanes a, R3SceneTreeLanes b) { return _mm_max_pd(a, b); }
+static inline int LessOrEqual(R3SceneTreeLanes a, R3SceneTreeLanes b) { return _mm_movemask_pd(_mm_cmple_pd(a, b)); }
+#endif
+
+
+
+int R3SceneTreePacket::
+Enters(const R3Box& box, int mask) const
+{
+  int hits = 0;
+
+#if defined(__AVX__) || defined(__SSE2__)
+  // Clip parameters of several lanes per instruction against slabs, skipping groups without lanes in mask
+  int group = (1 << R3_SCENE_TREE_LANE_WIDTH) - 1;
+  for (int lane = 0; lane < R3_SCENE_TREE_PACKET_SIZE; lane += R3_SCENE_TREE_LANE_WIDTH) {
+    if (!((mask >> lane) & group)) continue;
+    R3SceneTreeLanes lo = Set1(0), hi = Load(&length[lane]);
+    for (int dim = RN_X; dim <= RN_Z; dim++) {
+      R3SceneTreeLanes lane_start = Load(&start[dim][lane]);
+      R3SceneTreeLanes lane_inverse_vector = Load(&inverse_vector[dim][lane]);
+      R3SceneTreeLanes ta = Mul(Sub(Set1(box.Min()[dim]), lane_start), lane_inverse_vector);
+      R3SceneTreeLanes tb = Mul(Sub(Set1(box.Max()[dim]), lane_start), lane_inverse_vector);
+      lo = Max(lo, Min(ta, tb));
+      hi = Min(hi, Max(ta, tb));
+    }
+    hits |= LessOrEqual(lo, hi) << lane;
+  }
+#else
+  // Clip parameters of one lane at a time against slabs
+  for (int lane = 0; lane < R3_SCENE_TREE_PACKET_SIZE; lane++) {
+    if (!(mask & (1 << lane))) continue;
+    RNScalar lo = 0, hi = length[lane];
+    for (int dim = RN_X; dim <= RN_Z; dim++) {
+      RNScalar ta = (box.Min()[dim] - start[dim][lane]) * inverse_vector[dim][lane];
+      RNScalar tb = (box.Max()[dim] - start[dim][lane]) * inverse_vector[dim][lane];
+      if (ta > tb) { RNScalar swap = ta; ta = tb; tb = swap; }
+      if (ta > lo) lo = ta;
+      if (tb < hi) hi = tb;
+    }
+    if (lo <= hi) hits |= 1 << lane;
+  }
+#endif
+
+  // Return lanes in mask that enter box
+  return hits & mask;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// MEMBER FUNCTIONS
+////////////////////////////////////////////////////////////////////////
+
+R3SceneTree::
+R3SceneTree(void)
+  : items(NULL),
+    nitems(0),
+    nodes(NULL),
+    nnodes(0),
+    depth(0)
+{
+}
+
+
+
+R3SceneTree::
+~R3SceneTree(void)
+{
+  // Delete arrays
+  if (items) delete [] items;
+  if (nodes) delete [] nodes;
+}
+
+
+
+void R3SceneTree::
+Build(const R3SceneNode *node)
+{
+  // Delete previous tree
+  if (items) delete [] items;
+  if (nodes) delete [] nodes;
+  items = NULL;
+  nodes = NULL;
+  nitems = nnodes = depth = 0;
+
+  // Count items
+  int n = node->NChildren();
+  for (int i = 0; i < node->NElements(); i++)
+    n += node->Element(i)->NShapes();
+  if (n == 0) return;
+
+  // Fill in items
+  items = new R3SceneTreeItem [ n ];
+  for (int i = 0; i < node->NElements(); i++) {
+    R3SceneElement *element = node->Element(i);
+    for (int j = 0; j < element->NShapes(); j++) {
+      R3SceneTreeItem& item = items[nitems++];
+      item.bbox = element->Shape(j)->BBox();
+      item.element = element;
+      item.shape_index = j;
+      item.child = NULL;
+    }
+  }
+  for (int i = 0; i < node->NChildren(); i++) {
+    R3SceneTreeItem& item = items[nitems++];
+    item.child = node->Child(i);
+    item.bbox = item.child->BBox();
+    item.element = NULL;
+    item.shape_index = -1;
+  }
+
+  // Build hierarchy (a binary tree over n items has at most 2n - 1 nodes)
+  nodes = new R3SceneTreeNode [ 2 * nitems ];
+  BuildNode(0, nitems, 0);
+}
+
+
+
+int R3SceneTree::
+BuildNode(int first, int count, int level)
+{
+  // Create node bounding all its items
+  int index = nnodes++;
+  if (level > depth) depth = level;
+  R3SceneTreeNode& node = nodes[index];
+  node.bbox = R3null_box;
+  for (int i = first; i < first + count; i++)
+    node.bbox.Union(items[i].bbox);
+  node.first = first;
+  node.count = count;
+  if (count <= 2) return index;
+
+  // Find the split with the least surface area cost, sweeping items sorted along each axis
+  RNScalar *left_area = new RNScalar [ count ];
+  RNScalar best_cost = count * HalfArea(node.bbox);
+  int best_dim = -1, best_split = 0;
+  for (int dim = RN_X; dim <= RN_Z; dim++) {
+    qsort(&items[first], count, sizeof(R3SceneTreeItem), compare_items[dim]);
+    R3Box box = R3null_box;
+    for (int i = 0; i < count; i++) {
+      box.Union(items[first + i].bbox);
+      left_area[i] = HalfArea(box);
+    }
+    box = R3null_box;
+    for (int i = count - 1; i > 0; i--) {
+      box.Union(items[first + i].bbox);
+      RNScalar cost = HalfArea(node.bbox) + left_area[i - 1] * i + HalfArea(box) * (count - i);
+      if (cost < best_cost) { best_cost = cost; best_dim = dim; best_split = i; }
+    }
+  }
+  delete [] left_area;
+
+  // Make a leaf if no split is worth it
+  if (best_dim < 0) return index;
+
+  // Split items
+  qsort(&items[first], count, sizeof(R3SceneTreeItem), compare_items[best_dim]);
+  BuildNode(first, best_split, level + 1);
+  int second = BuildNode(first + best_split, count - best_split, level + 1);
+  nodes[index].first = second;
+  nodes[index].count = 0;
+  return index;
+}
+
+
+
+void R3SceneTree::
+Refit(void)
+{
+  // Update item boxes
+  for (int i = 0; i < nitems; i++) {
+    R3SceneTreeItem& item = items[i];
+    if (item.child) item.bbox = item.child->BBox();
+    else item.bbox = item.element->Shape(item.shape_index)->BBox();
+  }
+
+  // Update node boxes bottom up (children come after their parent)
+  for (int i = nnodes - 1; i >= 0; i--) {
+    R3SceneTreeNode& node = nodes[i];
+    node.bbox = R3null_box;
+    if (node.count > 0) {
+      for (int j = node.first; j < node.first + node.count; j++)
+        node.bbox.Union(items[j].bbox);
+    }
+    else {
+      node.bbox.Union(nodes[i + 1].bbox);
+      node.bbox.Union(nodes[node.first].bbox);
+    }
+  }
+}
+
+
+
+void R3SceneTree::
+Walk(const R3SceneTreeRay& ray, RNScalar *max_t,
+  RNBoolean (*visit)(const R3SceneTreeItem& item, RNScalar *max_t, void *data), void *data) const
+{
+  // Check root
+  if (nnodes == 0) return;
+  RNScalar t, t1, t2;
+  if (!ray.Enters(nodes[0].bbox, *max_t, &t)) return;
+
+  // Traverse nodes with a stack of (node, entry parameter), holding at most one node per level
+  int stack_buffer[64];
+  RNScalar stack_t_buffer[64];
+  int *stack = (depth < 64) ? stack_buffer : new int [ depth + 1 ];
+  RNScalar *stack_t = (depth < 64) ? stack_t_buffer : new RNScalar [ depth + 1 ];
+  int nstack = 0;
+  stack[nstack] = 0;
+  stack_t[nstack++] = t;
+  while (nstack > 0) {
+    nstack--;
+    if (stack_t[nstack] > *max_t) continue;
+    const R3SceneTreeNode& node = nodes[stack[nstack]];
+    if (node.count > 0) {
+      // Visit items of leaf
+      for (int i = node.first; i < node.first + node.count; i++) {
+        if (!(*visit)(items[i], max_t, data)) { nstack = 0; break; }
+      }
+    }
+    else {
+      // Push far child first, so near child is visited first
+      int child1 = stack[nstack] + 1, child2 = node.first;
+      RNBoolean hit1 = ray.Enters(nodes[child1].bbox, *max_t, &t1);
+      RNBoolean hit2 = ray.Enters(nodes[child2].bbox, *max_t, &t2);
+      if (hit1 && hit2 && (t2 < t1)) {
+        int swap = child1; child1 = child2; child2 = swap;
+        RNScalar swap_t = t1; t1 = t2; t2 = swap_t;
+      }
+      else if (!hit1) {
+        child1 = child2; t1 = t2;
+        hit1 = hit2; hit2 = FALSE;
+      }
+      if (hit2) { stack[nstack] = child2; stack_t[nstack++] = t2; }
+      if (hit1) { stack[nstack] = child1; stack_t[nstack++] = t1; }
+    }
+  }
+
+  // Delete stack
+  if (stack != stack_buffer) delete [] stack;
+  if (stack_t != stack_t_buffer) delete [] stack_t;
+}
+
+
+
+void R3SceneTree::
+Walk(const R3SceneTreePacket& packet, int mask,
+  void (*visit)(const R3SceneTreeItem& item, int mask, void *data), void *data) const
+{
+  // Check root
+  if (nnodes == 0) return;
+  mask = packet.Enters(nodes[0].bbox, mask);
+  if (!mask) return;
+
+  // Traverse nodes with a stack of (node, lanes entering its box)
+  int stack_buffer[64];
+  int stack_mask_buffer[64];
+  int *stack = (depth < 64) ? stack_buffer : new int [ depth + 1 ];
+  int *stack_mask = (depth < 64) ? stack_mask_buffer : new int [ depth + 1 ];
+  int nstack = 0;
+  stack[nstack] = 0;
+  stack_mask[nstack++] = mask;
+  while (nstack > 0) {
+    nstack--;
+    const R3SceneTreeNode& node = nodes[stack[nstack]];
+    int node_mask = stack_mask[nstack];
+    if (node.count > 0) {
+      // Visit items of leaf
+      for (int i = node.first; i < node.first + node.count; i++) 
+        (*visit)(items[i], node_mask, data);
+    }
+    else {
+      // Push children entered by any lane
+      int child1 = stack[nstack] + 1, child2 = node.first;
+      int mask1 = packet.Enters(nodes[child1].bbox, node_mask);
+      int mask2 = packet.Enters(nodes[child2].bbox, node_mask);
+      if (mask2) { stack[nstack] = child2; stack_mask[nstack++] = mask2; }
+      if (mask1) { stack[nstack] = child1; stack_mask[nstack++] = mask1; }
+    }
+  }
+
+  // Delete stack
+  if (stack != stack_buffer) delete [] stack;
+  if (stack_mask != stack_mask_buffer) delete [] stack_mask;
+}
@@ -0,0 +1,134 @@
+/* Include file for the R3 scene tree class */
+
+
+
+/* Class definitions */
+
+// One thing a node can hit: a shape of one of its elements, or a child node,
+// with its bounding box in the node's coordinate system
+struct R3SceneTreeItem {
+  R3Box bbox;
+  R3SceneElement *element;
+  int shape_index;
+  R3SceneNode *child;
+};
+
+// Ray prepared for many slab tests against boxes: its reciprocal direction,
+// and per axis which side of a box it enters first
+struct R3SceneTreeRay {
+  R3SceneTreeRay(const R3Ray& ray);
+  RNBoolean Enters(const R3Box& box, RNScalar max_t, RNScalar *entry_t) const;
+  R3Point start;
+  RNScalar inverse_vector[3];
+  RNDirection sign[3];
+};
+
+// Up to R3_SCENE_TREE_PACKET_SIZE spans tested against boxes together, one per
+// lane, kept as a structure of arrays so that slab tests run 4 lanes per
+// instruction with AVX, 2 with SSE2, and one at a time otherwise
+#define R3_SCENE_TREE_PACKET_SIZE 8
+struct R3SceneTreePacket {
+  R3SceneTreePacket(int nspans, const R3Span *spans);
+  int Enters(const R3Box& box, int mask) const;
+  int nspans;
+  const R3Span *spans;
+  RNScalar start[3][R3_SCENE_TREE_PACKET_SIZE];
+  RNScalar inverse_vector[3][R3_SCENE_TREE_PACKET_SIZE];
+  RNScalar length[R3_SCENE_TREE_PACKET_SIZE];
+};
+
+// Bounding volume hierarchy over the items of one scene node, split with the
+// surface area heuristic
+class R3SceneTree {
+public:
+  // Constructor functions
+  R3SceneTree(void);
+  ~R3SceneTree(void);
+
+  // Access functions
+  int NItems(void) const;
+  const R3SceneTreeItem& Item(int k) const;
+
+  // Manipulation functions
+  void Build(const R3SceneNode *node);
+  void Refit(void);
+
+  // Query functions (visits items whose box the ray enters before *max_t,
+  //   nearest box first; visit may lower *max_t, or return FALSE to stop)
+  void Walk(const R3SceneTreeRay& ray, RNScalar *max_t,
+    RNBoolean (*visit)(const R3SceneTreeItem& item, RNScalar *max_t, void *data), void *data) const;
+  // (visits items whose box any lane in mask enters, with the mask of those lanes)
+  void Walk(const R3SceneTreePacket& packet, int mask,
+    void (*visit)(const R3SceneTreeItem& item, int mask, void *data), void *data) const;
+
+private:
+  int BuildNode(int first, int count, int level);
+
+private:
+  struct R3SceneTreeNode {
+    R3Box bbox;
+    int first;   // first item of a leaf, or second child of an interior node (the first is next)
+    int count;   // number of items of a leaf, 0 for interior nodes
+  };
+  R3SceneTreeItem *items;
+  int nitems;
+  R3SceneTreeNode *nodes;
+  int nnodes;
+  int depth;
+};
+
+
+
+/* Inline functions */
+
+inline R3SceneTreeRay::
+R3SceneTreeRay(const R3Ray& ray)
+  : start(ray.Start())
+{
+  // Compute reciprocal direction (infinite along axes the ray does not move)
+  for (int dim = RN_X; dim <= RN_Z; dim++) {
+    inverse_vector[dim] = 1.0 / ray.Vector()[dim];
+    sign[dim] = (inverse_vector[dim] < 0) ? RN_HI : RN_LO;
+  }
+}
+
+
+
+inline RNBoolean R3SceneTreeRay::
+Enters(const R3Box& box, RNScalar max_t, RNScalar *entry_t) const
+{
+  // Clip ray parameters against slabs, near side first. Along an axis the ray
+  // does not move, the parameters are infinite (keeping or rejecting the whole
+  // ray), or NaN when it lies on a side, which the comparisons ignore
+  RNScalar lo = 0, hi = max_t;
+  for (int dim = RN_X; dim <= RN_Z; dim++) {
+    RNScalar ta = (box[sign[dim]][dim] - start[dim]) * inverse_vector[dim];
+    RNScalar tb = (box[1 - sign[dim]][dim] - start[dim]) * inverse_vector[dim];
+    if (ta > lo) lo = ta;
+    if (tb < hi) hi = tb;
+    if (lo > hi) return FALSE;
+  }
+
+  // Return entry parameter
+  *entry_t = lo;
+  return TRUE;
+}
+
+
+
+inline int R3SceneTree::
+NItems(void) const
+{
+  // Return number of items
+  return nitems;
+}
+
+
+
+inline const R3SceneTreeItem& R3SceneTree::
+Item(int k) const
+{
+  // Return kth item
+  assert((k >= 0) && (k < nitems));
+  return items[k];
+}
@@ -28,14 +28,14 @@ static const int max_depth = 64;
 
 class R3MeshSearchTreeFace {
 public:
-  R3MeshSearchTreeFace(R3Mesh *mesh, R3MeshFace *face) 
-  : face(face), area(mesh->FaceArea(face)), reference_count(0), mark(0) {};
+  R3MeshSearchTreeFace(R3Mesh *mesh, R3MeshFace *face, int index) 
+  : face(face), area(mesh->FaceArea(face)), reference_count(0), index(index) {};
 
 public:
   R3MeshFace *face;
   RNArea area;
   int reference_count;
-  RNMark mark;
+  int index;
 };
 
 
@@ -72,7 +72,8 @@ R3MeshSearchTree::
 R3MeshSearchTree(R3Mesh *mesh)
   : mesh(mesh),
     nnodes(1),
-    mark(1)
+    nfaces(0),
+    default_context()
 {
   // Create root 
   root = new R3MeshSearchTreeNode(NULL);
@@ -96,6 +97,70 @@ R3MeshSearchTree::
 
 
 
+////////////////////////////////////////////////////////////////////////
+// Search context functions
+////////////////////////////////////////////////////////////////////////
+
+R3MeshSearchTreeContext::
+R3MeshSearchTreeContext(void)
+  : marks(NULL),
+    nmarks(0),
+    mark(0),
+    nsearches(0),
+    nnodes(0),
+    nfaces(0)
+{
+}
+
+
+
+R3MeshSearchTreeContext::
+~R3MeshSearchTreeContext(void)
+{
+  // Delete marks
+  if (marks) delete [] marks;
+}
+
+
+
+void R3MeshSearchTreeContext::
+ResetStatistics(void)
+{
+  // Reset counters
+  nsearches = 0;
+  nnodes = 0;
+  nfaces = 0;
+}
+
+
+
+void R3MeshSearchTreeContext::
+BeginSearch(int tree_nfaces)
+{
+  // Make room for a mark per face (a context may be used with several trees,
+  // whose faces share marks, which is fine since every search has a new one)
+  if (tree_nfaces > nmarks) {
+    RNMark *new_marks = new RNMark [ tree_nfaces ];
+    for (int i = 0; i < nmarks; i++) new_marks[i] = marks[i];
+    for (int i = nmarks; i < tree_nfaces; i++) new_marks[i] = 0;
+    if (marks) delete [] marks;
+    marks = new_marks;
+    nmarks = tree_nfaces;
+  }
+
+  // Clear marks when the counter would wrap around
+  if (mark == INT_MAX) {
+    for (int i = 0; i < nmarks; i++) marks[i] = 0;
+    mark = 0;
+  }
+
+  // Update mark
+  mark++;
+  nsearches++;
+}
+
+
+
 ////////////////////////////////////////////////////////////////////////
 // Insert/delete functions
 ////////////////////////////////////////////////////////////////////////
@@ -173,7 +238,7 @@ InsertFace(R3MeshFace *face)
   if (!R3Intersects(mesh, face, BBox())) return;
 
   // Create container
-  R3MeshSearchTreeFace *face_container = new R3MeshSearchTreeFace(mesh, face);
+  R3MeshSearchTreeFace *face_container = new R3MeshSearchTreeFace(mesh, face, nfaces++);
   assert(face_container);
 
   // Insert face into root
@@ -291,6 +356,9 @@ Empty(void)
 {
   // Check root
   if (root) Empty(root);
+
+  // Restart face numbering
+  nfaces = 0;
 }
 
 
@@ -486,8 +554,11 @@ void R3MeshSearchTree::
 FindClosest(const R3Point& query_position, const R3Vector& query_normal, R3MeshIntersection& closest, 
   RNScalar min_distance_squared, RNScalar& max_distance_squared, 
   int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data,
-  R3MeshSearchTreeNode *node, const R3Box& node_box) const
+  R3MeshSearchTreeContext& context, R3MeshSearchTreeNode *node, const R3Box& node_box) const
 {
+  // Count node
+  context.nnodes++;
+
   // Compute distance (squared) from query point to node bbox
   RNScalar distance_squared = DistanceSquared(query_position, node_box, max_distance_squared);
   if (distance_squared >= max_distance_squared) return;
@@ -496,8 +567,7 @@ FindClosest(const R3Point& query_position, const R3Vector& query_normal, R3MeshI
   for (int i = 0; i < node->big_faces.NEntries(); i++) {
     // Get face container and check mark
     R3MeshSearchTreeFace *face_container = node->big_faces[i];
-    if (face_container->mark == mark) continue;
-    face_container->mark = mark;
+    if (!context.Visit(face_container->index)) continue;
   
     // Find closest point in mesh face
     FindClosest(query_position, query_normal, closest, 
@@ -519,13 +589,13 @@ FindClosest(const R3Point& query_position, const R3Vector& query_normal, R3MeshI
       R3Box child_box(node_box);
       child_box[RN_HI][node->split_dimension] = node->split_coordinate;
       FindClosest(query_position, query_normal, closest, 
-        min_distance_squared, max_distance_squared, IsCompatible, compatible_data,
+        min_distance_squared, max_distance_squared, IsCompatible, compatible_data, context,
         node->children[0], child_box);
       if (side*side < max_distance_squared) {
         R3Box child_box(node_box);
         child_box[RN_LO][node->split_dimension] = node->split_coordinate;
         FindClosest(query_position, query_normal, closest, 
-          min_distance_squared, max_distance_squared, IsCompatible, compatible_data,
+          min_distance_squared, max_distance_squared, IsCompatible, compatible_data, context,
           node->children[1], child_box);
       }
     }
@@ -534,13 +604,13 @@ FindClosest(const R3Point& query_position, const R3Vector& query_normal, R3MeshI
       R3Box child_box(node_box);
       child_box[RN_LO][node->split_dimension] = node->split_coordinate;
       FindClosest(query_position, query_normal, closest, 
-        min_distance_squared, max_distance_squared, IsCompatible, compatible_data,
+        min_distance_squared, max_distance_squared, IsCompatible, compatible_data, context,
         node->children[1], child_box);
       if (side*side < max_distance_squared) {
         R3Box child_box(node_box);
         child_box[RN_HI][node->split_dimension] = node->split_coordinate;
         FindClosest(query_position, query_normal, closest, 
-          min_distance_squared, max_distance_squared, IsCompatible, compatible_data,
+          min_distance_squared, max_distance_squared, IsCompatible, compatible_data, context,
           node->children[0], child_box);
       }
     }
@@ -550,8 +620,7 @@ FindClosest(const R3Point& query_position, const R3Vector& query_normal, R3MeshI
     for (int i = 0; i < node->small_faces.NEntries(); i++) {
       // Get face container and check mark
       R3MeshSearchTreeFace *face_container = node->small_faces[i];
-      if (face_container->mark == mark) continue;
-      face_container->mark = mark;
+      if (!context.Visit(face_container->index)) continue;
 
       // Find closest point in mesh face
       FindClosest(query_position, query_normal, closest, 
@@ -566,7 +635,8 @@ FindClosest(const R3Point& query_position, const R3Vector& query_normal, R3MeshI
 void R3MeshSearchTree::
 FindClosest(const R3Point& query_position, const R3Vector& query_normal, R3MeshIntersection& closest,
   RNScalar min_distance, RNScalar max_distance, 
-  int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data)
+  int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data,
+  R3MeshSearchTreeContext *context)
 {
   // Initialize result
   closest.type = R3_MESH_NULL_TYPE;
@@ -579,8 +649,9 @@ FindClosest(const R3Point& query_position, const R3Vector& query_normal, R3MeshI
   // Check root
   if (!root) return;
 
-  // Update mark (used to avoid checking same face twice)
-  mark++;
+  // Start search with new marks (used to avoid checking same face twice)
+  R3MeshSearchTreeContext& search_context = (context) ? *context : default_context;
+  search_context.BeginSearch(nfaces);
 
   // Use squared distances for efficiency
   RNScalar min_distance_squared = min_distance * min_distance;
@@ -590,7 +661,7 @@ FindClosest(const R3Point& query_position, const R3Vector& query_normal, R3MeshI
   FindClosest(query_position, query_normal, closest, 
     min_distance_squared, closest_distance_squared, 
     IsCompatible, compatible_data, 
-    root, BBox());
+    search_context, root, BBox());
 
   // Update result
   closest.t = sqrt(closest_distance_squared);
@@ -613,10 +684,11 @@ FindClosest(const R3Point& query_position, const R3Vector& query_normal, R3MeshI
 void R3MeshSearchTree::
 FindClosest(const R3Point& query_position, R3MeshIntersection& closest,
   RNScalar min_distance, RNScalar max_distance,
-  int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data)
+  int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data,
+  R3MeshSearchTreeContext *context)
 {
   // Find closest point, ignoring normal
-  FindClosest(query_position, R3zero_vector, closest, min_distance, max_distance, IsCompatible, compatible_data);
+  FindClosest(query_position, R3zero_vector, closest, min_distance, max_distance, IsCompatible, compatible_data, context);
 }
 
 
@@ -850,8 +922,11 @@ void R3MeshSearchTree::
 FindAll(const R3Point& query_position, const R3Vector& query_normal, RNArray<R3MeshIntersection *>& hits, 
   RNScalar min_distance_squared, RNScalar max_distance_squared, 
   int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data,
-  R3MeshSearchTreeNode *node, const R3Box& node_box) const
+  R3MeshSearchTreeContext& context, R3MeshSearchTreeNode *node, const R3Box& node_box) const
 {
+  // Count node
+  context.nnodes++;
+
   // Compute distance (squared) from query point to node bbox
   RNScalar distance_squared = DistanceSquared(query_position, node_box, max_distance_squared);
   if (distance_squared >= max_distance_squared) return;
@@ -860,8 +935,7 @@ FindAll(const R3Point& query_position, const R3Vector& query_normal, RNArray<R3M
   for (int i = 0; i < node->big_faces.NEntries(); i++) {
     // Get face container and check mark
     R3MeshSearchTreeFace *face_container = node->big_faces[i];
-    if (face_container->mark == mark) continue;
-    face_container->mark = mark;
+    if (!context.Visit(face_container->index)) continue;
   
     // Find point in mesh face
     FindAll(query_position, query_normal, hits, 
@@ -883,13 +957,13 @@ FindAll(const R3Point& query_position, const R3Vector& query_normal, RNArray<R3M
       R3Box child_box(node_box);
       child_box[RN_HI][node->split_dimension] = node->split_coordinate;
       FindAll(query_position, query_normal, hits, 
-        min_distance_squared, max_distance_squared, IsCompatible, compatible_data,
+        min_distance_squared, max_distance_squared, IsCompatible, compatible_data, context,
         node->children[0], child_box);
       if (side*side < max_distance_squared) {
         R3Box child_box(node_box);
         child_box[RN_LO][node->split_dimension] = node->split_coordinate;
         FindAll(query_position, query_normal, hits, 
-          min_distance_squared, max_distance_squared, IsCompatible, compatible_data,
+          min_distance_squared, max_distance_squared, IsCompatible, compatible_data, context,
           node->children[1], child_box);
       }
     }
@@ -898,13 +972,13 @@ FindAll(const R3Point& query_position, const R3Vector& query_normal, RNArray<R3M
       R3Box child_box(node_box);
       child_box[RN_LO][node->split_dimension] = node->split_coordinate;
       FindAll(query_position, query_normal, hits, 
-        min_distance_squared, max_distance_squared, IsCompatible, compatible_data,
+        min_distance_squared, max_distance_squared, IsCompatible, compatible_data, context,
         node->children[1], child_box);
       if (side*side < max_distance_squared) {
         R3Box child_box(node_box);
         child_box[RN_HI][node->split_dimension] = node->split_coordinate;
         FindAll(query_position, query_normal, hits, 
-          min_distance_squared, max_distance_squared, IsCompatible, compatible_data,
+          min_distance_squared, max_distance_squared, IsCompatible, compatible_data, context,
           node->children[0], child_box);
       }
     }
@@ -914,8 +988,7 @@ FindAll(const R3Point& query_position, const R3Vector& query_normal, RNArray<R3M
     for (int i = 0; i < node->small_faces.NEntries(); i++) {
       // Get face container and check mark
       R3MeshSearchTreeFace *face_container = node->small_faces[i];
-      if (face_container->mark == mark) continue;
-      face_container->mark = mark;
+      if (!context.Visit(face_container->index)) continue;
 
       // Find point in mesh face
       FindAll(query_position, query_normal, hits, 
@@ -930,13 +1003,15 @@ FindAll(const R3Point& query_position, const R3Vector& query_normal, RNArray<R3M
 void R3MeshSearchTree::
 FindAll(const R3Point& query_position, const R3Vector& query_normal, RNArray<R3MeshIntersection *>& hits, 
   RNScalar min_distance, RNScalar max_distance, 
-  int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data)
+  int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data,
+  R3MeshSearchTreeContext *context)
 {
   // Check root
   if (!root) return;
 
-  // Update mark (used to avoid checking same face twice)
-  mark++;
+  // Start search with new marks (used to avoid checking same face twice)
+  R3MeshSearchTreeContext& search_context = (context) ? *context : default_context;
+  search_context.BeginSearch(nfaces);
 
   // Use squared distances for efficiency
   RNScalar min_distance_squared = min_distance * min_distance;
@@ -946,7 +1021,7 @@ FindAll(const R3Point& query_position, const R3Vector& query_normal, RNArray<R3M
   FindAll(query_position, query_normal, hits,
     min_distance_squared, max_distance_squared, 
     IsCompatible, compatible_data, 
-    root, BBox());
+    search_context, root, BBox());
 }
 
 
@@ -954,10 +1029,11 @@ FindAll(const R3Point& query_position, const R3Vector& query_normal, RNArray<R3M
 void R3MeshSearchTree::
 FindAll(const R3Point& query_position, RNArray<R3MeshIntersection *>& hits, 
   RNScalar min_distance, RNScalar max_distance,
-  int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data)
+  int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data,
+  R3MeshSearchTreeContext *context)
 {
   // Find closest point, ignoring normal
-  FindAll(query_position, R3zero_vector, hits, min_distance, max_distance, IsCompatible, compatible_data);
+  FindAll(query_position, R3zero_vector, hits, min_distance, max_distance, IsCompatible, compatible_data, context);
 }
 
 
@@ -1003,8 +1079,11 @@ void R3MeshSearchTree::
 FindIntersection(const R3Ray& ray, R3MeshIntersection& closest, 
   RNScalar min_t, RNScalar& max_t, 
   int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data,
-  R3MeshSearchTreeNode *node, const R3Box& node_box) const
+  R3MeshSearchTreeContext& context, R3MeshSearchTreeNode *node, const R3Box& node_box) const
 {
+  // Count node
+  context.nnodes++;
+
   // Find intersection with bounding box
   RNScalar node_box_t;
   if (!R3Intersects(ray, node_box, NULL, NULL, &node_box_t)) return;
@@ -1014,8 +1093,7 @@ FindIntersection(const R3Ray& ray, R3MeshIntersection& closest,
   for (int i = 0; i < node->big_faces.NEntries(); i++) {
     // Get face container and check mark
     R3MeshSearchTreeFace *face_container = node->big_faces[i];
-    if (face_container->mark == mark) continue;
-    face_container->mark = mark;
+    if (!context.Visit(face_container->index)) continue;
   
     // Find closest point in mesh face
     FindIntersection(ray, closest, min_t, max_t, 
@@ -1039,13 +1117,13 @@ FindIntersection(const R3Ray& ray, R3MeshIntersection& closest,
         R3Box child_box(node_box);
         child_box[RN_HI][node->split_dimension] = node->split_coordinate;
         FindIntersection(ray, closest, min_t, max_t,
-          IsCompatible, compatible_data, node->children[0], child_box);
+          IsCompatible, compatible_data, context, node->children[0], child_box);
       }
       if (plane_t < max_t) {
         R3Box child_box(node_box);
         child_box[RN_LO][node->split_dimension] = node->split_coordinate;
         FindIntersection(ray, closest, min_t, max_t, 
-          IsCompatible, compatible_data, node->children[1], child_box);
+          IsCompatible, compatible_data, context, node->children[1], child_box);
       }
     }
     else {
@@ -1054,13 +1132,13 @@ FindIntersection(const R3Ray& ray, R3MeshIntersection& closest,
         R3Box child_box(node_box);
         child_box[RN_LO][node->split_dimension] = node->split_coordinate;
         FindIntersection(ray, closest, min_t, max_t, 
-          IsCompatible, compatible_data, node->children[1], child_box);
+          IsCompatible, compatible_data, context, node->children[1], child_box);
       }
       if (plane_t < max_t) {
         R3Box child_box(node_box);
         child_box[RN_HI][node->split_dimension] = node->split_coordinate;
         FindIntersection(ray, closest, min_t, max_t,
-          IsCompatible, compatible_data, node->children[0], child_box);
+          IsCompatible, compatible_data, context, node->children[0], child_box);
       }
     }
   }
@@ -1069,8 +1147,7 @@ FindIntersection(const R3Ray& ray, R3MeshIntersection& closest,
     for (int i = 0; i < node->small_faces.NEntries(); i++) {
       // Get face container and check mark
       R3MeshSearchTreeFace *face_container = node->small_faces[i];
-      if (face_container->mark == mark) continue;
-      face_container->mark = mark;
+      if (!context.Visit(face_container->index)) continue;
 
       // Find closest point in mesh face
       FindIntersection(ray, closest, min_t, max_t,
@@ -1084,7 +1161,8 @@ FindIntersection(const R3Ray& ray, R3MeshIntersection& closest,
 void R3MeshSearchTree::
 FindIntersection(const R3Ray& ray, R3MeshIntersection& closest,
   RNScalar min_t, RNScalar max_t, 
-  int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data)
+  int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data,
+  R3MeshSearchTreeContext *context)
 {
   // Initialize result
   closest.type = R3_MESH_NULL_TYPE;
@@ -1097,14 +1175,15 @@ FindIntersection(const R3Ray& ray, R3MeshIntersection& closest,
   // Check root
   if (!root) return;
 
-  // Update mark (used to avoid checking same face twice)
-  mark++;
+  // Start search with new marks (used to avoid checking same face twice)
+  R3MeshSearchTreeContext& search_context = (context) ? *context : default_context;
+  search_context.BeginSearch(nfaces);
 
   // Search nodes recursively
   FindIntersection(ray, closest,
     min_t, max_t,
     IsCompatible, compatible_data, 
-    root, BBox());
+    search_context, root, BBox());
 }
 
 
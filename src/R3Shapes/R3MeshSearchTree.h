@@ -9,6 +9,36 @@ class R3MeshSearchTreeNode;
 
 
 
+// Search state declaration (one per thread searching at the same time)
+
+class R3MeshSearchTreeContext {
+public:
+  // Constructor/destructors
+  R3MeshSearchTreeContext(void);
+  ~R3MeshSearchTreeContext(void);
+
+  // Statistics functions
+  void ResetStatistics(void);
+
+public:
+  // Internal mark functions (used to avoid checking same face twice)
+  void BeginSearch(int nfaces);
+  RNBoolean Visit(int face_index);
+
+public:
+  // Internal data
+  RNMark *marks;
+  int nmarks;
+  RNMark mark;
+
+  // Statistics
+  long long nsearches;
+  long long nnodes;
+  long long nfaces;
+};
+
+
+
 // Class declaration
 
 class R3MeshSearchTree {
@@ -25,35 +55,38 @@ public:
   void InsertFace(R3MeshFace *face);
   void Empty(void);
 
+  // Search functions below leave the tree unchanged when given a context, so
+  // several threads can search one tree at once, each with its own context
+
   // Find mesh feature closest to a query point
   void FindClosest(const R3Point& query, R3MeshIntersection& closest,
     RNScalar min_distance = 0, RNScalar max_distance = RN_INFINITY,
     int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *) = NULL, 
-    void *compatible_data = NULL);
+    void *compatible_data = NULL, R3MeshSearchTreeContext *context = NULL);
 
   // Find mesh feature closest to a query point and normal
   void FindClosest(const R3Point& query, const R3Vector& normal, R3MeshIntersection& closest,
     RNScalar min_distance = 0, RNScalar max_distance = RN_INFINITY, 
     int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *) = NULL, 
-    void *compatible_data = NULL);
+    void *compatible_data = NULL, R3MeshSearchTreeContext *context = NULL);
 
   // Find all mesh features with distance from a query point
   void FindAll(const R3Point& query, RNArray<R3MeshIntersection *>& hits,
     RNScalar min_distance = 0, RNScalar max_distance = RN_INFINITY,
     int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *) = NULL, 
-    void *compatible_data = NULL);
+    void *compatible_data = NULL, R3MeshSearchTreeContext *context = NULL);
 
   // Find all mesh features with distance from a query point and normal
   void FindAll(const R3Point& query, const R3Vector& normal, RNArray<R3MeshIntersection *>& hits,
     RNScalar min_distance = 0, RNScalar max_distance = RN_INFINITY,
     int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *) = NULL, 
-    void *compatible_data = NULL);
+    void *compatible_data = NULL, R3MeshSearchTreeContext *context = NULL);
 
   // Find first ray intersection
   void FindIntersection(const R3Ray& ray, R3MeshIntersection& closest,
     RNScalar min_t = 0, RNScalar max_t = RN_INFINITY,
     int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *) = NULL, 
-    void *compatible_data = NULL);
+    void *compatible_data = NULL, R3MeshSearchTreeContext *context = NULL);
 
   // Visualization/debugging functions
   int NNodes(void) const;
@@ -71,7 +104,7 @@ public:
   void FindClosest(const R3Point& query, const R3Vector& normal, R3MeshIntersection& closest, 
     RNScalar min_distance_squared, RNScalar& max_distance_squared, 
     int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data,
-    R3MeshSearchTreeNode *node, const R3Box& node_box) const;
+    R3MeshSearchTreeContext& context, R3MeshSearchTreeNode *node, const R3Box& node_box) const;
   void FindClosest(const R3Point& query, const R3Vector& normal, R3MeshIntersection& closest, 
     RNScalar min_distance_squared, RNScalar& max_distance_squared, 
     int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data,
@@ -81,7 +114,7 @@ public:
   void FindAll(const R3Point& query, const R3Vector& normal, RNArray<R3MeshIntersection *>& hits,
     RNScalar min_distance_squared, RNScalar max_distance_squared, 
     int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data,
-    R3MeshSearchTreeNode *node, const R3Box& node_box) const;
+    R3MeshSearchTreeContext& context, R3MeshSearchTreeNode *node, const R3Box& node_box) const;
   void FindAll(const R3Point& query, const R3Vector& normal, RNArray<R3MeshIntersection *>& hits,
     RNScalar min_distance_squared, RNScalar max_distance_squared, 
     int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data,
@@ -91,7 +124,7 @@ public:
   void FindIntersection(const R3Ray& ray, R3MeshIntersection& closest, 
     RNScalar min_t, RNScalar& max_t, 
     int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data,
-    R3MeshSearchTreeNode *node, const R3Box& node_box) const;
+    R3MeshSearchTreeContext& context, R3MeshSearchTreeNode *node, const R3Box& node_box) const;
   void FindIntersection(const R3Ray& ray, R3MeshIntersection& closest, 
     RNScalar min_t, RNScalar& max_t, 
     int (*IsCompatible)(const R3Point&, const R3Vector&, R3Mesh *, R3MeshFace *, void *), void *compatible_data,
@@ -110,7 +143,8 @@ public:
   R3Mesh *mesh;
   R3MeshSearchTreeNode *root;
   int nnodes;
-  RNMark mark;
+  int nfaces;
+  R3MeshSearchTreeContext default_context;
 };
 
 
@@ -131,6 +165,18 @@ RNLength R3Distance(const R3MeshSearchTree& tree1, const R3MeshSearchTree& tree2
 // Inline functions
 ////////////////////////////////////////////////////////////////////////
 
+inline RNBoolean R3MeshSearchTreeContext::
+Visit(int face_index)
+{
+  // Mark face, returning FALSE if already visited during this search
+  if (marks[face_index] == mark) return FALSE;
+  marks[face_index] = mark;
+  nfaces++;
+  return TRUE;
+}
+
+
+
 inline R3Mesh *R3MeshSearchTree::
 Mesh(void) const
 {
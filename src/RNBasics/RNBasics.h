@@ -78,6 +78,8 @@
 /* OS utility include files */
 
 #include "RNTime.h"
+#include "RNThread.h"
+#include "RNProfile.h"
 
 
 
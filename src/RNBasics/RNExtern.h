@@ -24,6 +24,8 @@
 #   include <float.h>
 #   include <sys/time.h>
 #   include <sys/resource.h>
+#   include <unistd.h>
+#   include <pthread.h>
 #endif
 
 
@@ -0,0 +1,355 @@
+/* Source file for GAPS profiling timers and counters */
+
+
+
+/* Include files */
+
+#include "RNBasics.h"
+
+
+
+/* Private constants */
+
+#define RN_PROFILE_MAX_TIMERS 256
+#define RN_PROFILE_MAX_COUNTERS 64
+#define RN_PROFILE_MAX_SPANS (1 << 20)
+#define RN_PROFILE_MAX_SAMPLES (1 << 16)
+
+
+
+/* Private types */
+
+struct RNProfileTimer {
+    const char *name;
+    int count;
+    double seconds;
+    double last_seconds;
+};
+
+struct RNProfileSpan {
+    const char *name;
+    int thread;
+    double start;     // microseconds since profiling was enabled
+    double duration;  // microseconds
+};
+
+struct RNProfileSample {
+    double time;      // microseconds since profiling was enabled
+    int first_value;  // index of the count of counter 0
+    int nvalues;
+};
+
+
+
+/* Private variables */
+
+RNBoolean RNprofile_enabled = FALSE;
+static double RNprofile_origin = 0;
+static RNProfileTimer RNprofile_timers[RN_PROFILE_MAX_TIMERS];
+static int RNprofile_ntimers = 0;
+static RNProfileCounter *RNprofile_counters[RN_PROFILE_MAX_COUNTERS];
+static int RNprofile_ncounters = 0;
+static RNProfileSpan *RNprofile_spans = NULL;
+static int RNprofile_nspans = 0;
+static int RNprofile_nspans_allocated = 0;
+static RNProfileSample *RNprofile_samples = NULL;
+static long long *RNprofile_values = NULL;
+static int RNprofile_nsamples = 0;
+static int RNprofile_nsamples_allocated = 0;
+static int RNprofile_nthreads = 1;
+#if (RN_OS == RN_WINDOWS)
+    static __declspec(thread) int RNprofile_thread = -1;
+#else
+    static __thread int RNprofile_thread = -1;
+    static pthread_mutex_t RNprofile_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+
+/* Private functions */
+
+static void
+LockProfile(void)
+{
+    // Thread pools run jobs in the calling thread on Windows
+#   if (RN_OS != RN_WINDOWS)
+        pthread_mutex_lock(&RNprofile_mutex);
+#   endif
+}
+
+
+
+static void
+UnlockProfile(void)
+{
+#   if (RN_OS != RN_WINDOWS)
+        pthread_mutex_unlock(&RNprofile_mutex);
+#   endif
+}
+
+
+
+static void
+SampleCounters(double time)
+{
+    // Record the count of every counter (profile must be locked)
+    if (RNprofile_nsamples >= RN_PROFILE_MAX_SAMPLES) return;
+    if (RNprofile_nsamples == RNprofile_nsamples_allocated) {
+        int size = (RNprofile_nsamples_allocated > 0) ? 2 * RNprofile_nsamples_allocated : 256;
+        RNprofile_samples = (RNProfileSample *) realloc(RNprofile_samples, size * sizeof(RNProfileSample));
+        RNprofile_values = (long long *) realloc(RNprofile_values, size * RN_PROFILE_MAX_COUNTERS * sizeof(long long));
+        RNprofile_nsamples_allocated = size;
+    }
+    RNProfileSample& sample = RNprofile_samples[RNprofile_nsamples];
+    sample.time = time;
+    sample.first_value = RNprofile_nsamples * RN_PROFILE_MAX_COUNTERS;
+    sample.nvalues = RNprofile_ncounters;
+    for (int i = 0; i < RNprofile_ncounters; i++)
+        RNprofile_values[sample.first_value + i] = RNprofile_counters[i]->Count();
+    RNprofile_nsamples++;
+}
+
+
+
+static void
+RecordSpan(const char *name, double start, double end)
+{
+    LockProfile();
+
+    // Number threads in the order they first record a span
+    if (RNprofile_thread < 0) RNprofile_thread = RNprofile_nthreads++;
+
+    // Add to totals of the timer name
+    int k = 0;
+    while ((k < RNprofile_ntimers) && (RNprofile_timers[k].name != name) &&
+           strcmp(RNprofile_timers[k].name, name)) k++;
+    if ((k == RNprofile_ntimers) && (k < RN_PROFILE_MAX_TIMERS)) {
+        RNprofile_timers[k].name = name;
+        RNprofile_timers[k].count = 0;
+        RNprofile_timers[k].seconds = 0;
+        RNprofile_ntimers++;
+    }
+    if (k < RNprofile_ntimers) {
+        RNProfileTimer& timer = RNprofile_timers[k];
+        timer.count++;
+        timer.last_seconds = 1.0E-6 * (end - start);
+        timer.seconds += timer.last_seconds;
+    }
+
+    // Add span, while there is room
+    if (RNprofile_nspans < RN_PROFILE_MAX_SPANS) {
+        if (RNprofile_nspans == RNprofile_nspans_allocated) {
+            int size = (RNprofile_nspans_allocated > 0) ? 2 * RNprofile_nspans_allocated : 1024;
+            RNprofile_spans = (RNProfileSpan *) realloc(RNprofile_spans, size * sizeof(RNProfileSpan));
+            RNprofile_nspans_allocated = size;
+        }
+        RNProfileSpan& span = RNprofile_spans[RNprofile_nspans++];
+        span.name = name;
+        span.thread = RNprofile_thread;
+        span.start = start - RNprofile_origin;
+        span.duration = end - start;
+    }
+
+    // Sample counters at the end of spans of the main thread
+    if (RNprofile_thread == 0) SampleCounters(end - RNprofile_origin);
+
+    UnlockProfile();
+}
+
+
+
+/* Public functions */
+
+double
+RNProfileMicroseconds(void)
+{
+    // Return microseconds on a clock that never goes back
+#   if (RN_OS == RN_WINDOWS)
+        LARGE_INTEGER frequency, counter;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&counter);
+        return 1.0E6 * (double) counter.QuadPart / (double) frequency.QuadPart;
+#   else
+        struct timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return 1.0E6 * time.tv_sec + 1.0E-3 * time.tv_nsec;
+#   endif
+}
+
+
+
+void
+RNEnableProfile(RNBoolean enable)
+{
+    // The thread enabling the profile is the main thread, 0
+    LockProfile();
+    if (enable && !RNprofile_enabled && (RNprofile_nspans == 0) && (RNprofile_nsamples == 0)) {
+        RNprofile_origin = RNProfileMicroseconds();
+        RNprofile_thread = 0;
+    }
+    RNprofile_enabled = enable;
+    UnlockProfile();
+}
+
+
+
+void
+RNResetProfile(void)
+{
+    // Forget spans, samples, totals, and counts
+    LockProfile();
+    RNprofile_ntimers = 0;
+    RNprofile_nspans = 0;
+    RNprofile_nsamples = 0;
+    for (int i = 0; i < RNprofile_ncounters; i++)
+        RNprofile_counters[i]->Reset();
+    RNprofile_origin = RNProfileMicroseconds();
+    UnlockProfile();
+}
+
+
+
+int
+RNNProfileTimers(void)
+{
+    // Return number of timer names
+    return RNprofile_ntimers;
+}
+
+
+
+const char *
+RNProfileTimerName(int k)
+{
+    // Return name of kth timer
+    assert((k >= 0) && (k < RNprofile_ntimers));
+    return RNprofile_timers[k].name;
+}
+
+
+
+int
+RNProfileTimerCount(int k)
+{
+    // Return number of spans of kth timer
+    assert((k >= 0) && (k < RNprofile_ntimers));
+    return RNprofile_timers[k].count;
+}
+
+
+
+double
+RNProfileTimerSeconds(int k)
+{
+    // Return total seconds of kth timer
+    assert((k >= 0) && (k < RNprofile_ntimers));
+    return RNprofile_timers[k].seconds;
+}
+
+
+
+double
+RNProfileTimerLastSeconds(int k)
+{
+    // Return seconds of the last span of kth timer
+    assert((k >= 0) && (k < RNprofile_ntimers));
+    return RNprofile_timers[k].last_seconds;
+}
+
+
+
+int
+RNNProfileCounters(void)
+{
+    // Return number of counters
+    return RNprofile_ncounters;
+}
+
+
+
+const RNProfileCounter *
+RNKthProfileCounter(int k)
+{
+    // Return kth counter
+    assert((k >= 0) && (k < RNprofile_ncounters));
+    return RNprofile_counters[k];
+}
+
+
+
+int
+RNWriteProfile(const char *filename)
+{
+    // Open file
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        RNFail("Unable to open profile file %s", filename);
+        return 0;
+    }
+
+    // Write spans as complete events, and counter samples as counter events,
+    // in the trace event format read by chrome://tracing and Perfetto
+    LockProfile();
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int i = 0; i < RNprofile_nthreads; i++) {
+        fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}},\n",
+            i, (i == 0) ? "main" : "thread", i);
+    }
+    for (int i = 0; i < RNprofile_nspans; i++) {
+        const RNProfileSpan& span = RNprofile_spans[i];
+        fprintf(fp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f},\n",
+            span.name, span.thread, span.start, span.duration);
+    }
+    for (int i = 0; i < RNprofile_nsamples; i++) {
+        const RNProfileSample& sample = RNprofile_samples[i];
+        for (int j = 0; j < sample.nvalues; j++) {
+            fprintf(fp, "{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":0,\"ts\":%.3f,\"args\":{\"count\":%lld}},\n",
+                RNprofile_counters[j]->Name(), sample.time, RNprofile_values[sample.first_value + j]);
+        }
+    }
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"profile\"}}\n]}\n");
+    UnlockProfile();
+
+    // Close file
+    fclose(fp);
+
+    // Return success
+    return 1;
+}
+
+
+
+/* Scoped timer member functions */
+
+RNScopedTimer::
+RNScopedTimer(const char *name)
+    : name(name),
+      start((RNprofile_enabled) ? RNProfileMicroseconds() : -1)
+{
+}
+
+
+
+RNScopedTimer::
+~RNScopedTimer(void)
+{
+    // Record span, if profiling was enabled when it started
+    if (start < 0) return;
+    RecordSpan(name, start, RNProfileMicroseconds());
+}
+
+
+
+/* Counter member functions */
+
+RNProfileCounter::
+RNProfileCounter(const char *name)
+    : name(name),
+      count(0)
+{
+    // Register counter (counters past the maximum are counted, not listed)
+    LockProfile();
+    if (RNprofile_ncounters < RN_PROFILE_MAX_COUNTERS)
+        RNprofile_counters[RNprofile_ncounters++] = this;
+    UnlockProfile();
+}
@@ -0,0 +1,124 @@
+/* Include file for GAPS profiling timers and counters */
+
+
+
+/* Class definitions */
+
+class RNScopedTimer /* : public RNBase */ {
+    // Adds the time from its construction to its destruction to the profile,
+    // as a span of the calling thread, if profiling is enabled. The name is
+    // kept, not copied, so it should be a string literal
+    public:
+        // Constructor functions
+        RNScopedTimer(const char *name);
+        ~RNScopedTimer(void);
+
+    private:
+        const char *name;
+        double start;  // microseconds, or negative if profiling was disabled
+};
+
+class RNProfileCounter /* : public RNBase */ {
+    // Named count, added to by any thread while profiling is enabled. Counters
+    // are meant to be static variables, and register themselves
+    public:
+        // Constructor functions
+        RNProfileCounter(const char *name);
+
+        // Property functions
+        const char *Name(void) const;
+        long long Count(void) const;
+
+        // Manipulation functions
+        void Add(long long n = 1);
+        void Reset(void);
+
+    private:
+        const char *name;
+        long long count;
+};
+
+
+
+/* Public functions */
+
+void RNEnableProfile(RNBoolean enable = TRUE);
+RNBoolean RNIsProfileEnabled(void);
+void RNResetProfile(void);
+
+// Microseconds on a monotonic clock
+double RNProfileMicroseconds(void);
+
+// Totals of each timer name, in order of first use
+int RNNProfileTimers(void);
+const char *RNProfileTimerName(int k);
+int RNProfileTimerCount(int k);
+double RNProfileTimerSeconds(int k);
+double RNProfileTimerLastSeconds(int k);
+
+// Registered counters
+int RNNProfileCounters(void);
+const RNProfileCounter *RNKthProfileCounter(int k);
+
+// Writes spans and counter samples as Chrome trace-event JSON
+int RNWriteProfile(const char *filename);
+
+
+
+/* Private variables */
+
+extern RNBoolean RNprofile_enabled;
+
+
+
+/* Inline functions */
+
+inline RNBoolean
+RNIsProfileEnabled(void)
+{
+    // Return whether timers and counters are recorded
+    return RNprofile_enabled;
+}
+
+
+
+inline const char *RNProfileCounter::
+Name(void) const
+{
+    // Return name
+    return name;
+}
+
+
+
+inline long long RNProfileCounter::
+Count(void) const
+{
+    // Return count
+    return count;
+}
+
+
+
+inline void RNProfileCounter::
+Add(long long n)
+{
+    // Add to count, atomically where the compiler allows it
+    if (!RNprofile_enabled) return;
+#   if defined(__GNUC__)
+        __sync_fetch_and_add(&count, n);
+#   elif (RN_OS == RN_WINDOWS)
+        InterlockedExchangeAdd64(&count, n);
+#   else
+        count += n;
+#   endif
+}
+
+
+
+inline void RNProfileCounter::
+Reset(void)
+{
+    // Reset count
+    count = 0;
+}
@@ -0,0 +1,170 @@
+/* Source file for GAPS thread pool class */
+
+
+
+/* Include files */
+
+#include "RNBasics.h"
+
+
+
+int 
+RNNumProcessors(void)
+{
+    // Return number of processors available to this process
+#   if (RN_OS == RN_WINDOWS)
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return (info.dwNumberOfProcessors > 0) ? info.dwNumberOfProcessors : 1;
+#   else
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return (n > 0) ? (int) n : 1;
+#   endif
+}
+
+
+
+RNThreadPool::
+RNThreadPool(int nthreads)
+    : nthreads(nthreads),
+      function(NULL),
+      data(NULL),
+      njobs(0),
+      next_job(0),
+      nactive(0),
+      generation(0),
+      stop(0)
+{
+    // Use all processors if no thread count was given
+    if (this->nthreads <= 0) this->nthreads = RNNumProcessors();
+
+#   if (RN_OS == RN_WINDOWS)
+        // Jobs run in the calling thread
+        this->nthreads = 1;
+#   else
+        // Initialize synchronization
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&start_condition, NULL);
+        pthread_cond_init(&done_condition, NULL);
+
+        // Start worker threads (the calling thread is also a worker)
+        threads = NULL;
+        if (this->nthreads > 1) {
+            threads = new pthread_t [ this->nthreads - 1 ];
+            for (int i = 0; i < this->nthreads - 1; i++) {
+                if (pthread_create(&threads[i], NULL, Work, this) != 0) {
+                    RNWarning("Unable to create thread %d\n", i);
+                    this->nthreads = i + 1;
+                    break;
+                }
+            }
+        }
+#   endif
+}
+
+
+
+RNThreadPool::
+~RNThreadPool(void)
+{
+#   if (RN_OS != RN_WINDOWS)
+        // Stop worker threads
+        pthread_mutex_lock(&mutex);
+        stop = 1;
+        pthread_cond_broadcast(&start_condition);
+        pthread_mutex_unlock(&mutex);
+        for (int i = 0; i < nthreads - 1; i++) pthread_join(threads[i], NULL);
+        if (threads) delete [] threads;
+
+        // Destroy synchronization
+        pthread_cond_destroy(&done_condition);
+        pthread_cond_destroy(&start_condition);
+        pthread_mutex_destroy(&mutex);
+#   endif
+}
+
+
+
+int RNThreadPool::
+NextJob(void)
+{
+    // Return index of next unclaimed job, or -1 if none (mutex must be held)
+    if (next_job >= njobs) return -1;
+    return next_job++;
+}
+
+
+
+void RNThreadPool::
+Run(int njobs, void (*function)(int job, void *data), void *data)
+{
+    // Run jobs serially if there is nobody to share them with
+    if ((nthreads <= 1) || (njobs <= 1)) {
+        for (int job = 0; job < njobs; job++) (*function)(job, data);
+        return;
+    }
+
+#   if (RN_OS != RN_WINDOWS)
+        // Publish jobs and wake up workers
+        pthread_mutex_lock(&mutex);
+        this->function = function;
+        this->data = data;
+        this->njobs = njobs;
+        this->next_job = 0;
+        this->nactive = 1;
+        this->generation++;
+        pthread_cond_broadcast(&start_condition);
+
+        // Take a share of the jobs in the calling thread
+        int job;
+        while ((job = NextJob()) >= 0) {
+            pthread_mutex_unlock(&mutex);
+            (*function)(job, data);
+            pthread_mutex_lock(&mutex);
+        }
+
+        // Wait for workers to finish their last jobs
+        nactive--;
+        while (nactive > 0) pthread_cond_wait(&done_condition, &mutex);
+        pthread_mutex_unlock(&mutex);
+#   endif
+}
+
+
+
+void *RNThreadPool::
+Work(void *ptr)
+{
+#   if (RN_OS != RN_WINDOWS)
+        RNThreadPool *pool = (RNThreadPool *) ptr;
+        int last_generation = 0;
+
+        pthread_mutex_lock(&pool->mutex);
+        while (TRUE) {
+            // Wait for new jobs
+            while (!pool->stop && (pool->generation == last_generation))
+                pthread_cond_wait(&pool->start_condition, &pool->mutex);
+            if (pool->stop) break;
+            last_generation = pool->generation;
+
+            // Process jobs until there are none left
+            pool->nactive++;
+            int job;
+            while ((job = pool->NextJob()) >= 0) {
+                pthread_mutex_unlock(&pool->mutex);
+                (*pool->function)(job, pool->data);
+                pthread_mutex_lock(&pool->mutex);
+            }
+
+            // Signal completion
+            if (--pool->nactive == 0) pthread_cond_signal(&pool->done_condition);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+#   endif
+
+    // Return nothing
+    return NULL;
+}
+
+
+
@@ -0,0 +1,58 @@
+/* Include file for GAPS thread pool class */
+
+
+
+/* Class definition */
+
+class RNThreadPool /* : public RNBase */ {
+    public:
+        // Constructor functions
+        RNThreadPool(int nthreads = 0);
+        ~RNThreadPool(void);
+
+        // Property functions
+        int NThreads(void) const;
+
+        // Execution functions
+        void Run(int njobs, void (*function)(int job, void *data), void *data);
+
+    private:
+        static void *Work(void *pool);
+        int NextJob(void);
+
+    private:
+        int nthreads;
+        void (*function)(int job, void *data);
+        void *data;
+        int njobs;
+        int next_job;
+        int nactive;
+        int generation;
+        int stop;
+#       if (RN_OS != RN_WINDOWS)
+            pthread_t *threads;
+            pthread_mutex_t mutex;
+            pthread_cond_t start_condition;
+            pthread_cond_t done_condition;
+#       endif
+};
+
+
+
+/* Public functions */
+
+int RNNumProcessors(void);
+
+
+
+/* Inline functions */
+
+inline int RNThreadPool::
+NThreads(void) const
+{
+    // Return number of threads (including the calling thread)
+    return nthreads;
+}
+
+
+
@@ -0,0 +1,232 @@
+// Source file for the batch wall kernels
+
+// Include files
+
+#include "WallKernel.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSE2__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define WALLKERNEL_AVX
+#endif
+
+
+
+void SetupQuadPlanes(QuadPlanes& planes, const RNScalar qx[4], const RNScalar qy[4], RNScalar sx, RNScalar sy)
+{
+  // Flip normals of clockwise quads so they always point outwards
+  RNScalar area = 0;
+  for (int k = 0; k < 4; k++) area += qx[k] * qy[(k+1)%4] - qx[(k+1)%4] * qy[k];
+  RNScalar orientation = (area < 0) ? -1.0 : 1.0;
+
+  for (int k = 0; k < 4; k++) {
+    planes.nx[k] = orientation * (qy[(k+1)%4] - qy[k]);
+    planes.ny[k] = orientation * (qx[k] - qx[(k+1)%4]);
+    planes.c[k] = qx[k] * planes.nx[k] + qy[k] * planes.ny[k];
+    planes.s[k] = sx * planes.nx[k] + sy * planes.ny[k];
+  }
+
+  // A flat quad has no inside; make its first plane reject every point
+  if (area == 0) {
+    planes.nx[0] = planes.ny[0] = planes.s[0] = 0;
+    planes.c[0] = -1;
+  }
+}
+
+
+
+// Liang-Barsky clip of the segment p + t (source - p), t in [0,1], against
+// the four planes. With num = c - p.n and den = s - p.n, each plane requires
+// t * den <= num: an upper bound on t if den > 0, a lower bound if den < 0,
+// and all or nothing if den == 0. Returns the clipped fraction of the segment.
+RNScalar QuadFraction(const QuadPlanes& planes, RNScalar x, RNScalar y)
+{
+  RNScalar lo = 0, hi = 1;
+  for (int k = 0; k < 4; k++) {
+    RNScalar pn = x * planes.nx[k] + y * planes.ny[k];
+    RNScalar num = planes.c[k] - pn;
+    RNScalar den = planes.s[k] - pn;
+    if (den > 0) { RNScalar t = num / den; if (t < hi) hi = t; }
+    else if (den < 0) { RNScalar t = num / den; if (t > lo) lo = t; }
+    else if (num < 0) hi = -RN_INFINITY;
+  }
+  return (hi > lo) ? hi - lo : 0;
+}
+
+
+
+// Same clip as QuadFraction, with the branches turned into selects, over the
+// points that fill whole vectors. Expanded once per instruction set below,
+// inside a namespace defining Vector, WIDTH and the wrappers it calls, with
+// the target attribute its functions are compiled for. Returns the number
+// of points done
+#define WALLKERNEL_QUAD_PATH_VECTORS(TARGET) \
+TARGET static int QuadPathVectors(const QuadPlanes& planes, RNScalar mu, \
+  RNScalar sx, RNScalar sy, RNScalar sz, \
+  int n, const RNScalar *x, const RNScalar *y, RNScalar *path) \
+{ \
+  int i = 0; \
+  Vector zero = Set1(0), one = Set1(1); \
+  Vector plus_infinity = Set1(RN_INFINITY), minus_infinity = Set1(-RN_INFINITY); \
+  Vector vsx = Set1(sx), vsy = Set1(sy), vsz2 = Set1(sz * sz), vmu = Set1(mu); \
+  Vector nx[4], ny[4], c[4], s[4]; \
+  for (int k = 0; k < 4; k++) { \
+    nx[k] = Set1(planes.nx[k]); ny[k] = Set1(planes.ny[k]); \
+    c[k] = Set1(planes.c[k]); s[k] = Set1(planes.s[k]); \
+  } \
+  for (; i + WIDTH <= n; i += WIDTH) { \
+    Vector vx = Load(&x[i]), vy = Load(&y[i]); \
+    Vector lo = zero, hi = one; \
+    for (int k = 0; k < 4; k++) { \
+      Vector pn = Add(Mul(vx, nx[k]), Mul(vy, ny[k])); \
+      Vector num = Sub(c[k], pn); \
+      Vector den = Sub(s[k], pn); \
+      Vector t = Div(num, den); \
+      Vector blocked = And(Equal(den, zero), Less(num, zero)); \
+      lo = Max(lo, Select(Less(den, zero), t, minus_infinity)); \
+      hi = Min(hi, Select(Less(zero, den), t, Select(blocked, minus_infinity, plus_infinity))); \
+    } \
+    Vector dx = Sub(vsx, vx), dy = Sub(vsy, vy); \
+    Vector length = Sqrt(Add(Add(Mul(dx, dx), Mul(dy, dy)), vsz2)); \
+    Vector chord = Mul(Max(Sub(hi, lo), zero), length); \
+    Store(&path[i], Add(Load(&path[i]), Mul(vmu, chord))); \
+  } \
+  return i; \
+}
+
+
+
+#if defined(__SSE2__)
+
+// 2 points per instruction; SSE2 is always there on x86-64
+namespace WallKernelSSE2 {
+typedef __m128d Vector;
+static const int WIDTH = 2;
+static inline Vector Set1(RNScalar a) { return _mm_set1_pd(a); }
+static inline Vector Load(const RNScalar *p) { return _mm_loadu_pd(p); }
+static inline void Store(RNScalar *p, Vector a) { _mm_storeu_pd(p, a); }
+static inline Vector Add(Vector a, Vector b) { return _mm_add_pd(a, b); }
+static inline Vector Sub(Vector a, Vector b) { return _mm_sub_pd(a, b); }
+static inline Vector Mul(Vector a, Vector b) { return _mm_mul_pd(a, b); }
+static inline Vector Div(Vector a, Vector b) { return _mm_div_pd(a, b); }
+static inline Vector Min(Vector a, Vector b) { return _mm_min_pd(a, b); }
+static inline Vector Max(Vector a, Vector b) { return _mm_max_pd(a, b); }
+static inline Vector Sqrt(Vector a) { return _mm_sqrt_pd(a); }
+static inline Vector Less(Vector a, Vector b) { return _mm_cmplt_pd(a, b); }
+static inline Vector Equal(Vector a, Vector b) { return _mm_cmpeq_pd(a, b); }
+static inline Vector And(Vector a, Vector b) { return _mm_and_pd(a, b); }
+static inline Vector Select(Vector mask, Vector a, Vector b) { return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b)); }
+WALLKERNEL_QUAD_PATH_VECTORS()
+}
+
+#endif
+
+
+
+#if defined(WALLKERNEL_AVX)
+
+// 4 points per instruction, compiled for AVX whatever the build flags, and
+// used only if the processor has it
+#define WALLKERNEL_AVX_TARGET __attribute__((target("avx")))
+namespace WallKernelAVX {
+typedef __m256d Vector;
+static const int WIDTH = 4;
+WALLKERNEL_AVX_TARGET static inline Vector Set1(RNScalar a) { return _mm256_set1_pd(a); }
+WALLKERNEL_AVX_TARGET static inline Vector Load(const RNScalar *p) { return _mm256_loadu_pd(p); }
+WALLKERNEL_AVX_TARGET static inline void Store(RNScalar *p, Vector a) { _mm256_storeu_pd(p, a); }
+WALLKERNEL_AVX_TARGET static inline Vector Add(Vector a, Vector b) { return _mm256_add_pd(a, b); }
+WALLKERNEL_AVX_TARGET static inline Vector Sub(Vector a, Vector b) { return _mm256_sub_pd(a, b); }
+WALLKERNEL_AVX_TARGET static inline Vector Mul(Vector a, Vector b) { return _mm256_mul_pd(a, b); }
+WALLKERNEL_AVX_TARGET static inline Vector Div(Vector a, Vector b) { return _mm256_div_pd(a, b); }
+WALLKERNEL_AVX_TARGET static inline Vector Min(Vector a, Vector b) { return _mm256_min_pd(a, b); }
+WALLKERNEL_AVX_TARGET static inline Vector Max(Vector a, Vector b) { return _mm256_max_pd(a, b); }
+WALLKERNEL_AVX_TARGET static inline Vector Sqrt(Vector a) { return _mm256_sqrt_pd(a); }
+WALLKERNEL_AVX_TARGET static inline Vector Less(Vector a, Vector b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+WALLKERNEL_AVX_TARGET static inline Vector Equal(Vector a, Vector b) { return _mm256_cmp_pd(a, b, _CMP_EQ_OQ); }
+WALLKERNEL_AVX_TARGET static inline Vector And(Vector a, Vector b) { return _mm256_and_pd(a, b); }
+WALLKERNEL_AVX_TARGET static inline Vector Select(Vector mask, Vector a, Vector b) { return _mm256_blendv_pd(b, a, mask); }
+WALLKERNEL_QUAD_PATH_VECTORS(WALLKERNEL_AVX_TARGET)
+}
+
+#endif
+
+
+
+static int DetectWallKernelWidth(void)
+{
+  // Check the processor for the widest vectors built
+#if defined(WALLKERNEL_AVX)
+  __builtin_cpu_init();
+  return (__builtin_cpu_supports("avx")) ? 4 : 2;
+#elif defined(__SSE2__)
+  return 2;
+#else
+  return 1;
+#endif
+}
+
+
+
+// Widest vectors allowed, set before main so threads only ever read it
+static int wallkernel_width = DetectWallKernelWidth();
+
+
+
+int WallKernelWidth(void)
+{
+  // Return widest vectors allowed
+  return wallkernel_width;
+}
+
+
+
+void WallKernelLimitWidth(int width)
+{
+  // Round down to a width that is built
+  if (width >= wallkernel_width) return;
+  wallkernel_width = (width >= 2) ? 2 : 1;
+}
+
+
+
+void QuadPathBatch(const RNScalar qx[4], const RNScalar qy[4], RNScalar mu,
+  RNScalar sx, RNScalar sy, RNScalar sz,
+  int n, const RNScalar *x, const RNScalar *y, RNScalar *path)
+{
+  // Precompute planes once for the whole batch
+  QuadPlanes planes;
+  SetupQuadPlanes(planes, qx, qy, sx, sy);
+  int i = 0;
+
+  // Whole vectors
+  int width = WallKernelWidth();
+#if defined(WALLKERNEL_AVX)
+  if (width == 4) i = WallKernelAVX::QuadPathVectors(planes, mu, sx, sy, sz, n, x, y, path);
+#endif
+#if defined(__SSE2__)
+  if (width == 2) i = WallKernelSSE2::QuadPathVectors(planes, mu, sx, sy, sz, n, x, y, path);
+#endif
+
+  // Remaining points
+  for (; i < n; i++) {
+    RNScalar dx = sx - x[i], dy = sy - y[i];
+    RNScalar length = sqrt(dx * dx + dy * dy + sz * sz);
+    path[i] += mu * (QuadFraction(planes, x[i], y[i]) * length);
+  }
+}
+
+
+
+void StrengthBatch(RNScalar sx, RNScalar sy, RNScalar sz, RNScalar scale,
+  int n, const RNScalar *x, const RNScalar *y, const RNScalar *path, RNScalar *values)
+{
+  // One exp per point, after all walls have been summed into path. This
+  // stays scalar: there is no vector exp instruction, and the loop is run
+  // once per source and row, not once per wall like QuadPathBatch
+  for (int i = 0; i < n; i++) {
+    RNScalar dx = sx - x[i], dy = sy - y[i];
+    RNScalar r2 = dx * dx + dy * dy + sz * sz;
+    values[i] += scale * exp(-path[i]) / r2;
+  }
+}
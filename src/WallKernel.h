@@ -0,0 +1,45 @@
+#ifndef __WALLKERNEL__H__
+#define __WALLKERNEL__H__
+
+#include "RNBasics/RNBasics.h"
+
+// Batch kernels evaluating one source against many grid points at once.
+// Points are passed as a structure of arrays (x[i], y[i]) at z = 0 and the
+// source at (sx, sy, sz). On x86 with GCC or Clang, QuadPathBatch is built
+// for both SSE2 and AVX, and picks at run time: 4 points per instruction if
+// the processor has AVX, 2 otherwise, and one at a time on other targets.
+// StrengthBatch is scalar.
+
+// Clipping planes of a quad as seen from one source: a point p is inside
+// edge k when p . n[k] <= c[k], and s[k] = source . n[k]
+struct QuadPlanes {
+  RNScalar nx[4], ny[4];
+  RNScalar c[4];
+  RNScalar s[4];
+};
+
+// sets up planes of the convex quad (qx[k], qy[k]) for a source at (sx, sy)
+void SetupQuadPlanes(QuadPlanes& planes, const RNScalar qx[4], const RNScalar qy[4], RNScalar sx, RNScalar sy);
+
+// returns the fraction of the segment from (x, y) to the source inside the quad
+RNScalar QuadFraction(const QuadPlanes& planes, RNScalar x, RNScalar y);
+
+// returns the number of points QuadPathBatch clips per instruction
+int WallKernelWidth(void);
+
+// limits QuadPathBatch to at most width points per instruction (1 for scalar);
+//   call before starting threads
+void WallKernelLimitWidth(int width);
+
+// adds mu times the length of each point-to-source segment inside the convex
+//   quad (qx[k], qy[k]), k = 0..3, to path[i]. Either winding order works
+void QuadPathBatch(const RNScalar qx[4], const RNScalar qy[4], RNScalar mu,
+  RNScalar sx, RNScalar sy, RNScalar sz,
+  int n, const RNScalar *x, const RNScalar *y, RNScalar *path);
+
+// adds scale * exp(-path[i]) / r^2 to values[i], where r is the distance
+//   from point i to the source
+void StrengthBatch(RNScalar sx, RNScalar sy, RNScalar sz, RNScalar scale,
+  int n, const RNScalar *x, const RNScalar *y, const RNScalar *path, RNScalar *values);
+
+#endif
@@ -0,0 +1,819 @@
+// Source file for the compiled wall table
+
+// Include files
+
+#include "WallSet.h"
+
+
+
+// Tessellation resolution for curved solids
+static const int WALLSET_SLICES = 32;
+static const int WALLSET_STACKS = 16;
+
+// Wall bounds clipped against segments by MayIntersect (when profiling)
+static RNProfileCounter wallset_walls_tested("Walls tested");
+
+
+
+// reallocates array with room for n entries, keeping the first count
+template <class T>
+static void Grow(T *&array, int count, int n)
+{
+  T *grown = new T [n];
+  for (int i = 0; i < count; i++) grown[i] = array[i];
+  if (array) delete [] array;
+  array = grown;
+}
+
+
+
+WallCells::
+WallCells(void)
+  : ncx(0),
+    ncy(0),
+    x0(0),
+    y0(0),
+    cw(1),
+    ch(1),
+    cell_first(NULL),
+    cell_boxes(NULL)
+{
+}
+
+
+
+WallCells::
+~WallCells(void)
+{
+  Empty();
+}
+
+
+
+void WallCells::
+Empty(void)
+{
+  // Delete arrays
+  if (cell_first) delete [] cell_first;
+  if (cell_boxes) delete [] cell_boxes;
+  cell_first = cell_boxes = NULL;
+  ncx = ncy = 0;
+}
+
+
+
+void WallCells::
+Build(int nboxes, const R2Box *boxes)
+{
+  // Find extent of non-empty boxes
+  Empty();
+  R2Box extent = R2null_box;
+  int nused = 0;
+  for (int i = 0; i < nboxes; i++) {
+    if (boxes[i].IsEmpty()) continue;
+    extent.Union(boxes[i]);
+    nused++;
+  }
+  if (nused == 0) return;
+
+  // About one cell per box, roughly square cells
+  RNScalar w = extent.XLength() + 2 * RN_EPSILON;
+  RNScalar h = extent.YLength() + 2 * RN_EPSILON;
+  ncx = (int) (sqrt(nused * w / h) + 0.5);
+  ncy = (int) (sqrt(nused * h / w) + 0.5);
+  if (ncx < 1) ncx = 1;
+  if (ncy < 1) ncy = 1;
+  if (ncx > 1024) ncx = 1024;
+  if (ncy > 1024) ncy = 1024;
+  x0 = extent.XMin() - RN_EPSILON;
+  y0 = extent.YMin() - RN_EPSILON;
+  cw = w / ncx;
+  ch = h / ncy;
+
+  // Count boxes per cell, then fill cells (compressed rows)
+  cell_first = new int [ncx * ncy + 1];
+  for (int c = 0; c <= ncx * ncy; c++) cell_first[c] = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < nboxes; i++) {
+      if (boxes[i].IsEmpty()) continue;
+      // Boxes get a little slack so segments grazing them still find them
+      int ix1 = (int) floor((boxes[i].XMin() - RN_EPSILON - x0) / cw);
+      int ix2 = (int) floor((boxes[i].XMax() + RN_EPSILON - x0) / cw);
+      int iy1 = (int) floor((boxes[i].YMin() - RN_EPSILON - y0) / ch);
+      int iy2 = (int) floor((boxes[i].YMax() + RN_EPSILON - y0) / ch);
+      if (ix1 < 0) ix1 = 0;
+      if (iy1 < 0) iy1 = 0;
+      if (ix2 >= ncx) ix2 = ncx - 1;
+      if (iy2 >= ncy) iy2 = ncy - 1;
+      for (int ix = ix1; ix <= ix2; ix++) {
+        for (int iy = iy1; iy <= iy2; iy++) {
+          int c = iy * ncx + ix;
+          if (pass == 0) cell_first[c + 1]++;
+          else cell_boxes[cell_first[c]++] = i;
+        }
+      }
+    }
+    if (pass == 0) {
+      for (int c = 0; c < ncx * ncy; c++) cell_first[c + 1] += cell_first[c];
+      cell_boxes = new int [cell_first[ncx * ncy]];
+    }
+    else {
+      // Filling advanced each start to the next cell's start; shift back
+      for (int c = ncx * ncy; c > 0; c--) cell_first[c] = cell_first[c - 1];
+      cell_first[0] = 0;
+    }
+  }
+}
+
+
+
+RNBoolean WallCells::
+Walk(const R3Point& p1, const R3Point& p2, RNBoolean (*visit)(int box, void *data), void *data) const
+{
+  // Clip segment to extent of cells
+  if (ncx == 0) return FALSE;
+  RNScalar x = p1.X(), y = p1.Y();
+  RNScalar dx = p2.X() - x, dy = p2.Y() - y;
+  RNScalar t1 = 0, t2 = 1;
+  RNScalar p[4] = { -dx, dx, -dy, dy };
+  RNScalar q[4] = { x - x0, x0 + ncx * cw - x, y - y0, y0 + ncy * ch - y };
+  for (int k = 0; k < 4; k++) {
+    if (p[k] == 0) {
+      if (q[k] < 0) return FALSE;
+    }
+    else {
+      RNScalar t = q[k] / p[k];
+      if (p[k] < 0) { if (t > t1) t1 = t; }
+      else { if (t < t2) t2 = t; }
+    }
+  }
+  if (t1 > t2) return FALSE;
+
+  // Find first and last cells
+  int ix = (int) floor((x + t1 * dx - x0) / cw), iy = (int) floor((y + t1 * dy - y0) / ch);
+  int ex = (int) floor((x + t2 * dx - x0) / cw), ey = (int) floor((y + t2 * dy - y0) / ch);
+  if (ix < 0) ix = 0; else if (ix >= ncx) ix = ncx - 1;
+  if (iy < 0) iy = 0; else if (iy >= ncy) iy = ncy - 1;
+  if (ex < 0) ex = 0; else if (ex >= ncx) ex = ncx - 1;
+  if (ey < 0) ey = 0; else if (ey >= ncy) ey = ncy - 1;
+
+  // Segment parameter at next cell boundary in x and y, and per cell step
+  int stepx = (dx > 0) ? 1 : -1, stepy = (dy > 0) ? 1 : -1;
+  RNScalar tx = (dx != 0) ? (x0 + (ix + (dx > 0)) * cw - x) / dx : RN_INFINITY;
+  RNScalar ty = (dy != 0) ? (y0 + (iy + (dy > 0)) * ch - y) / dy : RN_INFINITY;
+  RNScalar tdx = (dx != 0) ? cw / fabs(dx) : RN_INFINITY;
+  RNScalar tdy = (dy != 0) ? ch / fabs(dy) : RN_INFINITY;
+
+  // Walk cells
+  while (TRUE) {
+    int c = iy * ncx + ix;
+    for (int i = cell_first[c]; i < cell_first[c + 1]; i++)
+      if ((*visit)(cell_boxes[i], data)) return TRUE;
+    if ((ix == ex) && (iy == ey)) break;
+    if (((tx < ty) ? tx : ty) > t2) break;
+    if (tx < ty) { ix += stepx; tx += tdx; }
+    else { iy += stepy; ty += tdy; }
+    if ((ix < 0) || (ix >= ncx) || (iy < 0) || (iy >= ncy)) break;
+  }
+
+  // No visit stopped the walk
+  return FALSE;
+}
+
+
+
+RNBoolean WallCells::
+Walk(const R3Point& p1, const R3Point& p2, const R3Point& p3,
+  RNBoolean (*visit)(int box, void *data), void *data) const
+{
+  // Find columns overlapped by triangle
+  if (ncx == 0) return FALSE;
+  const R3Point *p[3] = { &p1, &p2, &p3 };
+  RNScalar xmin = p1.X(), xmax = p1.X();
+  for (int k = 1; k < 3; k++) {
+    if (p[k]->X() < xmin) xmin = p[k]->X();
+    if (p[k]->X() > xmax) xmax = p[k]->X();
+  }
+  int ix1 = (int) floor((xmin - x0) / cw), ix2 = (int) floor((xmax - x0) / cw);
+  if (ix1 < 0) ix1 = 0;
+  if (ix2 >= ncx) ix2 = ncx - 1;
+
+  // Visit each column over the y range of the triangle clipped to it
+  for (int ix = ix1; ix <= ix2; ix++) {
+    RNScalar xa = x0 + ix * cw, xb = xa + cw;
+    if (xa < xmin) xa = xmin;
+    if (xb > xmax) xb = xmax;
+    RNScalar ymin = RN_INFINITY, ymax = -RN_INFINITY;
+    for (int k = 0; k < 3; k++) {
+      // Clip edge to the column
+      const R3Point& a = *p[k];
+      const R3Point& b = *p[(k+1)%3];
+      RNScalar dx = b.X() - a.X(), dy = b.Y() - a.Y();
+      RNScalar t1 = 0, t2 = 1;
+      if (dx != 0) {
+        RNScalar ta = (xa - a.X()) / dx, tb = (xb - a.X()) / dx;
+        if (ta > tb) { RNScalar t = ta; ta = tb; tb = t; }
+        if (ta > t1) t1 = ta;
+        if (tb < t2) t2 = tb;
+      }
+      else if ((a.X() < xa) || (a.X() > xb)) continue;
+      if (t1 > t2) continue;
+      RNScalar ya = a.Y() + t1 * dy, yb = a.Y() + t2 * dy;
+      if (ya < ymin) ymin = ya;
+      if (ya > ymax) ymax = ya;
+      if (yb < ymin) ymin = yb;
+      if (yb > ymax) ymax = yb;
+    }
+    if (ymin > ymax) continue;
+    int iy1 = (int) floor((ymin - y0) / ch), iy2 = (int) floor((ymax - y0) / ch);
+    if (iy1 < 0) iy1 = 0;
+    if (iy2 >= ncy) iy2 = ncy - 1;
+    for (int iy = iy1; iy <= iy2; iy++) {
+      int c = iy * ncx + ix;
+      for (int i = cell_first[c]; i < cell_first[c + 1]; i++)
+        if ((*visit)(cell_boxes[i], data)) return TRUE;
+    }
+  }
+
+  // No visit stopped the walk
+  return FALSE;
+}
+
+
+
+WallSet::
+WallSet(void)
+  : nwalls(0),
+    nallocated(0),
+    types(NULL),
+    first(NULL),
+    nverts(NULL),
+    mu(NULL),
+    bboxes(NULL),
+    elements(NULL),
+    npoints(0),
+    npoints_allocated(0),
+    px(NULL),
+    py(NULL),
+    pz(NULL),
+    nbounds(0),
+    nbounds_allocated(0),
+    bounds(NULL)
+{
+}
+
+
+
+WallSet::
+~WallSet(void)
+{
+  Empty();
+}
+
+
+
+void WallSet::
+Empty(void)
+{
+  // Delete arrays
+  if (types) delete [] types;
+  if (first) delete [] first;
+  if (nverts) delete [] nverts;
+  if (mu) delete [] mu;
+  if (bboxes) delete [] bboxes;
+  if (elements) delete [] elements;
+  if (px) delete [] px;
+  if (py) delete [] py;
+  if (pz) delete [] pz;
+  if (bounds) delete [] bounds;
+  wall_cells.Empty();
+  bound_cells.Empty();
+  types = first = nverts = NULL;
+  mu = px = py = pz = NULL;
+  bboxes = NULL;
+  bounds = NULL;
+  elements = NULL;
+
+  // Reset counts
+  nwalls = nallocated = 0;
+  npoints = npoints_allocated = 0;
+  nbounds = nbounds_allocated = 0;
+}
+
+
+
+void WallSet::
+Compile(R3Scene *scene)
+{
+  // Rebuild tables from scene graph
+  RNScopedTimer timer("Compile walls");
+  Empty();
+  Compile(scene->Root(), R3identity_affine);
+
+  // Build cells (bounds are binned by their xy extent)
+  wall_cells.Build(nwalls, bboxes);
+  R2Box *footprints = new R2Box [nbounds + 1];
+  for (int i = 0; i < nbounds; i++)
+    footprints[i] = R2Box(bounds[i].XMin(), bounds[i].YMin(), bounds[i].XMax(), bounds[i].YMax());
+  bound_cells.Build(nbounds, footprints);
+  delete [] footprints;
+}
+
+
+
+void WallSet::
+Compile(R3SceneNode *node, R3Affine transformation)
+{
+  // Accumulate node transformation
+  transformation.Transform(node->Transformation());
+
+  // Compile shapes of node (same order as a depth-first scene traversal)
+  for (int i = 0; i < node->NElements(); i++) {
+    R3SceneElement *element = node->Element(i);
+    for (int j = 0; j < element->NShapes(); j++) {
+      R3Shape *shape = element->Shape(j);
+      if (shape->ClassID() == R3Box::CLASS_ID()) InsertBox(*((R3Box *) shape), transformation, element);
+      else InsertShape(*shape, transformation, element);
+      InsertBounds(*shape, transformation);
+    }
+  }
+
+  // Compile children
+  for (int i = 0; i < node->NChildren(); i++)
+    Compile(node->Child(i), transformation);
+}
+
+
+
+void WallSet::
+InsertWall(int type, int n, const R3Point *points, R3SceneElement *element, RNScalar mu)
+{
+  // Grow arrays
+  if (nwalls == nallocated) {
+    int size = (nallocated > 0) ? 2 * nallocated : 16;
+    Grow(types, nwalls, size);
+    Grow(first, nwalls, size);
+    Grow(nverts, nwalls, size);
+    Grow(this->mu, nwalls, size);
+    Grow(bboxes, nwalls, size);
+    Grow(elements, nwalls, size);
+    nallocated = size;
+  }
+  if (npoints + n > npoints_allocated) {
+    int size = (npoints_allocated > 0) ? 2 * npoints_allocated : 64;
+    while (size < npoints + n) size *= 2;
+    Grow(px, npoints, size);
+    Grow(py, npoints, size);
+    Grow(pz, npoints, size);
+    npoints_allocated = size;
+  }
+
+  // Copy vertices
+  R2Box bbox = R2null_box;
+  for (int k = 0; k < n; k++) {
+    px[npoints + k] = points[k].X();
+    py[npoints + k] = points[k].Y();
+    pz[npoints + k] = points[k].Z();
+    bbox.Union(R2Point(points[k].X(), points[k].Y()));
+  }
+
+  // Fill in wall
+  types[nwalls] = type;
+  first[nwalls] = npoints;
+  nverts[nwalls] = n;
+  this->mu[nwalls] = mu;
+  bboxes[nwalls] = bbox;
+  elements[nwalls] = element;
+  npoints += n;
+  nwalls++;
+}
+
+
+
+void WallSet::
+InsertBox(const R3Box& box, const R3Affine& transformation, R3SceneElement *element)
+{
+  // Transform corners of box footprint (counter-clockwise order)
+  R3Point c[4];
+  c[0] = R3Point(box.XMin(), box.YMin(), 0);
+  c[1] = R3Point(box.XMax(), box.YMin(), 0);
+  c[2] = R3Point(box.XMax(), box.YMax(), 0);
+  c[3] = R3Point(box.XMin(), box.YMax(), 0);
+  for (int k = 0; k < 4; k++) transformation.Apply(c[k]);
+
+  // Insert quad
+  InsertWall(WALLSET_BOX, 4, c, element, element->Material()->Brdf()->IndexOfRefraction() - 1);
+}
+
+
+
+// vertex of a triangle array and its index in the array
+struct WallSetVertexIndex {
+  const R3TriangleVertex *vertex;
+  int index;
+};
+
+static int CompareVertexIndices(const void *data1, const void *data2)
+{
+  const R3TriangleVertex *v1 = ((const WallSetVertexIndex *) data1)->vertex;
+  const R3TriangleVertex *v2 = ((const WallSetVertexIndex *) data2)->vertex;
+  if (v1 == v2) return 0;
+  return (v1 < v2) ? -1 : 1;
+}
+
+
+
+void WallSet::
+InsertShape(const R3Shape& shape, const R3Affine& transformation, R3SceneElement *element)
+{
+  // Skip shapes that cannot reach the z = 0 plane
+  R3Box bbox = shape.BBox();
+  bbox.Transform(transformation);
+  if (RNIsPositive(bbox.ZMin()) || RNIsNegative(bbox.ZMax())) return;
+
+  // Build an indexed triangle soup for the shape
+  RNArray<R3Point *> vertices;
+  int ntriangles = 0;
+  int *triangles = NULL;
+  if (shape.ClassID() == R3Triangle::CLASS_ID()) {
+    const R3Triangle& triangle = (const R3Triangle&) shape;
+    for (int k = 0; k < 3; k++) vertices.Insert(new R3Point(triangle.Vertex(k)->Position()));
+    ntriangles = 1;
+    triangles = new int [3];
+    for (int k = 0; k < 3; k++) triangles[k] = k;
+  }
+  else if (shape.ClassID() == R3TriangleArray::CLASS_ID()) {
+    // Index vertices through a sorted map, leaving the scene's vertices untouched
+    const R3TriangleArray& array = (const R3TriangleArray&) shape;
+    WallSetVertexIndex *map = new WallSetVertexIndex [array.NVertices() + 1];
+    for (int i = 0; i < array.NVertices(); i++) {
+      map[i].vertex = array.Vertex(i);
+      map[i].index = i;
+      vertices.Insert(new R3Point(array.Vertex(i)->Position()));
+    }
+    qsort(map, array.NVertices(), sizeof(WallSetVertexIndex), CompareVertexIndices);
+    ntriangles = array.NTriangles();
+    triangles = new int [3 * ntriangles];
+    for (int i = 0; i < ntriangles; i++) {
+      R3Triangle *triangle = array.Triangle(i);
+      for (int k = 0; k < 3; k++) {
+        WallSetVertexIndex key;
+        key.vertex = triangle->Vertex(k);
+        WallSetVertexIndex *found = (WallSetVertexIndex *)
+          bsearch(&key, map, array.NVertices(), sizeof(WallSetVertexIndex), CompareVertexIndices);
+        triangles[3*i+k] = (found) ? found->index : 0;
+      }
+    }
+    delete [] map;
+  }
+  else if ((shape.ClassID() == R3Cylinder::CLASS_ID()) || (shape.ClassID() == R3Cone::CLASS_ID())) {
+    // Ring around base, center of base, then top ring or apex
+    const R3Span& axis = (shape.ClassID() == R3Cylinder::CLASS_ID()) ?
+      ((const R3Cylinder&) shape).Axis() : ((const R3Cone&) shape).Axis();
+    RNLength radius = (shape.ClassID() == R3Cylinder::CLASS_ID()) ?
+      ((const R3Cylinder&) shape).Radius() : ((const R3Cone&) shape).Radius();
+    RNBoolean cone = (shape.ClassID() == R3Cone::CLASS_ID());
+    R3Vector w = axis.Vector();
+    R3Vector u = w % ((fabs(w.X()) < 0.9) ? R3posx_vector : R3posy_vector);
+    u.Normalize();
+    R3Vector v = w % u;
+    int n = WALLSET_SLICES;
+    for (int i = 0; i < n; i++) {
+      RNAngle a = RN_TWO_PI * i / n;
+      vertices.Insert(new R3Point(axis.Start() + radius * (cos(a) * u + sin(a) * v)));
+    }
+    vertices.Insert(new R3Point(axis.Start()));
+    if (cone) vertices.Insert(new R3Point(axis.End()));
+    else {
+      for (int i = 0; i < n; i++) {
+        RNAngle a = RN_TWO_PI * i / n;
+        vertices.Insert(new R3Point(axis.End() + radius * (cos(a) * u + sin(a) * v)));
+      }
+      vertices.Insert(new R3Point(axis.End()));
+    }
+    int base_center = n;
+    int top = n + 1;  // first vertex of the top ring (cylinders)
+    int top_center = (cone) ? n + 1 : 2 * n + 1;
+    triangles = new int [3 * 4 * n];
+    for (int i = 0; i < n; i++) {
+      int j = (i + 1) % n;
+      int *t = &triangles[3 * ntriangles];
+      t[0] = base_center; t[1] = j; t[2] = i; ntriangles++; t += 3;
+      if (cone) { t[0] = i; t[1] = j; t[2] = top_center; ntriangles++; }
+      else {
+        t[0] = i; t[1] = j; t[2] = top + j; ntriangles++; t += 3;
+        t[0] = i; t[1] = top + j; t[2] = top + i; ntriangles++; t += 3;
+        t[0] = top + i; t[1] = top + j; t[2] = top_center; ntriangles++;
+      }
+    }
+  }
+  else if (shape.ClassID() == R3Sphere::CLASS_ID()) {
+    // Poles plus rings of latitude
+    const R3Sphere& sphere = (const R3Sphere&) shape;
+    const R3Point& c = sphere.Center();
+    RNLength r = sphere.Radius();
+    int n = WALLSET_SLICES, m = WALLSET_STACKS;
+    vertices.Insert(new R3Point(c - r * R3posz_vector));
+    for (int j = 1; j < m; j++) {
+      RNAngle phi = RN_PI * j / m - RN_PI_OVER_TWO;
+      for (int i = 0; i < n; i++) {
+        RNAngle a = RN_TWO_PI * i / n;
+        vertices.Insert(new R3Point(c + r * R3Vector(cos(phi) * cos(a), cos(phi) * sin(a), sin(phi))));
+      }
+    }
+    vertices.Insert(new R3Point(c + r * R3posz_vector));
+    int north = vertices.NEntries() - 1;
+    triangles = new int [3 * 2 * n * m];
+    for (int i = 0; i < n; i++) {
+      int i1 = (i + 1) % n;
+      int *t = &triangles[3 * ntriangles];
+      t[0] = 0; t[1] = 1 + i1; t[2] = 1 + i; ntriangles++;
+      for (int j = 1; j < m - 1; j++) {
+        int a = 1 + (j - 1) * n, b = 1 + j * n;
+        t = &triangles[3 * ntriangles];
+        t[0] = a + i; t[1] = a + i1; t[2] = b + i1; ntriangles++; t += 3;
+        t[0] = a + i; t[1] = b + i1; t[2] = b + i; ntriangles++;
+      }
+      int a = 1 + (m - 2) * n;
+      t = &triangles[3 * ntriangles];
+      t[0] = a + i; t[1] = a + i1; t[2] = north; ntriangles++;
+    }
+  }
+
+  // Transform vertices and slice
+  if (ntriangles > 0) {
+    int npositions = vertices.NEntries();
+    R3Point *positions = new R3Point [npositions];
+    for (int i = 0; i < npositions; i++) {
+      positions[i] = *(vertices[i]);
+      transformation.Apply(positions[i]);
+    }
+    RNScalar mu = element->Material()->Brdf()->IndexOfRefraction() - 1;
+    InsertSlices(npositions, positions, ntriangles, triangles, element, mu);
+    delete [] positions;
+  }
+
+  // Delete temporary data
+  for (int i = 0; i < vertices.NEntries(); i++) delete vertices[i];
+  if (triangles) delete [] triangles;
+}
+
+
+
+// endpoint of a cut segment, identified by the mesh edge it lies on
+struct WallSetCutEnd {
+  int v1, v2;
+  int segment;
+};
+
+static int CompareCutEnds(const void *data1, const void *data2)
+{
+  const WallSetCutEnd *e1 = (const WallSetCutEnd *) data1;
+  const WallSetCutEnd *e2 = (const WallSetCutEnd *) data2;
+  if (e1->v1 != e2->v1) return (e1->v1 < e2->v1) ? -1 : 1;
+  if (e1->v2 != e2->v2) return (e1->v2 < e2->v2) ? -1 : 1;
+  return e1->segment - e2->segment;
+}
+
+static R3Point CutPoint(const R3Point *positions, int v1, int v2)
+{
+  // Always interpolate from the lower index so both triangles agree exactly
+  const R3Point& p1 = positions[v1];
+  const R3Point& p2 = positions[v2];
+  RNScalar t = p1.Z() / (p1.Z() - p2.Z());
+  return R3Point(p1.X() + t * (p2.X() - p1.X()), p1.Y() + t * (p2.Y() - p1.Y()), 0);
+}
+
+
+
+void WallSet::
+InsertSlices(int npositions, const R3Point *positions, int ntriangles, const int *triangles,
+  R3SceneElement *element, RNScalar mu)
+{
+  // Cut each triangle with z = 0 (vertices on the plane count as above it)
+  WallSetCutEnd *ends = new WallSetCutEnd [2 * ntriangles];
+  int nsegments = 0;
+  for (int i = 0; i < ntriangles; i++) {
+    const int *t = &triangles[3*i];
+    int nends = 0;
+    for (int k = 0; k < 3; k++) {
+      int a = t[k], b = t[(k+1)%3];
+      if ((positions[a].Z() >= 0) == (positions[b].Z() >= 0)) continue;
+      WallSetCutEnd& e = ends[2*nsegments + nends++];
+      e.v1 = (a < b) ? a : b;
+      e.v2 = (a < b) ? b : a;
+      e.segment = nsegments;
+    }
+    if (nends == 2) nsegments++;
+  }
+  if (nsegments == 0) { delete [] ends; return; }
+
+  // Link segments sharing a mesh edge (exactly two ends per manifold edge)
+  int *next = new int [2 * nsegments];
+  for (int i = 0; i < 2 * nsegments; i++) next[i] = -1;
+  WallSetCutEnd *sorted = new WallSetCutEnd [2 * nsegments];
+  for (int i = 0; i < 2 * nsegments; i++) { sorted[i] = ends[i]; sorted[i].segment = i; }
+  qsort(sorted, 2 * nsegments, sizeof(WallSetCutEnd), CompareCutEnds);
+  for (int i = 0; i < 2 * nsegments; ) {
+    int j = i + 1;
+    while ((j < 2 * nsegments) && (sorted[j].v1 == sorted[i].v1) && (sorted[j].v2 == sorted[i].v2)) j++;
+    if (j - i == 2) {
+      next[sorted[i].segment] = sorted[i+1].segment;
+      next[sorted[i+1].segment] = sorted[i].segment;
+    }
+    i = j;
+  }
+
+  // Walk chains of segments (end 2s and 2s+1 belong to segment s)
+  RNBoolean *visited = new RNBoolean [nsegments];
+  for (int s = 0; s < nsegments; s++) visited[s] = FALSE;
+  R3Point *points = new R3Point [nsegments + 1];
+  for (int s = 0; s < nsegments; s++) {
+    if (visited[s]) continue;
+
+    // Back up to the start of an open chain, if any
+    int start = 2 * s;
+    int end = start;
+    while (TRUE) {
+      int linked = next[end];
+      if (linked < 0) break;
+      int other = linked ^ 1;
+      if ((other >> 1) == s) break;
+      end = other;
+    }
+    RNBoolean closed = (next[end] >= 0);
+    if (closed) end = 2 * s;
+    start = end;
+
+    // Walk forward from start, collecting cut points
+    int n = 0;
+    int e = start;
+    points[n++] = CutPoint(positions, ends[e].v1, ends[e].v2);
+    while (TRUE) {
+      visited[e >> 1] = TRUE;
+      int other = e ^ 1;
+      int linked = next[other];
+      if (closed && (linked == start)) break;
+      points[n++] = CutPoint(positions, ends[other].v1, ends[other].v2);
+      if ((linked < 0) || visited[linked >> 1]) break;
+      e = linked;
+    }
+
+    // Insert polygon or sheet
+    if (closed && (n >= 3)) InsertWall(WALLSET_POLYGON, n, points, element, mu);
+    else if (n >= 2) InsertWall(WALLSET_SHEET, n, points, element, mu);
+  }
+
+  // Delete temporary data
+  delete [] points;
+  delete [] visited;
+  delete [] sorted;
+  delete [] next;
+  delete [] ends;
+}
+
+
+
+int WallSet::
+InsertQuad(const R3Point points[4], RNScalar mu, R3SceneElement *element)
+{
+  // Insert quad and return its index
+  InsertWall(WALLSET_BOX, 4, points, element, mu);
+  wall_cells.Build(nwalls, bboxes);
+  return nwalls - 1;
+}
+
+
+
+void WallSet::
+RemoveWall(int wall)
+{
+  // Leave vertices in place so indices of other walls do not change
+  types[wall] = WALLSET_REMOVED;
+  bboxes[wall] = R2null_box;
+  wall_cells.Build(nwalls, bboxes);
+}
+
+
+
+void WallSet::
+TransformWall(int wall, const R3Affine& transformation)
+{
+  // Transform vertices and recompute bbox
+  R2Box bbox = R2null_box;
+  for (int k = first[wall]; k < first[wall] + nverts[wall]; k++) {
+    R3Point p(px[k], py[k], pz[k]);
+    transformation.Apply(p);
+    px[k] = p.X();
+    py[k] = p.Y();
+    pz[k] = p.Z();
+    bbox.Union(R2Point(p.X(), p.Y()));
+  }
+  bboxes[wall] = bbox;
+  wall_cells.Build(nwalls, bboxes);
+}
+
+
+
+void WallSet::
+InsertBounds(const R3Shape& shape, const R3Affine& transformation)
+{
+  // Any shape can block a segment that leaves the z = 0 plane
+  R3Box bbox = shape.BBox();
+  bbox.Transform(transformation);
+
+  // Grow array
+  if (nbounds == nbounds_allocated) {
+    int size = (nbounds_allocated > 0) ? 2 * nbounds_allocated : 16;
+    Grow(bounds, nbounds, size);
+    nbounds_allocated = size;
+  }
+
+  // Remember world extent
+  bounds[nbounds++] = bbox;
+}
+
+
+
+// segment tested against the bounds met while walking cells
+struct WallSetSegment {
+  RNScalar x, y, z, dx, dy, dz;
+  const R3Box *bounds;
+  int *marks;
+  int stamp;
+  int *list;
+  int nlist;
+  int ntested;
+};
+
+static RNBoolean TouchesBound(int box, void *data)
+{
+  // Clip segment against the bound (slab test with a little slack)
+  WallSetSegment *segment = (WallSetSegment *) data;
+  const R3Box& b = segment->bounds[box];
+  segment->ntested++;
+  RNScalar x = segment->x, y = segment->y, z = segment->z;
+  RNScalar dx = segment->dx, dy = segment->dy, dz = segment->dz;
+  RNScalar t1 = 0, t2 = 1;
+  RNScalar p[6] = { -dx, dx, -dy, dy, -dz, dz };
+  RNScalar q[6] = { x - (b.XMin() - RN_EPSILON), (b.XMax() + RN_EPSILON) - x,
+                    y - (b.YMin() - RN_EPSILON), (b.YMax() + RN_EPSILON) - y,
+                    z - (b.ZMin() - RN_EPSILON), (b.ZMax() + RN_EPSILON) - z };
+  for (int k = 0; k < 6; k++) {
+    if (p[k] == 0) {
+      if (q[k] < 0) return FALSE;
+    }
+    else {
+      RNScalar t = q[k] / p[k];
+      if (p[k] < 0) { if (t > t1) t1 = t; }
+      else { if (t < t2) t2 = t; }
+      if (t1 > t2) return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static RNBoolean CollectWall(int wall, void *data)
+{
+  WallSetSegment *segment = (WallSetSegment *) data;
+  if (segment->marks[wall] == segment->stamp) return FALSE;
+  segment->marks[wall] = segment->stamp;
+  segment->list[segment->nlist++] = wall;
+  return FALSE;
+}
+
+
+
+RNBoolean WallSet::
+MayIntersect(const R3Point& p1, const R3Point& p2) const
+{
+  // Test bounds in cells along the segment
+  WallSetSegment segment;
+  segment.x = p1.X();
+  segment.y = p1.Y();
+  segment.z = p1.Z();
+  segment.dx = p2.X() - p1.X();
+  segment.dy = p2.Y() - p1.Y();
+  segment.dz = p2.Z() - p1.Z();
+  segment.bounds = bounds;
+  segment.ntested = 0;
+  RNBoolean touches = bound_cells.Walk(p1, p2, TouchesBound, &segment);
+  wallset_walls_tested.Add(segment.ntested);
+  return touches;
+}
+
+
+
+int WallSet::
+CollectWalls(const R3Point& p1, const R3Point& p2, const R3Point& p3,
+  int *marks, int stamp, int *list, int nlist) const
+{
+  // Collect walls in cells covered by the triangle
+  WallSetSegment segment;
+  segment.marks = marks;
+  segment.stamp = stamp;
+  segment.list = list;
+  segment.nlist = nlist;
+  wall_cells.Walk(p1, p2, p3, CollectWall, &segment);
+  return segment.nlist;
+}
@@ -0,0 +1,124 @@
+#ifndef __WALLSET__H__
+#define __WALLSET__H__
+
+#include "R3Graphics/R3Graphics.h"
+
+// Wall types
+#define WALLSET_BOX 0      // footprint quad of an R3Box
+#define WALLSET_POLYGON 1  // closed loop cut from a solid by the z = 0 plane
+#define WALLSET_SHEET 2    // open chain cut from a surface (zero thickness)
+#define WALLSET_REMOVED 3  // deleted by an edit; keeps later wall indices stable
+
+// Uniform grid of cells over a set of xy boxes, each cell listing the
+// boxes that overlap it. Segments are walked cell by cell (2D DDA), and
+// triangles visit the cells they cover column by column, so a query only
+// sees boxes near the segment or triangle. Boxes touching it are always
+// reported, possibly more than once; others may be reported too.
+class WallCells {
+    public:
+        WallCells(void);
+        ~WallCells(void);
+
+        // Query functions
+        // calls visit for boxes in cells crossed by p1-p2, stopping early if visit returns TRUE
+        RNBoolean Walk(const R3Point& p1, const R3Point& p2,
+          RNBoolean (*visit)(int box, void *data), void *data) const;
+        RNBoolean Walk(const R3Point& p1, const R3Point& p2, const R3Point& p3,
+          RNBoolean (*visit)(int box, void *data), void *data) const;
+
+        // Manipulation functions
+        void Build(int nboxes, const R2Box *boxes);
+        void Empty(void);
+
+    private:
+        int ncx, ncy;
+        RNScalar x0, y0;
+        RNScalar cw, ch;
+        int *cell_first;
+        int *cell_boxes;
+};
+
+
+
+// Flat table of world-space walls compiled once from a scene graph.
+// Every R3Box in the scene becomes one quad: its (XMin,YMin), (XMax,YMin),
+// (XMax,YMax), (XMin,YMax) corners at z = 0, pushed through the node
+// transformations. Triangles, triangle arrays, spheres, cylinders and cones
+// are cut by the z = 0 plane instead, and the cuts chained into polygons.
+// Each wall carries as mu the index of refraction of its material minus one,
+// the extra optical path per unit length, as radiationbf traces it.
+// Vertices of all walls are kept in one structure of arrays so that loops
+// over walls touch contiguous memory. Call Compile again after changing
+// scene geometry. Walls can also be edited in place; edits do not touch the
+// scene graph or the bounds used by MayIntersect, which are the full world
+// bboxes of the scene's shapes, so segments off the z = 0 plane are pruned
+// correctly too.
+class WallSet {
+    public:
+        WallSet(void);
+        ~WallSet(void);
+
+        // Access functions
+        int NWalls(void) const { return nwalls; }
+        int Type(int wall) const { return types[wall]; }
+        int NVertices(int wall) const { return nverts[wall]; }
+        R3Point Vertex(int wall, int k) const { int i = first[wall] + k; return R3Point(px[i], py[i], pz[i]); }
+        RNScalar Mu(int wall) const { return mu[wall]; }
+        R3SceneElement *Element(int wall) const { return elements[wall]; }
+        const R2Box& BBox(int wall) const { return bboxes[wall]; }
+
+        // Query functions
+        // returns FALSE only if no scene geometry can touch the segment
+        RNBoolean MayIntersect(const R3Point& p1, const R3Point& p2) const;
+        // appends each wall that may touch the triangle to list, unless marks[wall] == stamp
+        //   already, then sets marks[wall] = stamp; returns the new length of list
+        int CollectWalls(const R3Point& p1, const R3Point& p2, const R3Point& p3,
+          int *marks, int stamp, int *list, int nlist) const;
+
+        // Manipulation functions
+        void Compile(R3Scene *scene);
+        void Empty(void);
+
+        // Edit functions
+        int InsertQuad(const R3Point points[4], RNScalar mu, R3SceneElement *element = NULL);
+        void RemoveWall(int wall);
+        void TransformWall(int wall, const R3Affine& transformation);
+
+    private:
+        void Compile(R3SceneNode *node, R3Affine transformation);
+        void InsertBox(const R3Box& box, const R3Affine& transformation, R3SceneElement *element);
+        void InsertShape(const R3Shape& shape, const R3Affine& transformation, R3SceneElement *element);
+        void InsertSlices(int npositions, const R3Point *positions, int ntriangles, const int *triangles,
+          R3SceneElement *element, RNScalar mu);
+        void InsertWall(int type, int npoints, const R3Point *points, R3SceneElement *element, RNScalar mu);
+        void InsertBounds(const R3Shape& shape, const R3Affine& transformation);
+
+    private:
+        // walls
+        int nwalls;
+        int nallocated;
+        int *types;
+        int *first;
+        int *nverts;
+        RNScalar *mu;
+        R2Box *bboxes;
+        R3SceneElement **elements;
+
+        // vertices of all walls
+        int npoints;
+        int npoints_allocated;
+        RNScalar *px;
+        RNScalar *py;
+        RNScalar *pz;
+
+        // world bboxes of every scene shape
+        int nbounds;
+        int nbounds_allocated;
+        R3Box *bounds;
+
+        // cells over wall bboxes and over bounds
+        WallCells wall_cells;
+        WallCells bound_cells;
+};
+
+#endif
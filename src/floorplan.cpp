@@ -0,0 +1,296 @@
+// Source file for the floorplan generator program
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Include files
+////////////////////////////////////////////////////////////////////////
+
+#include "R3Graphics/R3Graphics.h"
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Type definitions
+////////////////////////////////////////////////////////////////////////
+
+struct Room {
+  R2Box box;
+};
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Global variables
+////////////////////////////////////////////////////////////////////////
+
+// Program variables
+
+static char *output_scene_name = NULL;
+static int num_walls = 64;
+static int num_sources = 4;
+static RNLength building_size = 10;
+static RNLength wall_thickness = 0.1;
+static RNLength door_width = 0.8;
+static RNScalar outer_ior = 50;
+static RNScalar inner_ior = 10;
+static int random_seed = 1;
+static int print_verbose = 0;
+
+
+
+// Application variables
+
+static RNArray<R2Box *> walls;
+static RNArray<Room *> rooms;
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Floorplan generation
+////////////////////////////////////////////////////////////////////////
+
+static RNScalar
+RandomScalar(RNScalar low, RNScalar high)
+{
+  // Return uniform random number in [low, high)
+  return low + (high - low) * RNRandomScalar();
+}
+
+
+
+static void
+InsertWall(RNCoord x1, RNCoord y1, RNCoord x2, RNCoord y2)
+{
+  // Insert box of wall from (x1, y1) to (x2, y2), along the x or y axis
+  RNLength h = 0.5 * wall_thickness;
+  R2Box *wall = new R2Box(x1 - h, y1 - h, x2 + h, y2 + h);
+  walls.Insert(wall);
+}
+
+
+
+static Room *
+LargestRoom(void)
+{
+  // Return room with largest area
+  Room *largest = NULL;
+  for (int i = 0; i < rooms.NEntries(); i++) {
+    Room *room = rooms.Kth(i);
+    if (!largest || (room->box.Area() > largest->box.Area())) largest = room;
+  }
+  return largest;
+}
+
+
+
+static int
+SplitRoom(Room *room, int max_walls)
+{
+  // Split the room across its longer side, somewhere in its middle,
+  // with an interior wall that has a door in it (two wall pieces),
+  // or no door if only one wall is left to place
+  R2Box box = room->box;
+  int dim = (box.XLength() > box.YLength()) ? RN_X : RN_Y;
+  int other = 1 - dim;
+  RNLength length = box.AxisLength((RNAxis) dim);
+  RNCoord split = RandomScalar(box[RN_LO][dim] + 0.3 * length, box[RN_LO][dim] + 0.7 * length);
+  RNCoord lo = box[RN_LO][other], hi = box[RN_HI][other];
+  RNLength door = (door_width < 0.5 * (hi - lo)) ? door_width : 0.5 * (hi - lo);
+  int nwalls = ((max_walls >= 2) && (door > wall_thickness)) ? 2 : 1;
+  if (nwalls == 2) {
+    RNCoord door_lo = RandomScalar(lo + wall_thickness, hi - wall_thickness - door);
+    if (dim == RN_X) {
+      InsertWall(split, lo, split, door_lo);
+      InsertWall(split, door_lo + door, split, hi);
+    }
+    else {
+      InsertWall(lo, split, door_lo, split);
+      InsertWall(door_lo + door, split, hi, split);
+    }
+  }
+  else {
+    if (dim == RN_X) InsertWall(split, lo, split, hi);
+    else InsertWall(lo, split, hi, split);
+  }
+
+  // Replace the room by its two halves
+  Room *room1 = new Room(*room);
+  Room *room2 = new Room(*room);
+  room1->box[RN_HI][dim] = split;
+  room2->box[RN_LO][dim] = split;
+  rooms.Remove(room);
+  delete room;
+  rooms.Insert(room1);
+  rooms.Insert(room2);
+
+  // Return number of walls inserted
+  return nwalls;
+}
+
+
+
+static void
+GenerateFloorplan(void)
+{
+  // Seed random numbers, so that the same arguments give the same floorplan
+  RNSeedRandomScalar(random_seed);
+
+  // Insert outer walls of a square building centered at the origin
+  RNCoord s = 0.5 * building_size;
+  InsertWall(-s, -s, s, -s);
+  InsertWall(-s, s, s, s);
+  InsertWall(-s, -s, -s, s);
+  InsertWall(s, -s, s, s);
+  Room *hall = new Room();
+  hall->box = R2Box(-s, -s, s, s);
+  rooms.Insert(hall);
+
+  // Split the largest room until there are enough walls
+  while (walls.NEntries() < num_walls) {
+    SplitRoom(LargestRoom(), num_walls - walls.NEntries());
+  }
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Output
+////////////////////////////////////////////////////////////////////////
+
+static int
+WriteScene(const char *filename)
+{
+  // Start statistics
+  RNTime start_time;
+  start_time.Read();
+
+  // Open file
+  FILE *fp = fopen(filename, "w");
+  if (!fp) {
+    fprintf(stderr, "Unable to open output scene file %s\n", filename);
+    return 0;
+  }
+
+  // Write camera looking down on the building, and a material for outer
+  // (0) and inner (1) walls, with the index of refraction in the same slot
+  // as the hand-written scenes
+  RNLength s = 0.5 * building_size;
+  fprintf(fp, "# floorplan -walls %d -sources %d -size %g -seed %d\n\n", num_walls, num_sources, building_size, random_seed);
+  fprintf(fp, "camera 0 0 %g   0 0 -1   0 1 0   0.025   %g %g\n\n", 50 * s, 0.01 * s, 100 * s);
+  fprintf(fp, "material 0.8 0.8 0.8    0.5 0.5 0.5   0 0 0   0 0 0   0 0 0   10 %g 0\n", outer_ior);
+  fprintf(fp, "material 0.8 0.8 0.8    0.5 0.5 0.5   0 0 0   0 0 0   0 0 0   10 %g 0\n\n", inner_ior);
+
+  // Write walls, as boxes through the grid plane
+  for (int i = 0; i < walls.NEntries(); i++) {
+    R2Box *wall = walls.Kth(i);
+    fprintf(fp, "box %d  %g %g %g  %g %g %g\n", (i < 4) ? 0 : 1,
+      wall->XMin(), wall->YMin(), -s, wall->XMax(), wall->YMax(), s);
+  }
+  fprintf(fp, "\n");
+
+  // Write sources, each in a random room away from its walls
+  for (int i = 0; i < num_sources; i++) {
+    Room *room = rooms.Kth((int) (RNRandomScalar() * rooms.NEntries()) % rooms.NEntries());
+    const R2Box& box = room->box;
+    fprintf(fp, "radiation_source %g %g 0 1.0\n",
+      RandomScalar(box.XMin() + wall_thickness, box.XMax() - wall_thickness),
+      RandomScalar(box.YMin() + wall_thickness, box.YMax() - wall_thickness));
+  }
+  fprintf(fp, "\nambient 0.6 0.6 0.6\n");
+
+  // Close file
+  fclose(fp);
+
+  // Print statistics
+  if (print_verbose) {
+    printf("Wrote scene to %s ...\n", filename);
+    printf("  Time = %.2f seconds\n", start_time.Elapsed());
+    printf("  # Walls = %d\n", walls.NEntries());
+    printf("  # Rooms = %d\n", rooms.NEntries());
+    printf("  # Sources = %d\n", num_sources);
+    fflush(stdout);
+  }
+
+  // Return success
+  return 1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Program argument parsing
+////////////////////////////////////////////////////////////////////////
+
+static int
+ParseArgs(int argc, char **argv)
+{
+  // Parse arguments
+  argc--; argv++;
+  while (argc > 0) {
+    if ((*argv)[0] == '-') {
+      if (!strcmp(*argv, "-v")) {
+        print_verbose = 1;
+      }
+      else if (!strcmp(*argv, "-walls")) {
+        argc--; argv++; num_walls = atoi(*argv);
+      }
+      else if (!strcmp(*argv, "-sources")) {
+        argc--; argv++; num_sources = atoi(*argv);
+      }
+      else if (!strcmp(*argv, "-size")) {
+        argc--; argv++; building_size = atof(*argv);
+      }
+      else if (!strcmp(*argv, "-thickness")) {
+        argc--; argv++; wall_thickness = atof(*argv);
+      }
+      else if (!strcmp(*argv, "-door")) {
+        argc--; argv++; door_width = atof(*argv);
+      }
+      else if (!strcmp(*argv, "-seed")) {
+        argc--; argv++; random_seed = atoi(*argv);
+      }
+      else {
+        fprintf(stderr, "Invalid program argument: %s", *argv);
+        exit(1);
+      }
+      argv++; argc--;
+    }
+    else {
+      if (!output_scene_name) output_scene_name = *argv;
+      else { fprintf(stderr, "Invalid program argument: %s", *argv); exit(1); }
+      argv++; argc--;
+    }
+  }
+
+  // Check scene filename and sizes
+  if (!output_scene_name || (num_walls < 4) || (random_seed == 0)) {
+    fprintf(stderr, "Usage: floorplan outputscenefile [-walls <int>] [-sources <int>] [-size <float>] [-thickness <float>] [-door <float>] [-seed <int>] [-v]\n");
+    fprintf(stderr, "  (at least 4 walls, for the outside of the building, and a nonzero seed)\n");
+    return 0;
+  }
+
+  // Return OK status
+  return 1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Main program
+////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+  // Parse program arguments
+  if (!ParseArgs(argc, argv)) exit(-1);
+
+  // Generate floorplan
+  GenerateFloorplan();
+
+  // Write scene
+  if (!WriteScene(output_scene_name)) exit(-1);
+
+  // Return success
+  return 0;
+}
@@ -0,0 +1,192 @@
+// Source file for the benchmark program comparing radiation and radiationbf
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Include files
+////////////////////////////////////////////////////////////////////////
+
+#include "R3Graphics/R3Graphics.h"
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Global variables
+////////////////////////////////////////////////////////////////////////
+
+// Program variables
+
+static char *input_scene_name = NULL;
+static const char *analytic_command = "./radiation";
+static const char *bruteforce_command = "./radiationbf";
+static const char *output_prefix = "radbench";
+static int grid_nx = 201;
+static int grid_ny = 201;
+static int num_runs = 3;
+static double max_difference = 1e-6;  // negative to never fail
+static int print_verbose = 0;
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Engine runs
+////////////////////////////////////////////////////////////////////////
+
+static double
+RunEngine(const char *command, const char *grid_name)
+{
+  // Build command line, with the engine's own output going to the terminal
+  // only when verbose
+  char buffer[4096];
+  sprintf(buffer, "%s %s %s -gdim %d %d%s", command, input_scene_name, grid_name,
+    grid_nx, grid_ny, (print_verbose) ? "" : " > /dev/null");
+  if (print_verbose) printf("%s\n", buffer);
+
+  // Run it num_runs times, and keep the fastest wall time
+  double best_seconds = -1;
+  for (int run = 0; run < num_runs; run++) {
+    RNTime run_time;
+    run_time.Read();
+    if (system(buffer) != 0) {
+      fprintf(stderr, "Unable to run %s\n", buffer);
+      return -1;
+    }
+    double seconds = run_time.Elapsed();
+    if ((best_seconds < 0) || (seconds < best_seconds)) best_seconds = seconds;
+  }
+
+  // Return fastest wall time
+  return best_seconds;
+}
+
+
+
+static int
+CompareGrids(const char *analytic_name, const char *bruteforce_name,
+  double *linf, double *rms, double *mean)
+{
+  // Read grids written by the engines
+  R2Grid analytic, bruteforce;
+  if (!analytic.ReadFile(analytic_name)) return 0;
+  if (!bruteforce.ReadFile(bruteforce_name)) return 0;
+  if ((analytic.XResolution() != bruteforce.XResolution()) ||
+      (analytic.YResolution() != bruteforce.YResolution())) {
+    fprintf(stderr, "Grids have different resolutions: %s %s\n", analytic_name, bruteforce_name);
+    return 0;
+  }
+
+  // Compute largest and root mean square difference (both engines scale
+  // their fields to the same mean, so absolute differences are comparable)
+  double max_diff = 0, sum_squares = 0;
+  for (int i = 0; i < analytic.NEntries(); i++) {
+    double diff = fabs(analytic.GridValue(i) - bruteforce.GridValue(i));
+    if (diff > max_diff) max_diff = diff;
+    sum_squares += diff * diff;
+  }
+  *linf = max_diff;
+  *rms = sqrt(sum_squares / analytic.NEntries());
+  *mean = analytic.Mean();
+
+  // Return success
+  return 1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Program argument parsing
+////////////////////////////////////////////////////////////////////////
+
+static int
+ParseArgs(int argc, char **argv)
+{
+  // Parse arguments
+  argc--; argv++;
+  while (argc > 0) {
+    if ((*argv)[0] == '-') {
+      if (!strcmp(*argv, "-v")) {
+        print_verbose = 1;
+      }
+      else if (!strcmp(*argv, "-gdim")) {
+        argc--; argv++; grid_nx = atoi(*argv);
+        argc--; argv++; grid_ny = atoi(*argv);
+      }
+      else if (!strcmp(*argv, "-runs")) {
+        argc--; argv++; num_runs = atoi(*argv);
+      }
+      else if (!strcmp(*argv, "-radiation")) {
+        argc--; argv++; analytic_command = *argv;
+      }
+      else if (!strcmp(*argv, "-radiationbf")) {
+        argc--; argv++; bruteforce_command = *argv;
+      }
+      else if (!strcmp(*argv, "-output")) {
+        argc--; argv++; output_prefix = *argv;
+      }
+      else if (!strcmp(*argv, "-max_difference")) {
+        argc--; argv++; max_difference = atof(*argv);
+      }
+      else {
+        fprintf(stderr, "Invalid program argument: %s", *argv);
+        exit(1);
+      }
+      argv++; argc--;
+    }
+    else {
+      if (!input_scene_name) input_scene_name = *argv;
+      else { fprintf(stderr, "Invalid program argument: %s", *argv); exit(1); }
+      argv++; argc--;
+    }
+  }
+
+  // Check scene filename
+  if (!input_scene_name || (num_runs < 1)) {
+    fprintf(stderr, "Usage: radbench inputscenefile [-gdim <int> <int>] [-runs <int>] [-radiation <command>] [-radiationbf <command>] [-output <prefix>] [-max_difference <float>] [-v]\n");
+    return 0;
+  }
+
+  // Return OK status
+  return 1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Main program
+////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+  // Parse program arguments
+  if (!ParseArgs(argc, argv)) exit(-1);
+
+  // Run both engines, each writing its grid next to the other
+  char analytic_name[1024], bruteforce_name[1024];
+  sprintf(analytic_name, "%s_radiation.grd", output_prefix);
+  sprintf(bruteforce_name, "%s_radiationbf.grd", output_prefix);
+  double analytic_seconds = RunEngine(analytic_command, analytic_name);
+  if (analytic_seconds < 0) exit(-1);
+  double bruteforce_seconds = RunEngine(bruteforce_command, bruteforce_name);
+  if (bruteforce_seconds < 0) exit(-1);
+
+  // Compare grids
+  double linf, rms, mean;
+  if (!CompareGrids(analytic_name, bruteforce_name, &linf, &rms, &mean)) exit(-1);
+
+  // Print results
+  int npoints = grid_nx * grid_ny;
+  printf("%s: %d x %d grid, best of %d runs\n", input_scene_name, grid_nx, grid_ny, num_runs);
+  printf("  radiation = %.3f seconds (%.0f points per second)\n", analytic_seconds, npoints / analytic_seconds);
+  printf("  radiationbf = %.3f seconds (%.0f points per second)\n", bruteforce_seconds, npoints / bruteforce_seconds);
+  printf("  Difference = %.6g max, %.6g RMS (mean %.6g)\n", linf, rms, mean);
+  fflush(stdout);
+
+  // Fail if the engines disagree by more than allowed
+  if ((max_difference >= 0) && (linf > max_difference)) {
+    fprintf(stderr, "Engines differ by %g, more than %g\n", linf, max_difference);
+    exit(1);
+  }
+
+  // Return success
+  return 0;
+}
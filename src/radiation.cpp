@@ -5,12 +5,17 @@
 #include "R3Graphics/R3Graphics.h"
 #include "fglut/fglut.h"
 #include "Radiator.h"
+#include "WallSet.h"
+#include "GridFile.h"
+#include "WallKernel.h"
 
 // Program variables
 
 static char *input_scene_name = NULL;
 static char *output_image_name = NULL;
+static char *output_best_name = NULL;
 static char *screenshot_image_name = NULL;
+static char *profile_name = NULL;
 static int render_image_width = 64;
 static int render_image_height = 64;
 static int print_verbose = 0;
@@ -19,6 +24,8 @@ static int print_verbose = 0;
 static double grid_point_radius = 0.00625;
 static double* grid;
 static double* optical_paths;
+static double** source_paths = NULL;
+static double** source_layers = NULL;
 static int grid_nx = 10;
 static int grid_ny = 10;
 static double grid_dx;
@@ -27,6 +34,16 @@ static double grid_x0;
 static double grid_y0;
 static double grid_scale = 1.0;
 
+// Threads
+static int num_threads = 1;
+static RNThreadPool *thread_pool = NULL;
+
+// Engines computing the optical paths of a source
+#define PERWALL_ENGINE 0  // one pass over the grid per wall (-perwall)
+#define BATCH_ENGINE 1    // one pass per source, walls batched along grid rows
+#define SWEEP_ENGINE 2    // one angular sweep around each source (-sweep)
+static int engine = BATCH_ENGINE;
+
 // GLUT variables 
 
 static int GLUTwindow = 0;
@@ -36,8 +53,9 @@ static int GLUTmouse[2] = { 0, 0 };
 static int GLUTbutton[3] = { 0, 0, 0 };
 static int GLUTmouse_drag = 0;
 static int GLUTmodifiers = 0;
-// movement: 0 = camera, 1 for rad sources
+// movement: 0 = camera, 1 for rad sources, 2 for walls
 static int movement = 0;
+static int current_wall = -1;
 static int current_rad_source = 0;
 static int num_rad_sources = 0;
 static int moving = 0;
@@ -59,6 +77,7 @@ static R3Camera FPSToggleCam;
 
 static R3Viewer *viewer = NULL;
 static R3Scene *scene = NULL;
+static WallSet walls;
 static R3Point center(0, 0, 0);
 
 
@@ -73,6 +92,8 @@ static int show_bboxes = 0;
 static int show_rays = 0;
 static int show_frame_rate = 0;
 static int show_grid = 1;
+static int show_best_source = 0;
+static int show_profile = 0;
 
 static void initGridValues(R3Scene *scene);
 
@@ -127,9 +148,68 @@ static void incOptPathValue(RNScalar inc, int ix, int iy)
   optical_paths[ix * grid_ny + iy] += inc;
 }
 
+// runs function on blocks of rows ix0 <= ix < ix1 covering the grid, handing
+// the blocks out to the thread pool so no two threads ever touch the same
+// grid point; scratch set up by function is reused for a whole block
+struct GridRowBlocks {
+  void (*function)(int ix0, int ix1, void *data);
+  void *data;
+  int rows_per_job;
+};
+
+static void GridRowBlockJob(int job, void *ptr)
+{
+  GridRowBlocks *blocks = (GridRowBlocks *) ptr;
+  int ix1 = (job + 1) * blocks->rows_per_job;
+  if (ix1 > grid_nx) ix1 = grid_nx;
+  blocks->function(job * blocks->rows_per_job, ix1, blocks->data);
+}
+
+static void ForEachGridRowBlock(void (*function)(int ix0, int ix1, void *data), void *data)
+{
+  if (!thread_pool) {
+    function(0, grid_nx, data);
+    return;
+  }
+
+  // several blocks per thread to even out rows with more walls in view
+  GridRowBlocks blocks;
+  blocks.function = function;
+  blocks.data = data;
+  blocks.rows_per_job = grid_nx / (4 * thread_pool->NThreads());
+  if (blocks.rows_per_job < 1) blocks.rows_per_job = 1;
+  int njobs = (grid_nx + blocks.rows_per_job - 1) / blocks.rows_per_job;
+  thread_pool->Run(njobs, GridRowBlockJob, &blocks);
+}
+
+// runs function on every grid row, in blocks as above
+struct GridRows {
+  void (*function)(int ix, void *data);
+  void *data;
+};
+
+static void GridRowsBlock(int ix0, int ix1, void *ptr)
+{
+  GridRows *rows = (GridRows *) ptr;
+  for (int ix = ix0; ix < ix1; ix++)
+    rows->function(ix, rows->data);
+}
+
+static void ForEachGridRow(void (*function)(int ix, void *data), void *data)
+{
+  GridRows rows;
+  rows.function = function;
+  rows.data = data;
+  ForEachGridRowBlock(GridRowsBlock, &rows);
+}
+
+// point-wall pairs whose chord was clipped, counted while profiling
+static RNProfileCounter wall_chords("Wall chords");
+
 // sets 0.5 to the arithmetic mean
 static void NormalizeGridScale(void)
 {
+  RNScopedTimer timer("Normalize");
   double sum = 0;
   for (int i = 0; i < grid_nx * grid_ny; i++)
     sum += grid[i];
@@ -160,31 +240,6 @@ static RNScalar strength(int ix, int iy, Radiator &source)
   return exp(-getOptPathValue(ix, iy)) / (r * r);
 }
 
-/* Helpful function */
-static void GetBoundingVertices(R3Box &wall, R3Affine &transformation, R3Point *v1, R3Point *v2, R3Point *v3, R3Point *v4)
-{
-  assert(v1);
-  assert(v2);
-  assert(v3);
-  assert(v4);
-  RNScalar x1 = wall.XMin();
-  RNScalar x2 = wall.XMax();
-  RNScalar y1 = wall.YMin();
-  RNScalar y2 = wall.YMax();
-  R3Point vert1 = R3Point(x1,y1,0);
-  R3Point vert2 = R3Point(x2,y1,0);
-  R3Point vert3 = R3Point(x2,y2,0);
-  R3Point vert4 = R3Point(x1,y2,0);
-  transformation.Apply(vert1);
-  transformation.Apply(vert2);
-  transformation.Apply(vert3);
-  transformation.Apply(vert4);
-  *v1 = vert1;
-  *v2 = vert2;
-  *v3 = vert3;
-  *v4 = vert4;
-}
-
 /* Ameera */
 // input boundaries of wall in vert1 vert2 vert3 vert4 (counter-clockwise order);
 //   output vertices into v1 and v2
@@ -416,98 +471,697 @@ static void UpdatePathLength(int ix, int iy, const R3Point &v1, const R3Point &v
   }
 
 }
-// adds radiator strength from source to the strength grid
+// one wall as seen from one source, shared by the row workers
+struct WallPaths {
+  R3Point v1, v2, v3, v4;
+  R3Vector bv1, bv2;
+  R3Point source_pt;
+  RNScalar mu;
+  RNBoolean source_inside;
+};
 
-static void CalculatePathsWall(R3Box &wall, R3Affine &transformation, Radiator &source, RNScalar mu)
+static void CalculatePathsWallRow(int i, void *ptr)
 {
-  R3Point v1,v2,v3,v4;
+  WallPaths *w = (WallPaths *) ptr;
+  int nchords = 0;
+  for (int j = 0; j < grid_ny; j++)
+    if (w->source_inside || InBounds(w->bv1, w->bv2, w->source_pt, getGridPosition(i,j)))
+    {
+      UpdatePathLength(i, j, w->v1, w->v2, w->v3, w->v4, w->source_pt, w->mu);
+      nchords++;
+    }
+  wall_chords.Add(nchords);
+}
 
-  R3Vector bv1, bv2;
-  R3Point source_pt = source.Position();
-  RNBoolean source_inside = FALSE;
+// adds radiator strength from source to the strength grid
+
+static void CalculatePathsWall(int wall, Radiator &source, RNScalar mu)
+{
+  WallPaths w;
+  w.source_pt = source.Position();
+  w.mu = mu;
+  w.source_inside = FALSE;
   // get bounding vertices
-  GetBoundingVertices(wall, transformation, &v1, &v2, &v3, &v4);
+  w.v1 = walls.Vertex(wall, 0);
+  w.v2 = walls.Vertex(wall, 1);
+  w.v3 = walls.Vertex(wall, 2);
+  w.v4 = walls.Vertex(wall, 3);
   if (print_verbose)
   {
-    printf("Mu: %.3f; Bounding vertices:\n", mu);
-    printf("(%.3f,%.3f,%.3f)\n(%.3f,%.3f,%.3f)\n", v1.X(),v1.Y(),v1.Z(),
-      v2.X(),v2.Y(),v2.Z());
-    printf("(%.3f,%.3f,%.3f)\n(%.3f,%.3f,%.3f)\n", v3.X(),v3.Y(),v3.Z(),
-      v4.X(),v4.Y(),v4.Z());
+    printf("Mu: %.3f; Bounding vertices:\n", w.mu);
+    printf("(%.3f,%.3f,%.3f)\n(%.3f,%.3f,%.3f)\n", w.v1.X(),w.v1.Y(),w.v1.Z(),
+      w.v2.X(),w.v2.Y(),w.v2.Z());
+    printf("(%.3f,%.3f,%.3f)\n(%.3f,%.3f,%.3f)\n", w.v3.X(),w.v3.Y(),w.v3.Z(),
+      w.v4.X(),w.v4.Y(),w.v4.Z());
   }
 
-  GetBoundingVectors(v1, v2, v3, v4, source_pt, &bv1, &bv2);
-  if (!(InBounds(bv1, bv2, source_pt, v1) && InBounds(bv1, bv2, source_pt, v2) && InBounds(bv1, bv2, source_pt, v3)  && InBounds(bv1, bv2, source_pt, v4)  ))
+  GetBoundingVectors(w.v1, w.v2, w.v3, w.v4, w.source_pt, &w.bv1, &w.bv2);
+  if (!(InBounds(w.bv1, w.bv2, w.source_pt, w.v1) && InBounds(w.bv1, w.bv2, w.source_pt, w.v2) && InBounds(w.bv1, w.bv2, w.source_pt, w.v3)  && InBounds(w.bv1, w.bv2, w.source_pt, w.v4)  ))
   {
-    source_inside = TRUE;
+    w.source_inside = TRUE;
     //printf("Source inside wall! \n");
   }
-  for (int i = 0; i < grid_nx; i++)
-    for (int j = 0; j < grid_ny; j++)
-      if (source_inside || InBounds(bv1, bv2, source_pt, getGridPosition(i,j)))
-        UpdatePathLength(i, j, v1, v2, v3, v4, source_pt, mu);
+  ForEachGridRow(CalculatePathsWallRow, &w);
 
 }
 
-// traversing scene tree to grab the walls
-static void traverse_tree(R3SceneNode *node, R3Affine trans, Radiator& source, void (*callback)(R3Box &wall, R3Affine &transformation, Radiator &source, RNScalar mu))
+// returns length of the part of the segment from point to source that lies inside 
+//   a sliced polygon wall, using the even-odd rule on the sorted edge crossings
+static RNScalar PolygonChordLength(int wall, const R3Point &point, const R3Point &source_point)
 {
-  trans.Transform(node->Transformation());
-  for (int i = 0; i < node->NElements(); i++)
-    for (int j = 0; j < node->Element(i)->NShapes(); j++)
-      if (node->Element(i)->Shape(j)->ClassID() == R3Box::CLASS_ID())
-      {
-        if (print_verbose)
-        {
-          printf("Hit box! Transformation: \n");
-          printf("%.3f %.3f %.3f %.3f\n%.3f %.3f %.3f %.3f\n", trans.Matrix()[0][0],
-            trans.Matrix()[0][1],trans.Matrix()[0][2],trans.Matrix()[0][3],trans.Matrix()[1][0],
-            trans.Matrix()[1][1],trans.Matrix()[1][2],trans.Matrix()[1][3]);
-          printf("%.3f %.3f %.3f %.3f\n%.3f %.3f %.3f %.3f\n", trans.Matrix()[2][0],
-            trans.Matrix()[2][1],trans.Matrix()[2][2],trans.Matrix()[2][3],trans.Matrix()[3][0],
-            trans.Matrix()[3][1],trans.Matrix()[3][2],trans.Matrix()[3][3]);
-        }
-        callback(*((R3Box*) node->Element(i)->Shape(j)),trans, source,
-          node->Element(i)->Material()->Brdf()->IndexOfRefraction());
-      }
-  for (int i = 0; i < node->NChildren(); i++)
-    traverse_tree(node->Child(i), trans, source, callback);
+  int n = walls.NVertices(wall);
+  RNScalar gx = point.X(), gy = point.Y();
+  RNScalar dx = source_point.X() - gx, dy = source_point.Y() - gy;
+  RNScalar buffer[64];
+  RNScalar *t = (n <= 64) ? buffer : new RNScalar[n];
+  int nt = 0;
+  RNBoolean inside = FALSE;
+  for (int k = 0; k < n; k++)
+  {
+    R3Point a = walls.Vertex(wall, k);
+    R3Point b = walls.Vertex(wall, (k + 1) % n);
+    RNScalar ex = b.X() - a.X(), ey = b.Y() - a.Y();
+    // even-odd test for the grid point, casting towards +x
+    if ((a.Y() > gy) != (b.Y() > gy))
+      if (a.X() + (gy - a.Y()) * ex / ey > gx)
+        inside = !inside;
+    // crossing of edge with the segment
+    RNScalar denom = dx * ey - dy * ex;
+    if (denom == 0)
+      continue;
+    RNScalar s = ((a.X() - gx) * ey - (a.Y() - gy) * ex) / denom;
+    RNScalar u = ((a.X() - gx) * dy - (a.Y() - gy) * dx) / denom;
+    if (s > 0 && s < 1 && u >= 0 && u < 1)
+      t[nt++] = s;
+  }
+  // sort crossings along the segment
+  for (int i = 1; i < nt; i++)
+    for (int j = i; j > 0 && t[j-1] > t[j]; j--)
+    {
+      RNScalar tmp = t[j];
+      t[j] = t[j-1];
+      t[j-1] = tmp;
+    }
+  // sum up inside intervals
+  RNScalar length = 0;
+  RNScalar prev = 0;
+  for (int i = 0; i < nt; i++)
+  {
+    if (inside)
+      length += t[i] - prev;
+    inside = !inside;
+    prev = t[i];
+  }
+  if (inside)
+    length += 1 - prev;
+  if (t != buffer)
+    delete [] t;
+  return length * sqrt(dx * dx + dy * dy);
 }
 
-static void traverse_tree(R3SceneNode *root, Radiator& source, void (*callback)(R3Box &wall, R3Affine &transformation, Radiator &source, RNScalar mu))
+// one sliced polygon as seen from one source, shared by the row workers
+struct PolygonPaths {
+  int wall;
+  R3Point source_pt;
+  RNScalar mu;
+};
+
+static void CalculatePathsPolygonRow(int i, void *ptr)
 {
-   R3Affine trans = R3identity_affine;
-   traverse_tree(root, trans, source, callback);
+  PolygonPaths *p = (PolygonPaths *) ptr;
+  const R2Box &bbox = walls.BBox(p->wall);
+  int nchords = 0;
+  for (int j = 0; j < grid_ny; j++)
+  {
+    // skip grid points whose segment to the source misses the polygon's bbox
+    R3Point point = getGridPosition(i, j);
+    if ((point.X() < bbox.XMin() && p->source_pt.X() < bbox.XMin()) ||
+        (point.X() > bbox.XMax() && p->source_pt.X() > bbox.XMax()) ||
+        (point.Y() < bbox.YMin() && p->source_pt.Y() < bbox.YMin()) ||
+        (point.Y() > bbox.YMax() && p->source_pt.Y() > bbox.YMax()))
+      continue;
+    RNScalar length = PolygonChordLength(p->wall, point, p->source_pt);
+    nchords++;
+    if (length > 0)
+      incOptPathValue(length * p->mu, i, j);
+  }
+  wall_chords.Add(nchords);
 }
 
+static void CalculatePathsPolygon(int wall, Radiator &source, RNScalar mu)
+{
+  PolygonPaths p;
+  p.wall = wall;
+  p.source_pt = source.Position();
+  p.mu = mu;
+  ForEachGridRow(CalculatePathsPolygonRow, &p);
+}
 
+// walls come from the table compiled at load time, in scene traversal order.
+//   sheets cut from open surfaces have no thickness, so they add nothing
 static void CalculatePaths(Radiator &source, R3Scene *scene)
 {
-  traverse_tree(scene->Root(), source, CalculatePathsWall);
+  RNScopedTimer timer("Calculate paths");
+  for (int i = 0; i < walls.NWalls(); i++)
+  {
+    if (walls.Type(i) == WALLSET_BOX)
+      CalculatePathsWall(i, source, walls.Mu(i));
+    else if (walls.Type(i) == WALLSET_POLYGON)
+      CalculatePathsPolygon(i, source, walls.Mu(i));
+  }
 }
 
-static void SubtractStrength(Radiator &source, R3Scene *scene)
+// rows whose fan sees more walls than this are evaluated in chunks of points
+#define ROW_CHUNK_WALLS 16
+#define ROW_CHUNK 32
+
+static int CompareInts(const void *data1, const void *data2)
 {
-  optical_paths = new double[grid_nx * grid_ny];
-  for (int i = 0; i < grid_nx * grid_ny; i++)
-    optical_paths[i] = 0;
-  CalculatePaths(source, scene);
+  return *((const int *) data1) - *((const int *) data2);
+}
+
+// one source as seen by the row workers, and the layer they fill in
+struct SourceLayer {
+  Radiator *source;
+  double *paths;
+  double *values;
+  RNScalar weight;
+};
+
+// adds mu times the chord through one wall to the paths of n points of a grid row
+//   (x and y of the points); returns FALSE if the row can't see past the wall
+static RNBoolean AddWallPathsRow(int wall, RNScalar mu, const R3Point &source_pt,
+  int n, const RNScalar *x, const RNScalar *y, RNScalar *path)
+{
+  RNScalar sx = source_pt.X(), sy = source_pt.Y(), sz = source_pt.Z();
+  const R2Box &bbox = walls.BBox(wall);
+  if ((x[0] < bbox.XMin() && sx < bbox.XMin()) || (x[0] > bbox.XMax() && sx > bbox.XMax()))
+    return FALSE;
+  if (walls.Type(wall) == WALLSET_BOX)
+  {
+    RNScalar qx[4], qy[4];
+    for (int k = 0; k < 4; k++)
+    {
+      R3Point v = walls.Vertex(wall, k);
+      qx[k] = v.X();
+      qy[k] = v.Y();
+    }
+    QuadPathBatch(qx, qy, mu, sx, sy, sz, n, x, y, path);
+  }
+  else if (walls.Type(wall) == WALLSET_POLYGON)
+  {
+    for (int j = 0; j < n; j++)
+    {
+      if ((y[j] < bbox.YMin() && sy < bbox.YMin()) || (y[j] > bbox.YMax() && sy > bbox.YMax()))
+        continue;
+      path[j] += PolygonChordLength(wall, R3Point(x[j], y[j], 0), source_pt) * mu;
+    }
+  }
+  else
+    return FALSE;
+  return TRUE;
+}
+
+// sums the optical path of every wall for a whole grid row, then writes the
+//   row's strengths, so the layer is touched once per source instead of once per wall.
+//   x and y are the row's points, path is scratch, and marks/list are scratch
+//   for CollectWalls with every mark below stamp
+static void BatchSourceRow(int i, SourceLayer *l, const RNScalar *x, const RNScalar *y,
+  RNScalar *path, int *marks, int *list, int &stamp)
+{
+  R3Point source_pt = l->source->Position();
+  RNScalar sx = source_pt.X(), sy = source_pt.Y(), sz = source_pt.Z();
+  RNScalar gx = x[0];
+  for (int j = 0; j < grid_ny; j++)
+    path[j] = 0;
+
+  // only walls in cells covered by the fan of segments from the row to the
+  //   source can add to it; if the fan sees many walls, narrow it by
+  //   splitting the row into chunks
+  int chunk_size = grid_ny;
+  long long nchords = 0;
+  int nlist = walls.CollectWalls(R3Point(gx, y[0], 0), R3Point(gx, y[grid_ny - 1], 0), source_pt, marks, stamp++, list, 0);
+  if (nlist > ROW_CHUNK_WALLS) chunk_size = ROW_CHUNK;
+  for (int j0 = 0; j0 < grid_ny; j0 += chunk_size)
+  {
+    int n = (grid_ny - j0 < chunk_size) ? grid_ny - j0 : chunk_size;
+    if (chunk_size < grid_ny)
+      nlist = walls.CollectWalls(R3Point(gx, y[j0], 0), R3Point(gx, y[j0 + n - 1], 0), source_pt, marks, stamp++, list, 0);
+    // sum in wall order, as without cells
+    qsort(list, nlist, sizeof(int), CompareInts);
+    for (int k = 0; k < nlist; k++)
+      if (AddWallPathsRow(list[k], walls.Mu(list[k]), source_pt, n, &x[j0], &y[j0], &path[j0]))
+        nchords += n;
+  }
+  wall_chords.Add(nchords);
+
+  double *values = &l->values[i * grid_ny];
+  for (int j = 0; j < grid_ny; j++)
+  {
+    l->paths[i * grid_ny + j] = path[j];
+    values[j] = 0;
+  }
+  StrengthBatch(sx, sy, sz, 1.0, grid_ny, x, y, path, values);
+}
+
+static void BatchLayerRows(int i0, int i1, void *ptr)
+{
+  RNScopedTimer timer("Calculate paths");
+  SourceLayer *l = (SourceLayer *) ptr;
+  RNScalar *x = new RNScalar [3 * grid_ny];
+  RNScalar *y = x + grid_ny;
+  RNScalar *path = y + grid_ny;
+  int *marks = new int [2 * walls.NWalls() + 1];
+  int *list = marks + walls.NWalls();
+  for (int wall = 0; wall < walls.NWalls(); wall++)
+    marks[wall] = 0;
+  int stamp = 1;
+  for (int i = i0; i < i1; i++)
+  {
+    for (int j = 0; j < grid_ny; j++)
+    {
+      x[j] = grid_x0 + grid_dx * i;
+      y[j] = grid_y0 + grid_dy * j;
+    }
+    BatchSourceRow(i, l, x, y, path, marks, list, stamp);
+  }
+  delete [] marks;
+  delete [] x;
+}
+
+// computes the layers of all sources for each grid row of a block and adds
+//   them to the grid, so the row, its scratch and the walls near it stay in
+//   cache while every source is evaluated, instead of streaming the grid once
+//   per source
+static void FusedLayersRows(int i0, int i1, void *ptr)
+{
+  RNScopedTimer timer("Calculate paths");
+  R3Scene *scene = (R3Scene *) ptr;
+  RNScalar *x = new RNScalar [3 * grid_ny];
+  RNScalar *y = x + grid_ny;
+  RNScalar *path = y + grid_ny;
+  int *marks = new int [2 * walls.NWalls() + 1];
+  int *list = marks + walls.NWalls();
+  for (int wall = 0; wall < walls.NWalls(); wall++)
+    marks[wall] = 0;
+  int stamp = 1;
+  for (int i = i0; i < i1; i++)
+  {
+    for (int j = 0; j < grid_ny; j++)
+    {
+      x[j] = grid_x0 + grid_dx * i;
+      y[j] = grid_y0 + grid_dy * j;
+    }
+    for (int k = 0; k < scene->NRadSources(); k++)
+    {
+      SourceLayer l;
+      l.source = scene->RadSource(k);
+      l.paths = source_paths[k];
+      l.values = source_layers[k];
+      l.weight = 1;
+      BatchSourceRow(i, &l, x, y, path, marks, list, stamp);
+    }
+
+    // same order of sums as adding the layers one after another
+    for (int k = 0; k < scene->NRadSources(); k++)
+    {
+      RNScalar weight = scene->RadSource(k)->Strength();
+      for (int j = 0; j < grid_ny; j++)
+        incGridValue(weight * source_layers[k][i * grid_ny + j], i, j);
+    }
+  }
+  delete [] marks;
+  delete [] x;
+}
+
+// writes a row of the layer from paths already summed for the whole grid
+static void StrengthLayerRow(int i, void *ptr)
+{
+  SourceLayer *l = (SourceLayer *) ptr;
+  R3Point source_pt = l->source->Position();
+  RNScalar *x = new RNScalar [2 * grid_ny];
+  RNScalar *y = x + grid_ny;
+  double *values = &l->values[i * grid_ny];
+  for (int j = 0; j < grid_ny; j++)
+  {
+    x[j] = grid_x0 + grid_dx * i;
+    y[j] = grid_y0 + grid_dy * j;
+    values[j] = 0;
+  }
+  StrengthBatch(source_pt.X(), source_pt.Y(), source_pt.Z(), 1.0, grid_ny, x, y, &l->paths[i * grid_ny], values);
+  delete [] x;
+}
+
+// The angular sweep orders walls and grid points by their angle around the
+//   source. Angles are binned into buckets; stepping through the buckets in
+//   order, a wall is inserted into the active set at the first bucket its
+//   angular span covers and removed after the last, so each grid point is
+//   only tested against walls in its direction. The active set is kept
+//   sorted by distance from the source, and a point stops at the first wall
+//   farther away than itself
+
+// monotonic stand-in for the angle of (dx, dy) in [0, 4); opposite
+//   directions are always 2 apart
+static RNScalar PseudoAngle(RNScalar dx, RNScalar dy)
+{
+  if ((dx == 0) && (dy == 0)) return 0;
+  RNScalar p = dx / (fabs(dx) + fabs(dy));
+  return (dy < 0) ? 3 + p : 1 - p;
+}
+
+static int SweepBucket(RNScalar angle, int nbuckets)
+{
+  if (angle < 0) angle += 4;
+  else if (angle >= 4) angle -= 4;
+  int b = (int) (angle * nbuckets / 4);
+  return (b < nbuckets) ? b : nbuckets - 1;
+}
+
+// one wall as seen from the swept source
+struct SweepWall {
+  int wall;
+  int first, last;    // buckets spanned, first > last if wrapping around 0, -1 if all
+  RNScalar distance;  // from the source to the closest point of the wall
+  QuadPlanes planes;
+};
+
+// returns distance from (px, py) to the segment from a to b
+static RNScalar SegmentDistance(RNScalar px, RNScalar py, const R3Point &a, const R3Point &b)
+{
+  RNScalar ex = b.X() - a.X(), ey = b.Y() - a.Y();
+  RNScalar wx = px - a.X(), wy = py - a.Y();
+  RNScalar e2 = ex * ex + ey * ey;
+  RNScalar t = (e2 > 0) ? (wx * ex + wy * ey) / e2 : 0;
+  if (t < 0) t = 0;
+  else if (t > 1) t = 1;
+  wx -= t * ex;
+  wy -= t * ey;
+  return sqrt(wx * wx + wy * wy);
+}
+
+// fills in the angular span and distance of a wall; returns FALSE for walls
+//   that add nothing to the paths
+static RNBoolean SetupSweepWall(SweepWall &w, int wall, const R3Point &source_pt, int nbuckets)
+{
+  int type = walls.Type(wall);
+  if ((type != WALLSET_BOX) && (type != WALLSET_POLYGON)) return FALSE;
+  if (walls.NVertices(wall) < 3) return FALSE;
+  RNScalar sx = source_pt.X(), sy = source_pt.Y();
+  int n = walls.NVertices(wall);
+  w.wall = wall;
+  w.first = w.last = -1;
+  w.distance = 0;
+  if (type == WALLSET_BOX)
+  {
+    RNScalar qx[4], qy[4];
+    for (int k = 0; k < 4; k++)
+    {
+      R3Point v = walls.Vertex(wall, k);
+      qx[k] = v.X();
+      qy[k] = v.Y();
+    }
+    SetupQuadPlanes(w.planes, qx, qy, sx, sy);
+  }
+
+  // a wall around the source is seen in every direction
+  const R2Box &bbox = walls.BBox(wall);
+  if ((sx >= bbox.XMin()) && (sx <= bbox.XMax()) && (sy >= bbox.YMin()) && (sy <= bbox.YMax()))
+    return TRUE;
+
+  // sorted vertex angles; the span is everything but the largest gap between them
+  RNScalar buffer[64];
+  RNScalar *angles = (n <= 64) ? buffer : new RNScalar[n];
+  w.distance = RN_INFINITY;
+  for (int k = 0; k < n; k++)
+  {
+    R3Point a = walls.Vertex(wall, k);
+    R3Point b = walls.Vertex(wall, (k + 1) % n);
+    RNScalar d = SegmentDistance(sx, sy, a, b);
+    if (d < w.distance) w.distance = d;
+    angles[k] = PseudoAngle(a.X() - sx, a.Y() - sy);
+    for (int j = k; j > 0 && angles[j-1] > angles[j]; j--)
+    {
+      RNScalar tmp = angles[j];
+      angles[j] = angles[j-1];
+      angles[j-1] = tmp;
+    }
+  }
+  RNScalar start = angles[0], end = angles[n - 1];
+  RNScalar gap = angles[0] + 4 - angles[n - 1];
+  for (int k = 0; k + 1 < n; k++)
+  {
+    if (angles[k + 1] - angles[k] > gap)
+    {
+      gap = angles[k + 1] - angles[k];
+      start = angles[k + 1];
+      end = angles[k];
+    }
+  }
+  if (angles != buffer)
+    delete [] angles;
+  if (gap <= 2) return TRUE;
+
+  // widen a little so rays grazing the extreme vertices stay in
+  start -= 1E-9;
+  end += 1E-9;
+  w.first = SweepBucket(start, nbuckets);
+  w.last = SweepBucket(end, nbuckets);
+  RNBoolean wraps = (start < 0) || (end >= 4) || (start > end);
+  if (wraps && (w.first <= w.last))
+    w.first = w.last = -1;
+  return TRUE;
+}
+
+static RNBoolean SweepWallActive(const SweepWall &w, int bucket)
+{
+  if (w.first < 0) return TRUE;
+  if (w.first <= w.last) return (bucket >= w.first) && (bucket <= w.last);
+  return (bucket <= w.last) || (bucket >= w.first);
+}
+
+// one source's sweep, with its buckets of grid points and wall events
+struct AngularSweep {
+  R3Point source_pt;
+  double *paths;
+  int nbuckets;
+  int buckets_per_job;
+  SweepWall *sweep_walls;
+  int nsweep_walls;
+  int *point_first, *points;
+  int *insert_first, *inserts;
+  int *remove_first, *removes;
+};
+
+static void SweepInsert(AngularSweep *s, int *active, int &nactive, int w)
+{
+  RNScalar distance = s->sweep_walls[w].distance;
+  int lo = 0, hi = nactive;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (s->sweep_walls[active[mid]].distance <= distance) lo = mid + 1;
+    else hi = mid;
+  }
+  memmove(&active[lo + 1], &active[lo], (nactive - lo) * sizeof(int));
+  active[lo] = w;
+  nactive++;
+}
+
+static void SweepRemove(int *active, int &nactive, int w)
+{
+  for (int a = 0; a < nactive; a++)
+  {
+    if (active[a] != w) continue;
+    memmove(&active[a], &active[a + 1], (nactive - a - 1) * sizeof(int));
+    nactive--;
+    return;
+  }
+}
+
+// sweeps a contiguous range of buckets, starting from the walls active in its first one
+static void SweepJob(int job, void *ptr)
+{
+  AngularSweep *s = (AngularSweep *) ptr;
+  RNScalar sx = s->source_pt.X(), sy = s->source_pt.Y(), sz = s->source_pt.Z();
+  int b0 = job * s->buckets_per_job;
+  int b1 = (b0 + s->buckets_per_job < s->nbuckets) ? b0 + s->buckets_per_job : s->nbuckets;
+  int *active = new int [s->nsweep_walls + 1];
+  int nactive = 0;
+  long long nchords = 0;
+  for (int w = 0; w < s->nsweep_walls; w++)
+    if (SweepWallActive(s->sweep_walls[w], b0))
+      SweepInsert(s, active, nactive, w);
+
+  for (int b = b0; b < b1; b++)
+  {
+    if (b > b0)
+      for (int e = s->insert_first[b]; e < s->insert_first[b + 1]; e++)
+        SweepInsert(s, active, nactive, s->inserts[e]);
+    for (int p = s->point_first[b]; p < s->point_first[b + 1]; p++)
+    {
+      int index = s->points[p];
+      RNScalar x = grid_x0 + grid_dx * (index / grid_ny);
+      RNScalar y = grid_y0 + grid_dy * (index % grid_ny);
+      RNScalar dx = sx - x, dy = sy - y;
+      RNScalar r = sqrt(dx * dx + dy * dy);
+      RNScalar length = sqrt(dx * dx + dy * dy + sz * sz);
+      RNScalar path = 0;
+      for (int a = 0; a < nactive; a++)
+      {
+        const SweepWall &w = s->sweep_walls[active[a]];
+        if (w.distance >= r) break;
+        nchords++;
+        if (walls.Type(w.wall) == WALLSET_BOX)
+          path += walls.Mu(w.wall) * (QuadFraction(w.planes, x, y) * length);
+        else
+          path += PolygonChordLength(w.wall, R3Point(x, y, 0), s->source_pt) * walls.Mu(w.wall);
+      }
+      s->paths[index] = path;
+    }
+    for (int e = s->remove_first[b]; e < s->remove_first[b + 1]; e++)
+      SweepRemove(active, nactive, s->removes[e]);
+  }
+  wall_chords.Add(nchords);
+  delete [] active;
+}
+
+// sorts items 0..n-1 into lists by bucket: list[first[b]] .. list[first[b+1]-1]
+//   are the items in bucket b, given as values[i] (or i if values is NULL)
+static void BucketSort(int n, const int *bucket, const int *values, int nbuckets, int *first, int *list)
+{
+  for (int b = 0; b <= nbuckets; b++)
+    first[b] = 0;
+  for (int i = 0; i < n; i++)
+    first[bucket[i] + 1]++;
+  for (int b = 0; b < nbuckets; b++)
+    first[b + 1] += first[b];
+  int *next = new int [nbuckets];
+  for (int b = 0; b < nbuckets; b++)
+    next[b] = first[b];
+  for (int i = 0; i < n; i++)
+    list[next[bucket[i]]++] = (values) ? values[i] : i;
+  delete [] next;
+}
+
+// computes the optical paths of every grid point from one source in a single
+//   angular sweep; the bucket ranges are split between the threads
+static void SweepPaths(const R3Point &source_pt, double *paths)
+{
+  RNScopedTimer timer("Calculate paths");
+  RNScalar sx = source_pt.X(), sy = source_pt.Y();
+  int npoints = grid_nx * grid_ny;
+  AngularSweep s;
+  s.source_pt = source_pt;
+  s.paths = paths;
+  s.nbuckets = npoints / 16;
+  if (s.nbuckets < 64) s.nbuckets = 64;
+  if (s.nbuckets > (1 << 18)) s.nbuckets = 1 << 18;
+  int nb = s.nbuckets;
+
+  // walls and their insert/remove events; a span wrapping around 0 is split in two
+  s.sweep_walls = new SweepWall [walls.NWalls() + 1];
+  s.nsweep_walls = 0;
+  for (int wall = 0; wall < walls.NWalls(); wall++)
+    if (SetupSweepWall(s.sweep_walls[s.nsweep_walls], wall, source_pt, nb))
+      s.nsweep_walls++;
+  int *event_wall = new int [3 * 2 * s.nsweep_walls + 1];
+  int *insert_bucket = event_wall + 2 * s.nsweep_walls;
+  int *remove_bucket = insert_bucket + 2 * s.nsweep_walls;
+  int nevents = 0;
+  for (int w = 0; w < s.nsweep_walls; w++)
+  {
+    const SweepWall &sw = s.sweep_walls[w];
+    if (sw.first < 0) continue;
+    event_wall[nevents] = w;
+    insert_bucket[nevents] = sw.first;
+    remove_bucket[nevents++] = (sw.first <= sw.last) ? sw.last : nb - 1;
+    if (sw.first <= sw.last) continue;
+    event_wall[nevents] = w;
+    insert_bucket[nevents] = 0;
+    remove_bucket[nevents++] = sw.last;
+  }
+  s.insert_first = new int [2 * (nb + 1)];
+  s.remove_first = s.insert_first + nb + 1;
+  s.inserts = new int [2 * nevents + 1];
+  s.removes = s.inserts + nevents;
+  BucketSort(nevents, insert_bucket, event_wall, nb, s.insert_first, s.inserts);
+  BucketSort(nevents, remove_bucket, event_wall, nb, s.remove_first, s.removes);
+  delete [] event_wall;
+
+  // grid points, bucketed by angle
+  int *point_bucket = new int [npoints];
   for (int i = 0; i < grid_nx; i++)
     for (int j = 0; j < grid_ny; j++)
-      incGridValue(-strength(i,j,source),i,j);
-  delete [] optical_paths;
+      point_bucket[i * grid_ny + j] = SweepBucket(PseudoAngle(grid_x0 + grid_dx * i - sx, grid_y0 + grid_dy * j - sy), nb);
+  s.point_first = new int [nb + 1];
+  s.points = new int [npoints];
+  BucketSort(npoints, point_bucket, NULL, nb, s.point_first, s.points);
+  delete [] point_bucket;
+
+  // sweep
+  int njobs = (thread_pool) ? 4 * thread_pool->NThreads() : 1;
+  s.buckets_per_job = (nb + njobs - 1) / njobs;
+  njobs = (nb + s.buckets_per_job - 1) / s.buckets_per_job;
+  if (thread_pool) thread_pool->Run(njobs, SweepJob, &s);
+  else SweepJob(0, &s);
+
+  delete [] s.sweep_walls;
+  delete [] s.insert_first;
+  delete [] s.inserts;
+  delete [] s.point_first;
+  delete [] s.points;
+}
+
+static void LayerRow(int i, void *ptr)
+{
+  SourceLayer *l = (SourceLayer *) ptr;
+  for (int j = 0; j < grid_ny; j++)
+    l->values[i * grid_ny + j] = strength(i, j, *(l->source));
 }
 
-static void UpdateStrength(Radiator &source, R3Scene *scene)
+static void AddLayerRow(int i, void *ptr)
 {
-  optical_paths = new double[grid_nx * grid_ny];
+  SourceLayer *l = (SourceLayer *) ptr;
+  for (int j = 0; j < grid_ny; j++)
+    incGridValue(l->weight * l->values[i * grid_ny + j], i, j);
+}
+
+// recomputes the unit-strength field of source k into its layer
+static void ComputeLayer(int k, R3Scene *scene)
+{
+  RNScopedTimer timer("Strength pass");
+  SourceLayer l;
+  l.source = scene->RadSource(k);
+  l.paths = source_paths[k];
+  l.values = source_layers[k];
+  l.weight = 1;
+  if (engine == BATCH_ENGINE)
+  {
+    ForEachGridRowBlock(BatchLayerRows, &l);
+    return;
+  }
+  if (engine == SWEEP_ENGINE)
+  {
+    SweepPaths(l.source->Position(), l.paths);
+    ForEachGridRow(StrengthLayerRow, &l);
+    return;
+  }
+  optical_paths = source_paths[k];
   for (int i = 0; i < grid_nx * grid_ny; i++)
     optical_paths[i] = 0;
-  CalculatePaths(source, scene);
-  for (int i = 0; i < grid_nx; i++)
-    for (int j = 0; j < grid_ny; j++)
-      incGridValue(strength(i,j,source),i,j);
-  delete [] optical_paths;
+  CalculatePaths(*(l.source), scene);
+  ForEachGridRow(LayerRow, &l);
+}
+
+// adds weight times the layer of source k to the grid
+static void AddLayer(int k, RNScalar weight, R3Scene *scene)
+{
+  SourceLayer l;
+  l.source = scene->RadSource(k);
+  l.paths = source_paths[k];
+  l.values = source_layers[k];
+  l.weight = weight;
+  ForEachGridRow(AddLayerRow, &l);
 }
 
 // initializes grid with source strengths
@@ -516,22 +1170,195 @@ static void initGridValues(R3Scene *scene)
 {
   for (int i = 0; i < grid_nx * grid_ny; i++)
     grid[i] = 0;
+  source_paths = new double* [scene->NRadSources()];
+  source_layers = new double* [scene->NRadSources()];
   for (int i = 0; i < scene->NRadSources(); i++)
   {
-    Radiator &source = *(scene->RadSource(i));
-    UpdateStrength(source, scene);
+    source_paths[i] = new double[grid_nx * grid_ny];
+    source_layers[i] = new double[grid_nx * grid_ny];
+  }
+  if (engine == BATCH_ENGINE)
+  {
+    // all sources in one pass over the grid
+    RNScopedTimer timer("Strength pass");
+    ForEachGridRowBlock(FusedLayersRows, scene);
+  }
+  else
+  {
+    for (int i = 0; i < scene->NRadSources(); i++)
+    {
+      ComputeLayer(i, scene);
+      AddLayer(i, scene->RadSource(i)->Strength(), scene);
+    }
   }
   NormalizeGridScale();
 
 }
 
 
-// 
-static void MoveRadiator(Radiator *source, R3Vector displacement, R3Scene *scene)
+// only the moved source's layer is recomputed; the others stay cached
+static void MoveRadiator(int k, R3Vector displacement, R3Scene *scene)
 {
-  SubtractStrength(*source, scene);
+  Radiator *source = scene->RadSource(k);
+  AddLayer(k, -source->Strength(), scene);
   source->Move(displacement);
-  UpdateStrength(*source, scene);
+  ComputeLayer(k, scene);
+  AddLayer(k, source->Strength(), scene);
+}
+
+// changing strength just rescales the cached layer
+static void SetRadiatorStrength(int k, RNScalar strength, R3Scene *scene)
+{
+  Radiator *source = scene->RadSource(k);
+  AddLayer(k, strength - source->Strength(), scene);
+  source->SetStrength(strength);
+}
+
+// one wall edit as seen from one source, shared by the row workers
+struct WallEdit {
+  int wall;
+  RNScalar mu;
+  int k;
+  Radiator *source;
+  double *delta;
+};
+
+// changes the optical path of source k at one grid point, then redoes the
+//   strength step there and carries the change over to the grid
+static void ApplyPathDelta(WallEdit *e, int i, int j, RNScalar delta)
+{
+  int index = i * grid_ny + j;
+  source_paths[e->k][index] += delta;
+  RNScalar value = 0;
+  if (engine != PERWALL_ENGINE)
+  {
+    R3Point source_pt = e->source->Position();
+    RNScalar x = grid_x0 + grid_dx * i, y = grid_y0 + grid_dy * j;
+    StrengthBatch(source_pt.X(), source_pt.Y(), source_pt.Z(), 1.0, 1, &x, &y, &source_paths[e->k][index], &value);
+  }
+  else
+    value = strength(i, j, *(e->source));
+  incGridValue(e->source->Strength() * (value - source_layers[e->k][index]), i, j);
+  source_layers[e->k][index] = value;
+}
+
+static void BatchWallEditRow(int i, void *ptr)
+{
+  WallEdit *e = (WallEdit *) ptr;
+  RNScalar *x = new RNScalar [3 * grid_ny];
+  RNScalar *y = x + grid_ny;
+  RNScalar *delta = y + grid_ny;
+  for (int j = 0; j < grid_ny; j++)
+  {
+    x[j] = grid_x0 + grid_dx * i;
+    y[j] = grid_y0 + grid_dy * j;
+    delta[j] = 0;
+  }
+  if (AddWallPathsRow(e->wall, e->mu, e->source->Position(), grid_ny, x, y, delta))
+  {
+    // points with a zero chord are outside the wall's shadow
+    for (int j = 0; j < grid_ny; j++)
+      if (delta[j] != 0)
+        ApplyPathDelta(e, i, j, delta[j]);
+  }
+  delete [] x;
+}
+
+static void WallEditRow(int i, void *ptr)
+{
+  WallEdit *e = (WallEdit *) ptr;
+  for (int j = 0; j < grid_ny; j++)
+    if (e->delta[i * grid_ny + j] != 0)
+      ApplyPathDelta(e, i, j, e->delta[i * grid_ny + j]);
+}
+
+// adds (sign = 1) or takes out (sign = -1) the contribution of one wall to
+//   the paths of every source; only points in the wall's shadow are touched
+static void UpdateWallPaths(int wall, RNScalar sign, R3Scene *scene)
+{
+  RNScopedTimer timer("Edit wall");
+  for (int k = 0; k < scene->NRadSources(); k++)
+  {
+    WallEdit e;
+    e.wall = wall;
+    e.mu = sign * walls.Mu(wall);
+    e.k = k;
+    e.source = scene->RadSource(k);
+    e.delta = NULL;
+    if (engine != PERWALL_ENGINE)
+    {
+      ForEachGridRow(BatchWallEditRow, &e);
+      continue;
+    }
+
+    // collect the wall's path changes into a scratch grid first
+    e.delta = new double[grid_nx * grid_ny];
+    for (int i = 0; i < grid_nx * grid_ny; i++)
+      e.delta[i] = 0;
+    optical_paths = e.delta;
+    if (walls.Type(wall) == WALLSET_BOX)
+      CalculatePathsWall(wall, *(e.source), e.mu);
+    else if (walls.Type(wall) == WALLSET_POLYGON)
+      CalculatePathsPolygon(wall, *(e.source), e.mu);
+    optical_paths = source_paths[k];
+    ForEachGridRow(WallEditRow, &e);
+    delete [] e.delta;
+  }
+}
+
+static void RemoveWall(int wall, R3Scene *scene)
+{
+  UpdateWallPaths(wall, -1, scene);
+  walls.RemoveWall(wall);
+}
+
+static void MoveWall(int wall, R3Vector displacement, R3Scene *scene)
+{
+  R3Affine translation(R3identity_affine);
+  translation.Translate(displacement);
+  UpdateWallPaths(wall, -1, scene);
+  walls.TransformWall(wall, translation);
+  UpdateWallPaths(wall, 1, scene);
+}
+
+// inserts a displaced copy of a box wall and returns its index (-1 for other walls)
+static int CopyWall(int wall, R3Vector displacement, R3Scene *scene)
+{
+  if (walls.Type(wall) != WALLSET_BOX) return -1;
+  R3Point points[4];
+  for (int k = 0; k < 4; k++)
+    points[k] = walls.Vertex(wall, k) + displacement;
+  int copy = walls.InsertQuad(points, walls.Mu(wall), walls.Element(wall));
+  UpdateWallPaths(copy, 1, scene);
+  return copy;
+}
+
+// returns index of the source contributing most at a grid point (-1 if none)
+static int getBestSource(int ix, int iy, R3Scene *scene)
+{
+  int best = -1;
+  RNScalar best_value = 0;
+  for (int k = 0; k < scene->NRadSources(); k++)
+  {
+    RNScalar value = scene->RadSource(k)->Strength() * source_layers[k][ix * grid_ny + iy];
+    if (value > best_value)
+    {
+      best = k;
+      best_value = value;
+    }
+  }
+  return best;
+}
+
+// color used to draw the points a source serves best
+static RNRgb SourceColor(int k)
+{
+  static const RNRgb colors[8] = {
+    RNRgb(1.0, 0.2, 0.2), RNRgb(0.2, 0.8, 0.2), RNRgb(0.2, 0.4, 1.0), RNRgb(1.0, 0.8, 0.0),
+    RNRgb(0.8, 0.2, 1.0), RNRgb(0.0, 0.8, 0.8), RNRgb(1.0, 0.5, 0.0), RNRgb(0.6, 0.6, 0.6)
+  };
+  if (k < 0) return RNRgb(0.0, 0.0, 0.0);
+  return colors[k % 8];
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -659,7 +1486,7 @@ DrawSources(R3Scene *scene)
   double radius = scene->BBox().DiagonalRadius() * grid_point_radius * 3;
   for (int i = 0; i < scene->NRadSources(); i++) {
     Radiator *source = scene->RadSource(i);
-    if ((movement) && (i == current_rad_source))
+    if ((movement == 1) && (i == current_rad_source))
       RNLoadRgb(RNRgb(1.0,0.0,1.0));
     else
       RNLoadRgb(RNRgb(0.0,1.0,1.0));
@@ -751,6 +1578,22 @@ DrawRays(R3Scene *scene)
 }
 
 
+/* outlines the compiled walls, highlighting the one being edited */
+static void
+DrawWalls(void)
+{
+  for (int wall = 0; wall < walls.NWalls(); wall++) {
+    if ((walls.Type(wall) != WALLSET_BOX) && (walls.Type(wall) != WALLSET_POLYGON)) continue;
+    if (wall == current_wall) RNLoadRgb(RNRgb(1.0, 0.0, 1.0));
+    else RNLoadRgb(RNRgb(1.0, 1.0, 0.0));
+    glBegin(GL_LINE_LOOP);
+    for (int k = 0; k < walls.NVertices(wall); k++)
+      R3LoadPoint(walls.Vertex(wall, k));
+    glEnd();
+  }
+}
+
+
 /* draws the sphere at grid point position with value value */
 /* value must be scaled to be from 0 to 1 */
 static void 
@@ -777,10 +1620,38 @@ DrawSphere(R3Scene *scene, R3Point position, RNScalar value)
 /* draws the grid */
 static void DrawGrid(R3Scene *scene)
 {
-
+  double radius = grid_point_radius * scene->BBox().DiagonalRadius();
   for (int ix = 0; ix < grid_nx; ix++)
     for (int iy = 0; iy < grid_ny; iy++)
-      DrawSphere(scene, getGridPosition(ix, iy), getGridValue(ix, iy));
+    {
+      if (show_best_source)
+      {
+        // color by the source serving the point
+        RNLoadRgb(SourceColor(getBestSource(ix, iy, scene)));
+        R3Sphere(getGridPosition(ix, iy), radius).Draw();
+      }
+      else
+        DrawSphere(scene, getGridPosition(ix, iy), getGridValue(ix, iy));
+    }
+}
+
+
+
+/* draws the timers and counters of the profile, top left */
+static void DrawProfile(void)
+{
+  char buffer[256];
+  int y = GLUTwindow_height - 20;
+  for (int k = 0; k < RNNProfileTimers(); k++, y -= 15) {
+    sprintf(buffer, "%s: %.2f ms last, %.1f ms total, %d times", RNProfileTimerName(k),
+      1000 * RNProfileTimerLastSeconds(k), 1000 * RNProfileTimerSeconds(k), RNProfileTimerCount(k));
+    DrawText(R2Point(10, y), buffer);
+  }
+  for (int k = 0; k < RNNProfileCounters(); k++, y -= 15) {
+    const RNProfileCounter *counter = RNKthProfileCounter(k);
+    sprintf(buffer, "%s: %lld", counter->Name(), counter->Count());
+    DrawText(R2Point(10, y), buffer);
+  }
 }
 
 
@@ -791,6 +1662,9 @@ static void DrawGrid(R3Scene *scene)
 
 void GLUTStop(void)
 {
+  // Write profile
+  if (profile_name) RNWriteProfile(profile_name);
+
   // Destroy window 
   glutDestroyWindow(GLUTwindow);
 
@@ -804,6 +1678,7 @@ void GLUTRedraw(void)
 {
   // Check scene
   if (!scene) return;
+  RNScopedTimer timer("Draw");
 
   // Set viewing transformation
   viewer->Camera().Load();
@@ -867,6 +1742,14 @@ void GLUTRedraw(void)
     DrawBBoxes(scene, scene->Root());
   }
 
+  // Draw walls being edited
+  if (movement == 2) {
+    glDisable(GL_LIGHTING);
+    glLineWidth(3);
+    DrawWalls();
+    glLineWidth(1);
+  }
+
   // Draw grid
   if (show_grid) {
     glDisable(GL_LIGHTING);
@@ -888,8 +1771,16 @@ void GLUTRedraw(void)
     }
   }  
 
+  // Draw profile
+  if (show_profile) {
+    glDisable(GL_LIGHTING);
+    glColor3d(1.0, 1.0, 1.0);
+    DrawProfile();
+  }
+
   // Capture screenshot image 
   if (screenshot_image_name) {
+    RNScopedTimer screenshot_timer("Screenshot");
     if (print_verbose) printf("Creating image %s\n", screenshot_image_name);
     R2Image image(GLUTwindow_width, GLUTwindow_height, 3);
     image.Capture();
@@ -1043,7 +1934,7 @@ void GLUTKeyboard(unsigned char key, int x, int y)
   case 'e':
     if (num_rad_sources)
     {
-      if (movement) {
+      if (movement == 1) {
         current_rad_source = (current_rad_source + 1 ) % num_rad_sources;
       }
       else {
@@ -1052,11 +1943,35 @@ void GLUTKeyboard(unsigned char key, int x, int y)
     }
     break;
 
+  case 'F':
+  case 'f': {
+    // select next wall that can be edited
+    int n = walls.NWalls();
+    for (int i = 1; i <= n; i++) {
+      int wall = (current_wall + i) % n;
+      if ((walls.Type(wall) == WALLSET_BOX) || (walls.Type(wall) == WALLSET_POLYGON)) {
+        current_wall = wall;
+        movement = 2;
+        break;
+      }
+    }
+    break; }
+
   case 'G':
   case 'g':
     show_grid = !show_grid;
     break;
 
+  case 'I':
+  case 'i':
+    if (movement == 2) {
+      R3Vector offset = camera_dx * scene->BBox().DiagonalRadius() * viewer->Camera().Right();
+      offset.SetZ(0.0);
+      int copy = CopyWall(current_wall, offset, scene);
+      if (copy >= 0) current_wall = copy;
+    }
+    break;
+
   case 'L':
   case 'l':
     show_lights = !show_lights;
@@ -1067,6 +1982,13 @@ void GLUTKeyboard(unsigned char key, int x, int y)
     show_sources = !show_sources;
     break;
 
+  case 'P':
+  case 'p':
+    // Show the profile, recording it from now on
+    show_profile = !show_profile;
+    if (show_profile && !RNIsProfileEnabled()) RNEnableProfile();
+    break;
+
   case 'R':
   case 'r':
     show_rays = !show_rays;
@@ -1077,6 +1999,35 @@ void GLUTKeyboard(unsigned char key, int x, int y)
     show_frame_rate = !show_frame_rate;
     break;
 
+  case 'V':
+  case 'v':
+    show_best_source = !show_best_source;
+    break;
+
+  case 'X':
+  case 'x':
+    if (movement == 2) {
+      RemoveWall(current_wall, scene);
+      movement = 0;
+    }
+    break;
+
+  case '+':
+  case '=':
+    if (movement == 1) {
+      Radiator *source = scene->RadSource(current_rad_source);
+      SetRadiatorStrength(current_rad_source, 1.25 * source->Strength(), scene);
+    }
+    break;
+
+  case '-':
+  case '_':
+    if (movement == 1) {
+      Radiator *source = scene->RadSource(current_rad_source);
+      SetRadiatorStrength(current_rad_source, 0.8 * source->Strength(), scene);
+    }
+    break;
+
   case ' ':
     viewer->SetCamera(scene->Camera());
     break;
@@ -1089,7 +2040,8 @@ void GLUTKeyboard(unsigned char key, int x, int y)
     }
     else {
       moveVector.SetZ(0.0);
-      MoveRadiator(scene->RadSource(current_rad_source), moveVector, scene);
+      if (movement == 1) MoveRadiator(current_rad_source, moveVector, scene);
+      else MoveWall(current_wall, moveVector, scene);
     }
 
     break; }
@@ -1102,7 +2054,8 @@ void GLUTKeyboard(unsigned char key, int x, int y)
     }
     else {
       moveVector.SetZ(0.0);
-      MoveRadiator(scene->RadSource(current_rad_source), moveVector, scene);
+      if (movement == 1) MoveRadiator(current_rad_source, moveVector, scene);
+      else MoveWall(current_wall, moveVector, scene);
     }
 
     break; }
@@ -1115,7 +2068,8 @@ void GLUTKeyboard(unsigned char key, int x, int y)
     }
     else {
       moveVector.SetZ(0.0);
-      MoveRadiator(scene->RadSource(current_rad_source), moveVector, scene);
+      if (movement == 1) MoveRadiator(current_rad_source, moveVector, scene);
+      else MoveWall(current_wall, moveVector, scene);
     }
 
     break; }
@@ -1128,7 +2082,8 @@ void GLUTKeyboard(unsigned char key, int x, int y)
     }
     else {
       moveVector.SetZ(0.0);
-      MoveRadiator(scene->RadSource(current_rad_source), moveVector, scene);
+      if (movement == 1) MoveRadiator(current_rad_source, moveVector, scene);
+      else MoveWall(current_wall, moveVector, scene);
     }
     break; }
 
@@ -1210,6 +2165,7 @@ static R3Scene *
 ReadScene(char *filename)
 {
   // Start statistics
+  RNScopedTimer timer("Load scene");
   RNTime start_time;
   start_time.Read();
 
@@ -1264,6 +2220,67 @@ WriteImage(R2Image *image, const char *filename)
 
 
 
+static int
+WriteGrid(const char *filename)
+{
+  // Copy grid values into an R2Grid mapping grid point (ix, iy) to its world position
+  R2Grid output(grid_nx, grid_ny, GridWorldToGrid(grid_x0, grid_y0, grid_dx, grid_dy));
+  for (int ix = 0; ix < grid_nx; ix++)
+    for (int iy = 0; iy < grid_ny; iy++)
+      output.SetGridValue(ix, iy, getGridValue(ix, iy));
+
+  // Write values or colormap, depending on the extension
+  return WriteGridFile(output, filename, print_verbose);
+}
+
+
+
+static int
+WriteBestSources(const char *filename)
+{
+  // Start statistics
+  RNTime start_time;
+  start_time.Read();
+
+  // Parse output filename extension
+  const char *extension = strrchr(filename, '.');
+  if (!extension) {
+    fprintf(stderr, "Output file has no extension (e.g., .pfm, .jpg): %s\n", filename);
+    return 0;
+  }
+
+  // Write file of appropriate type
+  if (!strcmp(extension, ".pfm") || !strcmp(extension, ".raw") || !strcmp(extension, ".grd")) {
+    // Store index of best source (-1 where no source reaches)
+    R2Grid output(grid_nx, grid_ny, GridWorldToGrid(grid_x0, grid_y0, grid_dx, grid_dy));
+    for (int ix = 0; ix < grid_nx; ix++)
+      for (int iy = 0; iy < grid_ny; iy++)
+        output.SetGridValue(ix, iy, getBestSource(ix, iy, scene));
+    if (!output.WriteFile(filename)) return 0;
+  }
+  else {
+    // Color each point by its best source
+    R2Image image(grid_nx, grid_ny, 3);
+    for (int ix = 0; ix < grid_nx; ix++)
+      for (int iy = 0; iy < grid_ny; iy++)
+        image.SetPixelRGB(ix, iy, SourceColor(getBestSource(ix, iy, scene)));
+    if (!WriteImage(&image, filename)) return 0;
+  }
+
+  // Print statistics
+  if (print_verbose) {
+    printf("Wrote best sources to %s ...\n", filename);
+    printf("  Time = %.2f seconds\n", start_time.Elapsed());
+    printf("  Resolution = %d %d\n", grid_nx, grid_ny);
+    fflush(stdout);
+  }
+
+  // Return success
+  return 1;
+}
+
+
+
 ////////////////////////////////////////////////////////////////////////
 // Program argument parsing
 ////////////////////////////////////////////////////////////////////////
@@ -1289,6 +2306,24 @@ ParseArgs(int argc, char **argv)
         argc--; argv++; grid_nx = atoi(*argv); 
         argc--; argv++; grid_ny = atoi(*argv); 
       }
+      else if (!strcmp(*argv, "-threads")) { 
+        argc--; argv++; num_threads = atoi(*argv); 
+      }
+      else if (!strcmp(*argv, "-best")) { 
+        argc--; argv++; output_best_name = *argv; 
+      }
+      else if (!strcmp(*argv, "-perwall")) { 
+        engine = PERWALL_ENGINE; 
+      }
+      else if (!strcmp(*argv, "-sweep")) { 
+        engine = SWEEP_ENGINE; 
+      }
+      else if (!strcmp(*argv, "-profile")) { 
+        argc--; argv++; profile_name = *argv; 
+      }
+      else if (!strcmp(*argv, "-simd")) { 
+        argc--; argv++; WallKernelLimitWidth(atoi(*argv)); 
+      }
       else { 
         fprintf(stderr, "Invalid program argument: %s", *argv); 
         exit(1); 
@@ -1305,7 +2340,7 @@ ParseArgs(int argc, char **argv)
 
   // Check scene filename
   if (!input_scene_name) {
-    fprintf(stderr, "Usage: photonmap inputscenefile [outputimagefile] [-resolution <int> <int>] [-v]\n");
+    fprintf(stderr, "Usage: radiation inputscenefile [outputfile] [-gdim <int> <int>] [-gr <float>] [-threads <int>] [-perwall | -sweep] [-simd <int>] [-best <file>] [-profile <file>] [-v]\n");
     return 0;
   }
 
@@ -1324,11 +2359,57 @@ int main(int argc, char **argv)
   // Parse program arguments
   if (!ParseArgs(argc, argv)) exit(-1);
 
+  // Record timers and counters from the start
+  if (profile_name) RNEnableProfile();
+
+  // Start worker threads (-threads 0 uses every processor)
+  if (num_threads != 1) thread_pool = new RNThreadPool(num_threads);
+
   // Read scene
+  RNTime read_time;
+  read_time.Read();
   scene = ReadScene(input_scene_name);
   if (!scene) exit(-1);
+  double read_seconds = read_time.Elapsed();
+
+  // Compile walls
+  RNTime walls_time;
+  walls_time.Read();
+  walls.Compile(scene);
+  double walls_seconds = walls_time.Elapsed();
+  if (print_verbose) {
+    printf("Compiled walls ...\n");
+    printf("  Time = %.2f seconds\n", walls_seconds);
+    printf("  # Walls = %d\n", walls.NWalls());
+    fflush(stdout);
+  }
 
+  // Run without a window if an output file was given
+  if (output_image_name) {
+    // Compute grid
+    RNTime grid_time;
+    grid_time.Read();
+    initGrid(scene);
+    double grid_seconds = grid_time.Elapsed();
+
+    // Write grid
+    RNTime write_time;
+    write_time.Read();
+    if (!WriteGrid(output_image_name)) exit(-1);
+    if (output_best_name && !WriteBestSources(output_best_name)) exit(-1);
+    double write_seconds = write_time.Elapsed();
+
+    // Print timings
+    printf("%s: %d sources, %d x %d grid\n", input_scene_name, scene->NRadSources(), grid_nx, grid_ny);
+    printf("  Read = %.3f seconds\n", read_seconds);
+    printf("  Walls = %.3f seconds\n", walls_seconds);
+    printf("  Grid = %.3f seconds\n", grid_seconds);
+    printf("  Write = %.3f seconds\n", write_seconds);
+    fflush(stdout);
 
+    // Write profile
+    if (profile_name && !RNWriteProfile(profile_name)) exit(-1);
+  }
   else {
     initGrid(scene);
     num_rad_sources = scene->NRadSources();
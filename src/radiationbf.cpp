@@ -7,19 +7,37 @@
 #include "R3Graphics/R3Graphics.h"
 #include "fglut/fglut.h"
 #include "Radiator.h"
+#include "WallSet.h"
+#include "GridFile.h"
+#include "GridLayout.h"
+#include <new>
+#if (RN_OS != RN_WINDOWS)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
 
 // Program variables
 
 static char *input_scene_name = NULL;
 static char *output_image_name = NULL;
 static char *screenshot_image_name = NULL;
+static char *record_trace_name = NULL;
+static char *replay_trace_name = NULL;
+static char *profile_name = NULL;
+static char *cache_directory = NULL;
 static int render_image_width = 64;
 static int render_image_height = 64;
 static int print_verbose = 0;
 
 // Grid
+#define PACKET_SIZE R3_SCENE_TREE_PACKET_SIZE  // grid points traced together
 static double grid_point_radius = 0.00625;
 static double* grid;
+static int grid_layout_type = GRIDLAYOUT_ROWS;
+static GridLayout grid_layout;
+static double adaptive_tolerance = -1;  // negative to evaluate every point
+static int adaptive_evaluations = 0;
 static int grid_nx = 10;
 static int grid_ny = 10;
 static double grid_dx;
@@ -28,6 +46,11 @@ static double grid_x0;
 static double grid_y0;
 static double grid_scale = 1.0;
 
+// Threads
+static int num_threads = 1;
+static RNThreadPool *thread_pool = NULL;
+static R3SceneQueryContext query_statistics;  // summed over all jobs
+
 // GLUT variables 
 
 static int GLUTwindow = 0;
@@ -47,7 +70,6 @@ static double camera_dx = 0.02;
 static double camera_dy = 0.02;
 
 // ray_tracing
-static int max_layer = 15;
 
 #if 0
 // FPS
@@ -61,6 +83,7 @@ static R3Camera FPSToggleCam;
 
 static R3Viewer *viewer = NULL;
 static R3Scene *scene = NULL;
+static WallSet walls;
 static R3Point center(0, 0, 0);
 
 
@@ -75,6 +98,7 @@ static int show_bboxes = 0;
 static int show_rays = 0;
 static int show_frame_rate = 0;
 static int show_grid = 1;
+static int show_profile = 0;
 
 static void initGridValues(R3Scene *scene);
 
@@ -92,7 +116,8 @@ static void initGrid(R3Scene *scene)
     printf("Grid: (%.3f:%.3f:%.3f) X (%.3f:%.3f:%.3f)\n", grid_x0, grid_dx, grid_x0 + (grid_nx - 1) * grid_dx,
       grid_y0, grid_dy, grid_y0 + (grid_ny - 1) * grid_dy);
   }
-  grid = new double[grid_nx * grid_ny];
+  grid_layout.Setup(grid_layout_type, grid_nx, grid_ny);
+  grid = new double[grid_layout.NEntries()];
   initGridValues(scene);
 }
 
@@ -104,27 +129,28 @@ static R3Point getGridPosition(int ix, int iy)
 
 static RNScalar getGridValue(int ix, int iy)
 {
-  return grid[ix * grid_ny + iy];
+  return grid[grid_layout.Index(ix, iy)];
 }
 
 static void setGridValue(RNScalar value, int ix, int iy)
 {
-  grid[ix * grid_ny + iy] = value * grid_scale;
+  grid[grid_layout.Index(ix, iy)] = value * grid_scale;
 }
 
 static void incGridValue(RNScalar inc, int ix, int iy)
 {
-  grid[ix * grid_ny + iy] += inc * grid_scale;
+  grid[grid_layout.Index(ix, iy)] += inc * grid_scale;
 }
 
-// sets 0.5 to the arithmetic mean
+// sets 0.5 to the arithmetic mean (padding of the tiled layout stays 0)
 static void NormalizeGridScale(void)
 {
+  RNScopedTimer timer("Normalize");
   double sum = 0;
-  for (int i = 0; i < grid_nx * grid_ny; i++)
+  for (int i = 0; i < grid_layout.NEntries(); i++)
     sum += grid[i];
   sum /= 2 * grid_nx * grid_ny;
-  for (int i = 0; i < grid_nx * grid_ny; i++)
+  for (int i = 0; i < grid_layout.NEntries(); i++)
     grid[i] /= sum;
   grid_scale /= sum;
 }
@@ -134,103 +160,1349 @@ static RNScalar source2pointDistance(R3Point point, Radiator &source) {
     return (point - source.Position()).Length();
 }
 
-RNScalar opticalPath(R3Ray &ray, R3Scene *scene, R3Point source_point, RNBoolean in, int layer) {
-    R3SceneNode *node = NULL;
-    R3SceneElement *element = NULL;
-    R3Shape *shape = NULL;
-    R3Point point;
-    R3Vector normal;
-    RNScalar t;    
-    RNScalar epsilon = 1e-15;
-    RNScalar mu = 0;
-    assert(scene);
-
-    RNBoolean intersects = scene->Intersects(ray, &node, &element, 
-                &shape, &point, &normal, &t); 
-    // if in is true we assume that our ray intersected with the scene. subtract 1 from IoR
-    if (element && element->Material())
-      mu = in ? (element->Material()->Brdf()->IndexOfRefraction() - 1): 0;
-    else if (print_verbose)
-      printf("Lack of element or material!\n");
-#if 0
-    // debug
-    if (print_verbose)
-    {
-      printf("In: %d, IoR: %f: from (%.3f,%.3f,%.3f) to (%.3f,%.3f,%.3f)\n", in, element->Material()->Brdf()->IndexOfRefraction(),
-        ray.Start().X(), ray.Start().Y(), ray.Start().Z(), point.X(),point.Y(), point.Z());
-      printf("t: %.3f; intersects: %d; ray.T: %.3f\n", t, intersects, ray.T(source_point));
+// computes optical path lengths from n points to the source: the parts of each
+//   segment inside solids, each weighted by IoR - 1. Segments are traced through
+//   the scene together in packets, which works best for neighbouring points
+static void opticalPaths(int n, const R3Point *points, Radiator &source, R3Scene *scene,
+    R3SceneQueryContext &context, RNScalar *paths) {
+    // nothing to trace for points where no scene geometry is near the segment
+    R3Span spans[PACKET_SIZE];
+    int index[PACKET_SIZE];
+    int nspans = 0;
+    for (int i = 0; i < n; i++) {
+      paths[i] = 0;
+      if (!walls.MayIntersect(points[i], source.Position())) continue;
+      spans[nspans] = R3Span(points[i], source.Position());
+      index[nspans++] = i;
+    }
+    if (nspans == 0)
+      return;
+
+    R3SceneInterval buffer[PACKET_SIZE * 64];
+    int counts[PACKET_SIZE];
+    scene->Intervals(nspans, spans, buffer, 64, counts, &context);
+
+    for (int k = 0; k < nspans; k++) {
+      // trace again alone if the span had more intervals than fit
+      R3SceneInterval *intervals = buffer + k * 64;
+      int nintervals = counts[k];
+      if (nintervals > 64) {
+        intervals = new R3SceneInterval[nintervals];
+        scene->Intervals(spans[k], intervals, nintervals, &context);
+      }
+
+      RNScalar path = 0;
+      for (int i = 0; i < nintervals; i++) {
+        R3SceneElement *element = intervals[i].element;
+        if (element && element->Material())
+          path += (intervals[i].t2 - intervals[i].t1) * spans[k].Length() *
+            (element->Material()->Brdf()->IndexOfRefraction() - 1);
+        else if (print_verbose)
+          printf("Lack of element or material!\n");
+      }
+      paths[index[k]] = path;
+
+      if (intervals != buffer + k * 64)
+        delete [] intervals;
     }
+}
+
+// runs njobs jobs on the thread pool, or one after another without threads
+static void RunJobs(int njobs, void (*function)(int job, void *data), void *data)
+{
+  if (thread_pool) {
+    thread_pool->Run(njobs, function, data);
+  }
+  else {
+    for (int job = 0; job < njobs; job++)
+      function(job, data);
+  }
+}
+
+// segments traced through the scene, counted while profiling
+static RNProfileCounter rays_cast("Rays cast");
+
+// adds the statistics of per-job query contexts to the program's totals
+static void AddQueryStatistics(int njobs, const R3SceneQueryContext *contexts)
+{
+  for (int job = 0; job < njobs; job++) {
+    rays_cast.Add(contexts[job].nqueries);
+    query_statistics.nqueries += contexts[job].nqueries;
+    query_statistics.nnodes += contexts[job].nnodes;
+    query_statistics.nshapes += contexts[job].nshapes;
+  }
+}
+
+// grid blocks (rows or tiles of the grid layout) traced for one source, handed
+//   out to the thread pool. Each job has its own query context, and no two jobs
+//   touch the same grid point
+struct StrengthJobs {
+  Radiator *source;
+  R3Scene *scene;
+  RNScalar sign;
+  int blocks_per_job;
+  R3SceneQueryContext *contexts;
+};
+
+// traces packets of PACKET_SIZE neighbouring points along each grid column of a
+//   job's blocks, in the traversal order of the grid layout
+static void AccumulateStrengthBlocks(int job, void *data)
+{
+  RNScopedTimer timer("Trace paths");
+  StrengthJobs *jobs = (StrengthJobs *) data;
+  Radiator &source = *(jobs->source);
+  R3Point points[PACKET_SIZE];
+  RNScalar paths[PACKET_SIZE];
+  int block1 = (job + 1) * jobs->blocks_per_job;
+  if (block1 > grid_layout.NBlocks()) block1 = grid_layout.NBlocks();
+  for (int block = job * jobs->blocks_per_job; block < block1; block++) {
+    int i0, j0, i1, j1;
+    grid_layout.Block(block, &i0, &j0, &i1, &j1);
+    for (int i = i0; i < i1; i++) {
+      for (int j = j0; j < j1; j += PACKET_SIZE) {
+        int n = (j1 - j < PACKET_SIZE) ? j1 - j : PACKET_SIZE;
+        for (int k = 0; k < n; k++)
+          points[k] = getGridPosition(i, j + k);
+        opticalPaths(n, points, source, jobs->scene, jobs->contexts[job], paths);
+        for (int k = 0; k < n; k++) {
+          RNScalar r = source2pointDistance(points[k], source);
+          incGridValue(jobs->sign * exp(-paths[k]) / (r * r), i, j + k);
+        }
+      }
+    }
+  }
+}
+
+// adds sign times the radiator strength from source to the strength grid
+static void AccumulateStrength(Radiator &source, R3Scene *scene, RNScalar sign)
+{
+  RNScopedTimer timer("Strength pass");
+
+  // build what queries would otherwise build on first use, so jobs only read the scene
+  scene->PrepareQueries();
+
+  // several jobs per thread to even out blocks with more geometry in view
+  StrengthJobs jobs;
+  jobs.source = &source;
+  jobs.scene = scene;
+  jobs.sign = sign;
+  int nblocks = grid_layout.NBlocks();
+  jobs.blocks_per_job = (thread_pool) ? nblocks / (4 * thread_pool->NThreads()) : nblocks;
+  if (jobs.blocks_per_job < 1) jobs.blocks_per_job = 1;
+  int njobs = (nblocks + jobs.blocks_per_job - 1) / jobs.blocks_per_job;
+  jobs.contexts = new R3SceneQueryContext [ njobs ];
+  RunJobs(njobs, AccumulateStrengthBlocks, &jobs);
+  AddQueryStatistics(njobs, jobs.contexts);
+  delete [] jobs.contexts;
+}
+
+static void SubtractStrength(Radiator &source, R3Scene *scene)
+{
+  AccumulateStrength(source, scene, -1);
+}
+
+static void UpdateStrength(Radiator &source, R3Scene *scene)
+{
+  AccumulateStrength(source, scene, 1);
+}
+
+// sets field to the unit field of one source at every grid point (ix * grid_ny + iy),
+//   traced into a zeroed grid that stands in for the strength grid meanwhile
+static void TraceSourceField(Radiator &source, R3Scene *scene, RNScalar *field)
+{
+  double *total = grid;
+  RNScalar total_scale = grid_scale;
+  grid = new double[grid_layout.NEntries()];
+  for (int i = 0; i < grid_layout.NEntries(); i++)
+    grid[i] = 0;
+  grid_scale = 1.0;
+  UpdateStrength(source, scene);
+  for (int ix = 0; ix < grid_nx; ix++)
+    for (int iy = 0; iy < grid_ny; iy++)
+      field[ix * grid_ny + iy] = getGridValue(ix, iy);
+  delete [] grid;
+  grid = total;
+  grid_scale = total_scale;
+}
+
+// The field cache (-cache <directory>) keeps the field of each source, at unit
+//   strength and grid scale, as an R2Grid file named by a hash of everything
+//   the field depends on: the engine version, every traced shape with its
+//   node transformation and material index of refraction, the grid points,
+//   and the source position. Strengths are left out, since
+//   fields do not depend on them. Runs that find a source's file add it from
+//   the mapped file instead of tracing, and the others write it. Files are
+//   written under another name and renamed, so runs sharing a directory never
+//   read one partly written. The viewer reads and writes the cache for its
+//   first grid only; the fields of moved sources are recomputed, not cached.
+//   The cache cannot be combined with adaptive or lazy evaluation
+#define FIELD_CACHE_VERSION 2  // change whenever the traced field changes
+static unsigned long long field_cache_key = 0;  // hash of all but the source position
+static int field_cache_hits = 0;
+static int field_cache_misses = 0;
+
+// folds bytes into an FNV-1a hash
+static unsigned long long HashBytes(unsigned long long hash, const void *data, size_t size)
+{
+  const unsigned char *bytes = (const unsigned char *) data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// continues the hash over the shapes of node and its children, in traversal order,
+//   with the transformation and index of refraction that intervals are traced with
+static unsigned long long HashSceneNode(unsigned long long hash, R3SceneNode *node, R3Affine transformation)
+{
+  // Accumulate node transformation
+  transformation.Transform(node->Transformation());
+  const R4Matrix& matrix = transformation.Matrix();
+  for (int i = 0; i < 4; i++)
+    hash = HashBytes(hash, matrix[i], 4 * sizeof(RNScalar));
+
+  // Hash shapes by type and parameters (class ids depend on registration order, so
+  //   each type gets a fixed code, and other shapes only their bounding box)
+  int nelements = node->NElements();
+  hash = HashBytes(hash, &nelements, sizeof(int));
+  for (int i = 0; i < nelements; i++) {
+    R3SceneElement *element = node->Element(i);
+    RNScalar mu = (element->Material()) ? element->Material()->Brdf()->IndexOfRefraction() : 1;
+    int nshapes = element->NShapes();
+    hash = HashBytes(hash, &mu, sizeof(RNScalar));
+    hash = HashBytes(hash, &nshapes, sizeof(int));
+    for (int j = 0; j < nshapes; j++) {
+      R3Shape *shape = element->Shape(j);
+      int type = 0;
+      RNScalar parameters[7] = { 0, 0, 0, 0, 0, 0, 0 };
+      if (shape->ClassID() == R3Box::CLASS_ID()) {
+        const R3Box& box = *((R3Box *) shape);
+        RNScalar coords[7] = { box.XMin(), box.YMin(), box.ZMin(), box.XMax(), box.YMax(), box.ZMax(), 0 };
+        type = 1;
+        memcpy(parameters, coords, sizeof(coords));
+      }
+      else if (shape->ClassID() == R3Sphere::CLASS_ID()) {
+        const R3Sphere& sphere = *((R3Sphere *) shape);
+        RNScalar coords[7] = { sphere.Center().X(), sphere.Center().Y(), sphere.Center().Z(), sphere.Radius(), 0, 0, 0 };
+        type = 2;
+        memcpy(parameters, coords, sizeof(coords));
+      }
+      else if ((shape->ClassID() == R3Cylinder::CLASS_ID()) || (shape->ClassID() == R3Cone::CLASS_ID())) {
+        RNBoolean cone = (shape->ClassID() == R3Cone::CLASS_ID());
+        const R3Span& axis = (cone) ? ((R3Cone *) shape)->Axis() : ((R3Cylinder *) shape)->Axis();
+        RNLength radius = (cone) ? ((R3Cone *) shape)->Radius() : ((R3Cylinder *) shape)->Radius();
+        RNScalar coords[7] = { axis.Start().X(), axis.Start().Y(), axis.Start().Z(),
+                               axis.End().X(), axis.End().Y(), axis.End().Z(), radius };
+        type = (cone) ? 4 : 3;
+        memcpy(parameters, coords, sizeof(coords));
+      }
+      else if ((shape->ClassID() == R3TriangleArray::CLASS_ID()) || (shape->ClassID() == R3Triangle::CLASS_ID())) {
+        type = (shape->ClassID() == R3Triangle::CLASS_ID()) ? 5 : 6;
+      }
+      else {
+        const R3Box& box = shape->BBox();
+        RNScalar coords[7] = { box.XMin(), box.YMin(), box.ZMin(), box.XMax(), box.YMax(), box.ZMax(), 0 };
+        type = 7;
+        memcpy(parameters, coords, sizeof(coords));
+      }
+      hash = HashBytes(hash, &type, sizeof(int));
+      hash = HashBytes(hash, parameters, sizeof(parameters));
+
+      // Hash triangle vertices
+      int ntriangles = (type == 5) ? 1 : (type == 6) ? ((R3TriangleArray *) shape)->NTriangles() : 0;
+      hash = HashBytes(hash, &ntriangles, sizeof(int));
+      for (int k = 0; k < ntriangles; k++) {
+        R3Triangle *triangle = (type == 5) ? (R3Triangle *) shape : ((R3TriangleArray *) shape)->Triangle(k);
+        for (int v = 0; v < 3; v++) {
+          const R3Point& position = triangle->Vertex(v)->Position();
+          RNScalar coords[3] = { position.X(), position.Y(), position.Z() };
+          hash = HashBytes(hash, coords, sizeof(coords));
+        }
+      }
+    }
+  }
+
+  // Hash children
+  int nchildren = node->NChildren();
+  hash = HashBytes(hash, &nchildren, sizeof(int));
+  for (int i = 0; i < nchildren; i++)
+    hash = HashSceneNode(hash, node->Child(i), transformation);
+  return hash;
+}
+
+// hashes the engine version, scene and grid points (after initGrid)
+static void UpdateFieldCacheKey(R3Scene *scene)
+{
+  int version = FIELD_CACHE_VERSION;
+  int dimensions[2] = { grid_nx, grid_ny };
+  RNScalar placement[4] = { grid_x0, grid_y0, grid_dx, grid_dy };
+  unsigned long long hash = 14695981039346656037ULL;
+  hash = HashBytes(hash, &version, sizeof(version));
+  hash = HashSceneNode(hash, scene->Root(), R3identity_affine);
+  hash = HashBytes(hash, dimensions, sizeof(dimensions));
+  hash = HashBytes(hash, placement, sizeof(placement));
+  field_cache_key = hash;
+}
+
+// maps the cached field file of a source read-only, or reads it on systems
+//   without mmap; returns its values, or NULL if it is missing or not for this grid
+static const RNScalar *MapCachedField(const char *filename, size_t *size)
+{
+  // an R2Grid file is 2 ints of resolution, 9 RNScalars of transformation, and the values
+  size_t header_size = 2 * sizeof(int) + 9 * sizeof(RNScalar);
+  *size = header_size + (size_t) grid_nx * grid_ny * sizeof(RNScalar);
+#if (RN_OS == RN_WINDOWS)
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) return NULL;
+  char *data = (char *) malloc(*size + 1);
+  size_t nread = (data) ? fread(data, 1, *size + 1, fp) : 0;
+  fclose(fp);
+  if (nread != *size) { free(data); return NULL; }
+#else
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat status;
+  if ((fstat(fd, &status) < 0) || ((size_t) status.st_size != *size)) { close(fd); return NULL; }
+  void *mapping = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return NULL;
+  const char *data = (const char *) mapping;
+#endif
+  const int *resolution = (const int *) data;
+  if ((resolution[0] != grid_nx) || (resolution[1] != grid_ny)) {
+#if (RN_OS == RN_WINDOWS)
+    free(data);
+#else
+    munmap(mapping, *size);
 #endif
-    // in this case we have that we have traced our way to the 
-    // destination point, and we need not recurse 
-    if (!intersects || t > ray.T(source_point) || layer >= max_layer) {
-      if (print_verbose && (layer >= max_layer))
-        printf("Hit max layer!\n");
+    return NULL;
+  }
+  return (const RNScalar *) (data + header_size);
+}
 
-       return (ray.Start() - source_point).Length()*mu;
-    }  
+static void UnmapCachedField(const RNScalar *values, size_t size)
+{
+  const char *data = (const char *) values - (2 * sizeof(int) + 9 * sizeof(RNScalar));
+#if (RN_OS == RN_WINDOWS)
+  free((char *) data);
+#else
+  munmap((void *) data, size);
+#endif
+}
+
+// sets field to the unit field of source at every grid point (ix * grid_ny + iy),
+//   from the cache if it has the field, and otherwise traced and added to the cache
+static void CachedSourceField(Radiator &source, R3Scene *scene, RNScalar *field)
+{
+  // name the file by the hash of the source position and everything else
+  R3Point position = source.Position();
+  RNScalar coordinates[3] = { position.X(), position.Y(), position.Z() };
+  unsigned long long hash = HashBytes(field_cache_key, coordinates, sizeof(coordinates));
+  char filename[4096];
+  sprintf(filename, "%s/%016llx.grd", cache_directory, hash);
+
+  // read the cached field (R2Grid values have ix fastest)
+  size_t size;
+  const RNScalar *values = MapCachedField(filename, &size);
+  if (values) {
+    for (int ix = 0; ix < grid_nx; ix++)
+      for (int iy = 0; iy < grid_ny; iy++)
+        field[ix * grid_ny + iy] = values[iy * grid_nx + ix];
+    UnmapCachedField(values, size);
+    field_cache_hits++;
+    return;
+  }
 
-    R3Ray newRay(point + epsilon*ray.Vector(), source_point);
+  // trace the field
+  TraceSourceField(source, scene, field);
+  field_cache_misses++;
 
-    return (ray.Start() - point).Length()*mu +
-        opticalPath(newRay, scene, source_point, !in, layer + 1);  
+  // write it (a run that cannot write the cache still has its grid)
+  R2Grid file(grid_nx, grid_ny, GridWorldToGrid(grid_x0, grid_y0, grid_dx, grid_dy));
+  for (int ix = 0; ix < grid_nx; ix++)
+    for (int iy = 0; iy < grid_ny; iy++)
+      file.SetGridValue(ix, iy, field[ix * grid_ny + iy]);
+  char partial_filename[4096];
+#if (RN_OS == RN_WINDOWS)
+  sprintf(partial_filename, "%s/%016llx.partial.grd", cache_directory, hash);
+#else
+  sprintf(partial_filename, "%s/%016llx.%d.grd", cache_directory, hash, (int) getpid());
+#endif
+  if (file.WriteFile(partial_filename) && (rename(partial_filename, filename) != 0))
+    remove(partial_filename);
 }
 
-// returns optical path length
-static RNScalar opticalPath(R3Point point, Radiator &source, R3Scene *scene) {
-    R3Ray ray(point, source.Position());
+// adds sign times the field of source to the strength grid, through the cache
+static void AccumulateCachedStrength(Radiator &source, R3Scene *scene, RNScalar sign)
+{
+  RNScalar *field = new RNScalar [grid_nx * grid_ny];
+  CachedSourceField(source, scene, field);
+  for (int ix = 0; ix < grid_nx; ix++)
+    for (int iy = 0; iy < grid_ny; iy++)
+      incGridValue(sign * field[ix * grid_ny + iy], ix, iy);
+  delete [] field;
+}
 
-    RNBoolean in = FALSE;
+// Adaptive evaluation (-adaptive <tolerance>) samples the field of all sources
+//   on a coarse lattice of grid points, ADAPTIVE_STEP apart, and splits each
+//   cell of the lattice in four where its corner values differ by more than
+//   the tolerance relative to the largest, or where a wall edge crosses it,
+//   down to single grid cells. Points of cells that are not split are filled
+//   in by bilinear interpolation of the corners, so the full grid is still
+//   written and drawn; only the evaluated points are traced
+#define ADAPTIVE_STEP 16
+#define ADAPTIVE_POINTS_PER_JOB 256
+
+// a cell of the lattice, from grid point (ix0, iy0) to (ix1, iy1) inclusive
+struct AdaptiveCell {
+  int ix0, iy0, ix1, iy1;
+};
+
+static RNBoolean UpdateCancelled(int generation);
+
+// grid points whose field is evaluated, handed out in chunks to the thread pool
+struct FieldJobs {
+  R3Scene *scene;
+  int nsources;
+  Radiator **sources;
+  int npoints;
+  const int *points;  // ix * grid_ny + iy
+  RNScalar *values;   // field of each point
+  int generation;     // of the background update computing the field, or -1
+  R3SceneQueryContext *contexts;
+};
+
+// sums the field of every source at a chunk of points, traced in packets
+static void EvaluateFieldChunk(int job, void *data)
+{
+  FieldJobs *jobs = (FieldJobs *) data;
+  if (UpdateCancelled(jobs->generation)) return;
+  RNScopedTimer timer("Trace paths");
+  R3Point points[PACKET_SIZE];
+  RNScalar paths[PACKET_SIZE];
+  RNScalar values[PACKET_SIZE];
+  int i1 = (job + 1) * ADAPTIVE_POINTS_PER_JOB;
+  if (i1 > jobs->npoints) i1 = jobs->npoints;
+  for (int i = job * ADAPTIVE_POINTS_PER_JOB; i < i1; i += PACKET_SIZE) {
+    int n = (i1 - i < PACKET_SIZE) ? i1 - i : PACKET_SIZE;
+    for (int k = 0; k < n; k++) {
+      points[k] = getGridPosition(jobs->points[i + k] / grid_ny, jobs->points[i + k] % grid_ny);
+      values[k] = 0;
+    }
+    for (int s = 0; s < jobs->nsources; s++) {
+      Radiator &source = *(jobs->sources[s]);
+      opticalPaths(n, points, source, jobs->scene, jobs->contexts[job], paths);
+      for (int k = 0; k < n; k++) {
+        RNScalar r = source2pointDistance(points[k], source);
+        values[k] += exp(-paths[k]) / (r * r);
+      }
+    }
+    for (int k = 0; k < n; k++)
+      jobs->values[i + k] = values[k];
+  }
+}
 
-    return opticalPath(ray, scene, source.Position(), in, 0);
+// sets values to the field of the sources at n grid points (ix * grid_ny + iy)
+static void EvaluateField(R3Scene *scene, int nsources, Radiator **sources,
+  int n, const int *points, RNScalar *values, int generation)
+{
+  FieldJobs jobs;
+  jobs.scene = scene;
+  jobs.nsources = nsources;
+  jobs.sources = sources;
+  jobs.npoints = n;
+  jobs.points = points;
+  jobs.values = values;
+  jobs.generation = generation;
+  int njobs = (n + ADAPTIVE_POINTS_PER_JOB - 1) / ADAPTIVE_POINTS_PER_JOB;
+  jobs.contexts = new R3SceneQueryContext [ njobs + 1 ];  // njobs may be 0
+  RunJobs(njobs, EvaluateFieldChunk, &jobs);
+  AddQueryStatistics(njobs, jobs.contexts);
+  delete [] jobs.contexts;
+}
 
+// returns whether an edge of a wall may cross the cell: its bbox overlaps the
+//   cell without covering it. marks and list are scratch for CollectWalls
+static RNBoolean CellHasWallEdge(const AdaptiveCell &cell, int *marks, int *list, int &stamp)
+{
+  R3Point p00 = getGridPosition(cell.ix0, cell.iy0), p11 = getGridPosition(cell.ix1, cell.iy1);
+  R3Point p10 = getGridPosition(cell.ix1, cell.iy0), p01 = getGridPosition(cell.ix0, cell.iy1);
+  int nlist = walls.CollectWalls(p00, p10, p11, marks, stamp, list, 0);
+  nlist = walls.CollectWalls(p00, p11, p01, marks, stamp, list, nlist);
+  stamp++;
+  for (int k = 0; k < nlist; k++) {
+    if ((walls.Type(list[k]) == WALLSET_SHEET) || (walls.Type(list[k]) == WALLSET_REMOVED)) continue;
+    const R2Box &bbox = walls.BBox(list[k]);
+    if ((bbox.XMax() < p00.X()) || (bbox.XMin() > p11.X()) || (bbox.YMax() < p00.Y()) || (bbox.YMin() > p11.Y()))
+      continue;
+    if ((bbox.XMin() <= p00.X()) && (bbox.XMax() >= p11.X()) && (bbox.YMin() <= p00.Y()) && (bbox.YMax() >= p11.Y()))
+      continue;
+    return TRUE;
+  }
+  return FALSE;
 }
 
-static RNScalar strength(R3Point point, Radiator &source, R3Scene *scene)
+// fills the points of a cell that have no value yet from its corners, and
+//   marks them known unless they are only a preview until the cell is split
+static void InterpolateCell(const AdaptiveCell &cell, RNScalar *field, char *known, RNBoolean final)
 {
-  RNScalar r = source2pointDistance(point, source);
-  return exp(-opticalPath(point, source, scene)) / (r * r);
+  RNScalar f00 = field[cell.ix0 * grid_ny + cell.iy0], f01 = field[cell.ix0 * grid_ny + cell.iy1];
+  RNScalar f10 = field[cell.ix1 * grid_ny + cell.iy0], f11 = field[cell.ix1 * grid_ny + cell.iy1];
+  for (int ix = cell.ix0; ix <= cell.ix1; ix++) {
+    RNScalar u = (cell.ix1 > cell.ix0) ? (RNScalar) (ix - cell.ix0) / (cell.ix1 - cell.ix0) : 0;
+    for (int iy = cell.iy0; iy <= cell.iy1; iy++) {
+      int index = ix * grid_ny + iy;
+      if (known[index]) continue;
+      RNScalar v = (cell.iy1 > cell.iy0) ? (RNScalar) (iy - cell.iy0) / (cell.iy1 - cell.iy0) : 0;
+      field[index] = (1 - u) * ((1 - v) * f00 + v * f01) + u * ((1 - v) * f10 + v * f11);
+      if (final) known[index] = 1;
+    }
+  }
 }
 
+// computes the field of the sources at every grid point (ix * grid_ny + iy),
+//   refining adaptively from cells step points wide. If preview is given, it
+//   is called after each level with the field so far, points still to be
+//   refined interpolated. Returns the number of points evaluated, or -1 if
+//   the background update of the given generation was cancelled
+static int AdaptiveField(R3Scene *scene, int nsources, Radiator **sources,
+  RNScalar tolerance, int step, RNScalar *field, int generation,
+  void (*preview)(const RNScalar *field, int generation))
+{
+  RNScopedTimer timer("Strength pass");
+  int npoints = grid_nx * grid_ny;
+  char *evaluated = new char [2 * npoints];
+  char *known = evaluated + npoints;
+  int *points = new int [npoints];
+  RNScalar *values = new RNScalar [npoints];
+  int *marks = new int [2 * walls.NWalls() + 1];
+  int *list = marks + walls.NWalls();
+  int stamp = 1;
+  for (int i = 0; i < npoints; i++)
+    evaluated[i] = known[i] = 0;
+  for (int wall = 0; wall < walls.NWalls(); wall++)
+    marks[wall] = 0;
+
+  // coarse cells; cells on the upper edges may be narrower. Cells of a level
+  //   and the children they split into are kept by value in two arrays,
+  //   swapped after each level, and grown only when a level needs more room
+  int nallocated = ((grid_nx + step - 1) / step) * ((grid_ny + step - 1) / step);
+  AdaptiveCell *cells = (AdaptiveCell *) malloc(nallocated * sizeof(AdaptiveCell));
+  AdaptiveCell *children = (AdaptiveCell *) malloc(nallocated * sizeof(AdaptiveCell));
+  int ncells = 0;
+  for (int ix = 0; ix < grid_nx; ix += step) {
+    for (int iy = 0; iy < grid_ny; iy += step) {
+      AdaptiveCell& cell = cells[ncells++];
+      cell.ix0 = ix;
+      cell.iy0 = iy;
+      cell.ix1 = (ix + step < grid_nx) ? ix + step : grid_nx - 1;
+      cell.iy1 = (iy + step < grid_ny) ? iy + step : grid_ny - 1;
+    }
+  }
+
+  int nevaluated = 0;
+  while (ncells > 0) {
+    // evaluate corners not evaluated yet, in cell order so packets stay coherent
+    int n = 0;
+    for (int i = 0; i < ncells; i++) {
+      const AdaptiveCell& cell = cells[i];
+      int corners[4] = {
+        cell.ix0 * grid_ny + cell.iy0, cell.ix0 * grid_ny + cell.iy1,
+        cell.ix1 * grid_ny + cell.iy0, cell.ix1 * grid_ny + cell.iy1 };
+      for (int k = 0; k < 4; k++) {
+        if (evaluated[corners[k]]) continue;
+        evaluated[corners[k]] = known[corners[k]] = 1;
+        points[n++] = corners[k];
+      }
+    }
+    EvaluateField(scene, nsources, sources, n, points, values, generation);
+    for (int i = 0; i < n; i++)
+      field[points[i]] = values[i];
+    nevaluated += n;
+
+    // split cells that need it, and fill in the others
+    int nchildren = 0;
+    for (int i = 0; i < ncells; i++) {
+      AdaptiveCell cell = cells[i];  // a copy, since growing moves the arrays
+      RNBoolean split = FALSE;
+      if ((cell.ix1 - cell.ix0 > 1) || (cell.iy1 - cell.iy0 > 1)) {
+        RNScalar f[4] = {
+          field[cell.ix0 * grid_ny + cell.iy0], field[cell.ix0 * grid_ny + cell.iy1],
+          field[cell.ix1 * grid_ny + cell.iy0], field[cell.ix1 * grid_ny + cell.iy1] };
+        RNScalar lo = f[0], hi = f[0];
+        for (int k = 1; k < 4; k++) {
+          if (f[k] < lo) lo = f[k];
+          if (f[k] > hi) hi = f[k];
+        }
+        split = (hi - lo > tolerance * hi) || CellHasWallEdge(cell, marks, list, stamp);
+      }
+      if (split) {
+        // halve each side longer than one grid step
+        int xs[3] = { cell.ix0, (cell.ix0 + cell.ix1) / 2, cell.ix1 };
+        int ys[3] = { cell.iy0, (cell.iy0 + cell.iy1) / 2, cell.iy1 };
+        int nx = (cell.ix1 - cell.ix0 > 1) ? 2 : 1;
+        int ny = (cell.iy1 - cell.iy0 > 1) ? 2 : 1;
+        if (nx == 1) xs[1] = cell.ix1;
+        if (ny == 1) ys[1] = cell.iy1;
+        if (nchildren + 4 > nallocated) {
+          nallocated *= 2;
+          children = (AdaptiveCell *) realloc(children, nallocated * sizeof(AdaptiveCell));
+          cells = (AdaptiveCell *) realloc(cells, nallocated * sizeof(AdaptiveCell));
+        }
+        for (int a = 0; a < nx; a++) {
+          for (int b = 0; b < ny; b++) {
+            AdaptiveCell& child = children[nchildren++];
+            child.ix0 = xs[a];
+            child.ix1 = xs[a + 1];
+            child.iy0 = ys[b];
+            child.iy1 = ys[b + 1];
+          }
+        }
+        if (preview) InterpolateCell(cell, field, known, FALSE);
+      }
+      else {
+        InterpolateCell(cell, field, known, TRUE);
+      }
+    }
+    AdaptiveCell *swap = cells;
+    cells = children;
+    children = swap;
+    ncells = nchildren;
+
+    // stop if a newer update was requested, or show this level
+    if (UpdateCancelled(generation)) {
+      nevaluated = -1;
+      break;
+    }
+    if (preview) (*preview)(field, generation);
+  }
+
+  free(cells);
+  free(children);
+  delete [] evaluated;
+  delete [] points;
+  delete [] values;
+  delete [] marks;
+  return nevaluated;
+}
 
-// adds radiator strength from source to the strength grid
+// computes the field of the sources at every grid point (ix * grid_ny + iy),
+//   each traced. Returns the number of points evaluated, or -1 if the
+//   background update of the given generation was cancelled
+static int ExactField(R3Scene *scene, int nsources, Radiator **sources,
+  RNScalar *field, int generation)
+{
+  RNScopedTimer timer("Strength pass");
+  int npoints = grid_nx * grid_ny;
+  int *points = new int [npoints];
+  for (int i = 0; i < npoints; i++)
+    points[i] = i;
+  EvaluateField(scene, nsources, sources, npoints, points, field, generation);
+  delete [] points;
+  return (UpdateCancelled(generation)) ? -1 : npoints;
+}
 
-static void SubtractStrength(Radiator &source, R3Scene *scene)
+// sets the grid to the field of all sources, evaluated adaptively
+static void AdaptiveStrength(R3Scene *scene)
 {
-  for (int i = 0; i < grid_nx; i++)
-    for (int j = 0; j < grid_ny; j++)
-      incGridValue(-strength(getGridPosition(i,j), source, scene),i,j);
+  scene->PrepareQueries();
+  int nsources = scene->NRadSources();
+  Radiator **sources = new Radiator * [nsources + 1];
+  for (int s = 0; s < nsources; s++)
+    sources[s] = scene->RadSource(s);
+  RNScalar *field = new RNScalar [grid_nx * grid_ny];
+  adaptive_evaluations = AdaptiveField(scene, nsources, sources, adaptive_tolerance, ADAPTIVE_STEP, field, -1, NULL);
+  for (int ix = 0; ix < grid_nx; ix++)
+    for (int iy = 0; iy < grid_ny; iy++)
+      setGridValue(field[ix * grid_ny + iy], ix, iy);
+  delete [] sources;
+  delete [] field;
 }
 
-static void UpdateStrength(Radiator &source, R3Scene *scene)
+// Background updates (interactive mode): moving a source only records the new
+//   positions and wakes a worker thread, so the viewer keeps responding. The
+//   field of each source is kept, with the position it was computed for, and
+//   the worker recomputes only the sources that moved, on top of the fields
+//   of the others, into a back buffer; the idle callback swaps it in for
+//   drawing. Each source is traced at every grid point, or with -adaptive
+//   coarse to fine from PROGRESSIVE_STEP apart, handing over each finished
+//   level. A newer move cancels the update in progress after the chunk or
+//   level it is on, keeping the last field finished for the source.
+//   Kept fields take grid_nx * grid_ny values per source
+#define PROGRESSIVE_STEP 8
+static int keep_source_fields = 0;          // set before initGrid to fill the fields below
+static RNScalar **source_fields = NULL;     // unit field of each source (ix * grid_ny + iy)
+static R3Point *source_field_positions = NULL;  // position each field was computed for
+static RNScalar *total_field = NULL;        // sum of source_fields
+static int update_request = 0;              // generation of the latest request
+static RNBoolean update_stop = FALSE;
+static R3Point *update_positions = NULL;    // source positions of the latest request
+static double *ready_grid = NULL;           // latest finished level, for the idle callback
+static RNBoolean update_ready = FALSE;
+static RNBoolean update_done = TRUE;        // the latest request is finished
+static RNBoolean background_updates = FALSE;  // the worker is running
+static double *back_grid = NULL;            // worker only
+static RNScalar *update_base = NULL;        // worker only: fields of the sources not being recomputed
+#if (RN_OS != RN_WINDOWS)
+static pthread_t update_thread;
+static pthread_mutex_t update_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t update_condition = PTHREAD_COND_INITIALIZER;
+#endif
+
+// returns whether a newer background update was requested (-1 is not one)
+static RNBoolean UpdateCancelled(int generation)
+{
+  if (generation < 0) return FALSE;
+#if (RN_OS != RN_WINDOWS)
+  pthread_mutex_lock(&update_mutex);
+  RNBoolean cancelled = (generation != update_request);
+  pthread_mutex_unlock(&update_mutex);
+  return cancelled;
+#else
+  return FALSE;
+#endif
+}
+
+#if (RN_OS != RN_WINDOWS)
+
+// fills the back buffer with a level of the field plus update_base, if any,
+//   and swaps it with the buffer waiting for the idle callback unless the
+//   update was cancelled
+static void PublishField(const RNScalar *field, int generation)
+{
+  for (int ix = 0; ix < grid_nx; ix++) {
+    for (int iy = 0; iy < grid_ny; iy++) {
+      int i = ix * grid_ny + iy;
+      RNScalar value = (update_base) ? update_base[i] + field[i] : field[i];
+      back_grid[grid_layout.Index(ix, iy)] = value * grid_scale;
+    }
+  }
+  pthread_mutex_lock(&update_mutex);
+  if (generation == update_request) {
+    double *swap = ready_grid;
+    ready_grid = back_grid;
+    back_grid = swap;
+    update_ready = TRUE;
+  }
+  pthread_mutex_unlock(&update_mutex);
+}
+
+static void *UpdateFieldThread(void *)
+{
+  int nsources = scene->NRadSources();
+  int npoints = grid_nx * grid_ny;
+  R3Point *positions = new R3Point [nsources + 1];
+  RNScalar *field = new RNScalar [npoints];
+  RNScalar *base = new RNScalar [npoints];
+
+  int generation = 0;
+  pthread_mutex_lock(&update_mutex);
+  while (TRUE) {
+    while (!update_stop && (update_request == generation))
+      pthread_cond_wait(&update_condition, &update_mutex);
+    if (update_stop) break;
+    generation = update_request;
+    for (int s = 0; s < nsources; s++)
+      positions[s] = update_positions[s];
+    pthread_mutex_unlock(&update_mutex);
+
+    // recompute the sources that moved, one after another (until a source is
+    //   done, the others still moved are drawn where they were)
+    RNBoolean cancelled = FALSE;
+    for (int s = 0; s < nsources; s++) {
+      if (positions[s] == source_field_positions[s]) continue;
+      for (int i = 0; i < npoints; i++)
+        base[i] = total_field[i] - source_fields[s][i];
+      update_base = base;
+      Radiator source(positions[s], 1.0);
+      Radiator *sources[1] = { &source };
+      int nevaluated = (adaptive_tolerance >= 0) ?
+        AdaptiveField(scene, 1, sources, adaptive_tolerance, PROGRESSIVE_STEP, field, generation, PublishField) :
+        ExactField(scene, 1, sources, field, generation);
+      if (nevaluated < 0) {
+        cancelled = TRUE;
+        break;
+      }
+      RNScalar *swap = source_fields[s];
+      source_fields[s] = field;
+      field = swap;
+      source_field_positions[s] = positions[s];
+      for (int i = 0; i < npoints; i++)
+        total_field[i] = base[i] + source_fields[s][i];
+    }
+
+    // show the whole field, also when no source had to be recomputed
+    update_base = NULL;
+    if (!cancelled) PublishField(total_field, generation);
+
+    pthread_mutex_lock(&update_mutex);
+    if (!cancelled && (generation == update_request)) update_done = TRUE;
+  }
+  pthread_mutex_unlock(&update_mutex);
+
+  delete [] positions;
+  delete [] field;
+  delete [] base;
+  return NULL;
+}
+
+#endif
+
+// starts the worker for background updates, after initGrid has filled the
+//   fields of the sources; returns whether it is running
+static RNBoolean StartFieldUpdates(R3Scene *scene)
 {
-  for (int i = 0; i < grid_nx; i++)
-    for (int j = 0; j < grid_ny; j++)
-      incGridValue(strength(getGridPosition(i,j), source, scene),i,j);
+#if (RN_OS != RN_WINDOWS)
+  if (!source_fields) return FALSE;
+  update_positions = new R3Point [scene->NRadSources() + 1];
+  ready_grid = new double [grid_layout.NEntries()];
+  back_grid = new double [grid_layout.NEntries()];
+  for (int i = 0; i < grid_layout.NEntries(); i++)
+    ready_grid[i] = back_grid[i] = 0;
+  if (pthread_create(&update_thread, NULL, UpdateFieldThread, NULL) != 0) {
+    RNWarning("Unable to create thread for field updates\n");
+    return FALSE;
+  }
+  background_updates = TRUE;
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+// cancels any update in progress and waits for the worker to finish
+static void StopFieldUpdates(void)
+{
+#if (RN_OS != RN_WINDOWS)
+  if (!background_updates) return;
+  pthread_mutex_lock(&update_mutex);
+  update_stop = TRUE;
+  update_request++;
+  pthread_cond_signal(&update_condition);
+  pthread_mutex_unlock(&update_mutex);
+  pthread_join(update_thread, NULL);
+  background_updates = FALSE;
+#endif
+}
+
+// asks the worker to recompute the field for the current source positions
+static RNBoolean RequestFieldUpdate(R3Scene *scene)
+{
+#if (RN_OS != RN_WINDOWS)
+  if (!background_updates) return FALSE;
+  pthread_mutex_lock(&update_mutex);
+  for (int s = 0; s < scene->NRadSources(); s++)
+    update_positions[s] = scene->RadSource(s)->Position();
+  update_request++;
+  update_ready = FALSE;
+  update_done = FALSE;
+  pthread_cond_signal(&update_condition);
+  pthread_mutex_unlock(&update_mutex);
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+// swaps in the latest finished level, if any, for drawing; returns whether
+//   more are still to come
+static RNBoolean ReceiveFieldUpdate(RNBoolean *received)
+{
+  *received = FALSE;
+#if (RN_OS != RN_WINDOWS)
+  pthread_mutex_lock(&update_mutex);
+  if (update_ready) {
+    double *swap = grid;
+    grid = ready_grid;
+    ready_grid = swap;
+    update_ready = FALSE;
+    *received = TRUE;
+  }
+  RNBoolean pending = !update_done || update_ready;
+  pthread_mutex_unlock(&update_mutex);
+  return pending;
+#else
+  return FALSE;
+#endif
+}
+
+// Lazy evaluation (-lazy, viewer only) computes grid points only when they are
+//   drawn: tiles of LAZY_TILE_SIZE points inside the camera's view frustum,
+//   at a power-of-two stride that keeps drawn points about LAZY_PIXEL_SPACING
+//   pixels apart. Each tile remembers the finest stride it was evaluated at,
+//   so panning back or zooming out costs nothing, and zooming in evaluates
+//   only the points in between. The grid scale is set from the corner point
+//   of every tile, evaluated at the start
+#define LAZY_TILE_SIZE 16
+#define LAZY_PIXEL_SPACING 4
+static int lazy_evaluation = 0;
+static int lazy_ntx = 0;
+static int lazy_nty = 0;
+static int *lazy_tile_stride = NULL;  // finest stride evaluated, 0 if none, at tx * lazy_nty + ty
+static int *lazy_draw_stride = NULL;  // stride drawn in the current view, 0 if out of view
+
+// appends to points those a tile needs at the given stride and was not
+//   evaluated at yet, and records the stride as evaluated
+static int CollectLazyPoints(int tile, int stride, int *points, int n)
+{
+  int old_stride = lazy_tile_stride[tile];
+  int ix0 = (tile / lazy_nty) * LAZY_TILE_SIZE, iy0 = (tile % lazy_nty) * LAZY_TILE_SIZE;
+  for (int i = 0; (i < LAZY_TILE_SIZE) && (ix0 + i < grid_nx); i += stride) {
+    for (int j = 0; (j < LAZY_TILE_SIZE) && (iy0 + j < grid_ny); j += stride) {
+      if (old_stride && (i % old_stride == 0) && (j % old_stride == 0)) continue;
+      points[n++] = (ix0 + i) * grid_ny + iy0 + j;
+    }
+  }
+  lazy_tile_stride[tile] = stride;
+  return n;
+}
+
+// traces the points listed and stores them in the grid
+static void EvaluateLazyPoints(R3Scene *scene, int n, const int *points)
+{
+  RNScopedTimer timer("Strength pass");
+  int nsources = scene->NRadSources();
+  Radiator **sources = new Radiator * [nsources + 1];
+  for (int s = 0; s < nsources; s++)
+    sources[s] = scene->RadSource(s);
+  RNScalar *values = new RNScalar [n + 1];
+  EvaluateField(scene, nsources, sources, n, points, values, -1);
+  for (int i = 0; i < n; i++)
+    setGridValue(values[i], points[i] / grid_ny, points[i] % grid_ny);
+  delete [] sources;
+  delete [] values;
+}
+
+// forgets every evaluated tile, after sources moved
+static void InvalidateLazyTiles(void)
+{
+  for (int tile = 0; tile < lazy_ntx * lazy_nty; tile++)
+    lazy_tile_stride[tile] = 0;
+}
+
+// evaluates the corner point of every tile and sets the grid scale from them
+static void InitLazyGrid(R3Scene *scene)
+{
+  scene->PrepareQueries();
+  lazy_ntx = (grid_nx + LAZY_TILE_SIZE - 1) / LAZY_TILE_SIZE;
+  lazy_nty = (grid_ny + LAZY_TILE_SIZE - 1) / LAZY_TILE_SIZE;
+  int ntiles = lazy_ntx * lazy_nty;
+  lazy_tile_stride = new int [ntiles];
+  lazy_draw_stride = new int [ntiles];
+  InvalidateLazyTiles();
+  int *points = new int [ntiles];
+  int n = 0;
+  for (int tile = 0; tile < ntiles; tile++) {
+    lazy_draw_stride[tile] = 0;
+    n = CollectLazyPoints(tile, LAZY_TILE_SIZE, points, n);
+  }
+  grid_scale = 1.0;
+  EvaluateLazyPoints(scene, n, points);
+  double sum = 0;
+  for (int i = 0; i < n; i++)
+    sum += getGridValue(points[i] / grid_ny, points[i] % grid_ny);
+  sum /= 2 * n;
+  for (int i = 0; i < n; i++)
+    grid[grid_layout.Index(points[i] / grid_ny, points[i] % grid_ny)] /= sum;
+  grid_scale /= sum;
+  delete [] points;
+}
+
+// sets the stride each tile is drawn at in the viewer's current view, and
+//   evaluates the points visible tiles are missing
+static void UpdateLazyTiles(R3Scene *scene, const R3Viewer *viewer)
+{
+  R3Frustum frustum(viewer->Camera());
+  double radius = grid_point_radius * scene->BBox().DiagonalRadius();
+  int ntiles = lazy_ntx * lazy_nty;
+  int npoints = 0;
+  for (int tile = 0; tile < ntiles; tile++) {
+    int ix0 = (tile / lazy_nty) * LAZY_TILE_SIZE, iy0 = (tile % lazy_nty) * LAZY_TILE_SIZE;
+    int ix1 = (ix0 + LAZY_TILE_SIZE < grid_nx) ? ix0 + LAZY_TILE_SIZE - 1 : grid_nx - 1;
+    int iy1 = (iy0 + LAZY_TILE_SIZE < grid_ny) ? iy0 + LAZY_TILE_SIZE - 1 : grid_ny - 1;
+    R3Point p0 = getGridPosition(ix0, iy0), p1 = getGridPosition(ix1, iy1);
+    R3Box bbox(p0.X() - radius, p0.Y() - radius, -radius, p1.X() + radius, p1.Y() + radius, radius);
+    lazy_draw_stride[tile] = 0;
+    if (!frustum.Intersects(bbox)) continue;
+
+    // pixels between neighbouring grid points at the middle of the tile
+    //   (the coarsest stride if it is behind the camera)
+    int stride = LAZY_TILE_SIZE;
+    R3Point center = getGridPosition((ix0 + ix1) / 2, (iy0 + iy1) / 2);
+    R2Point c = viewer->ViewportPoint(center);
+    R2Point cx = viewer->ViewportPoint(center + R3Vector(grid_dx, 0, 0));
+    R2Point cy = viewer->ViewportPoint(center + R3Vector(0, grid_dy, 0));
+    if ((c != R2infinite_point) && (cx != R2infinite_point) && (cy != R2infinite_point)) {
+      RNLength spacing = R2Distance(c, cx);
+      if (R2Distance(c, cy) > spacing) spacing = R2Distance(c, cy);
+      stride = 1;
+      while ((stride < LAZY_TILE_SIZE) && (stride * spacing < LAZY_PIXEL_SPACING)) stride *= 2;
+    }
+    lazy_draw_stride[tile] = stride;
+    if (!lazy_tile_stride[tile] || (stride < lazy_tile_stride[tile]))
+      npoints += LAZY_TILE_SIZE * LAZY_TILE_SIZE / (stride * stride);
+  }
+  if (npoints == 0) return;
+
+  // evaluate the missing points of all visible tiles together
+  int *points = new int [npoints];
+  int n = 0;
+  for (int tile = 0; tile < ntiles; tile++) {
+    int stride = lazy_draw_stride[tile];
+    if (!stride) continue;
+    if (lazy_tile_stride[tile] && (stride >= lazy_tile_stride[tile])) continue;
+    n = CollectLazyPoints(tile, stride, points, n);
+  }
+  EvaluateLazyPoints(scene, n, points);
+  delete [] points;
+}
+
+// returns whether moves update the grid in the background (which needs the
+//   fields of all sources kept), rather than before the move returns
+static RNBoolean UsesFieldUpdates(void)
+{
+#if (RN_OS != RN_WINDOWS)
+  return !lazy_evaluation;
+#else
+  return FALSE;
+#endif
+}
+
+// sets field to the unit field of one source at every grid point (ix * grid_ny + iy)
+static void SourceField(Radiator &source, R3Scene *scene, RNScalar *field)
+{
+  if (adaptive_tolerance >= 0) {
+    Radiator *sources[1] = { &source };
+    adaptive_evaluations += AdaptiveField(scene, 1, sources, adaptive_tolerance, ADAPTIVE_STEP, field, -1, NULL);
+  }
+  else if (cache_directory) {
+    CachedSourceField(source, scene, field);
+  }
+  else {
+    TraceSourceField(source, scene, field);
+  }
+}
+
+// computes and keeps the field of each source, for background updates, and
+//   sets the grid to their sum
+static void InitSourceFields(R3Scene *scene)
+{
+  scene->PrepareQueries();
+  int nsources = scene->NRadSources();
+  int npoints = grid_nx * grid_ny;
+  source_fields = new RNScalar * [nsources + 1];
+  source_field_positions = new R3Point [nsources + 1];
+  total_field = new RNScalar [npoints];
+  for (int i = 0; i < npoints; i++)
+    total_field[i] = 0;
+  for (int s = 0; s < nsources; s++) {
+    Radiator &source = *(scene->RadSource(s));
+    source_fields[s] = new RNScalar [npoints];
+    source_field_positions[s] = source.Position();
+    SourceField(source, scene, source_fields[s]);
+    for (int i = 0; i < npoints; i++)
+      total_field[i] += source_fields[s][i];
+  }
+  for (int ix = 0; ix < grid_nx; ix++)
+    for (int iy = 0; iy < grid_ny; iy++)
+      setGridValue(total_field[ix * grid_ny + iy], ix, iy);
 }
 
 // initializes grid with source strengths
 
 static void initGridValues(R3Scene *scene)
 {
-  for (int i = 0; i < grid_nx * grid_ny; i++)
+  for (int i = 0; i < grid_layout.NEntries(); i++)
     grid[i] = 0;
-  for (int i = 0; i < scene->NRadSources(); i++)
+  if (lazy_evaluation) {
+    InitLazyGrid(scene);
+    return;
+  }
+  if (cache_directory) UpdateFieldCacheKey(scene);
+  if (keep_source_fields)
+    InitSourceFields(scene);
+  else if (adaptive_tolerance >= 0)
+    AdaptiveStrength(scene);
+  else
   {
-    Radiator &source = *(scene->RadSource(i));
-    UpdateStrength(source, scene);
+    for (int i = 0; i < scene->NRadSources(); i++)
+    {
+      Radiator &source = *(scene->RadSource(i));
+      if (cache_directory) AccumulateCachedStrength(source, scene, 1);
+      else UpdateStrength(source, scene);
+    }
   }
   NormalizeGridScale();
 }
 
-// 
+// moves a source and updates the grid for it: in the background, where only
+//   its field is recomputed, or else before returning. Without background
+//   updates the adaptive grid is refined for the field of all sources, so it
+//   is evaluated again as a whole
 static void MoveRadiator(Radiator *source, R3Vector displacement, R3Scene *scene)
 {
+  if (background_updates)
+  {
+    source->Move(displacement);
+    RequestFieldUpdate(scene);
+    return;
+  }
+  if (lazy_evaluation)
+  {
+    source->Move(displacement);
+    InvalidateLazyTiles();
+    return;
+  }
+  if (adaptive_tolerance >= 0)
+  {
+    source->Move(displacement);
+    AdaptiveStrength(scene);
+    return;
+  }
+  if (cache_directory)
+  {
+    AccumulateCachedStrength(*source, scene, -1);
+    source->Move(displacement);
+    AccumulateCachedStrength(*source, scene, 1);
+    return;
+  }
   SubtractStrength(*source, scene);
   source->Move(displacement);
   UpdateStrength(*source, scene);
 }
 
+////////////////////////////////////////////////////////////////////////
+// Traces
+////////////////////////////////////////////////////////////////////////
+
+// A trace (-record <file> in the viewer) lists the moves made in a session,
+//   one per line, so that -replay <file> can play them back without a window
+//   and time how long the grid takes to catch up after each:
+//     window <width> <height>
+//     move <source> <dx> <dy> <dz>
+//     camera <origin> <towards> <up>
+static FILE *record_fp = NULL;
+
+// counts allocations made through operator new, on every thread, while
+//   count_allocations is set, which ReplayTrace does only around the events
+//   it times; other allocations pay one test of the flag (not inlined, so
+//   the compiler does not pair the malloc and free inside them with the new
+//   and delete at call sites)
+static volatile RNBoolean count_allocations = FALSE;
+static long long num_allocations = 0;
+#if defined(__GNUC__)
+__attribute__((noinline)) void *operator new(size_t size)
+{
+  if (count_allocations) __sync_fetch_and_add(&num_allocations, 1);
+  void *data = malloc((size > 0) ? size : 1);
+  if (!data) throw std::bad_alloc();
+  return data;
+}
+
+__attribute__((noinline)) void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void *data) throw()
+{
+  free(data);
+}
+
+__attribute__((noinline)) void operator delete[](void *data) throw()
+{
+  free(data);
+}
+#endif
+
+static void RecordWindow(int width, int height)
+{
+  if (!record_fp) return;
+  fprintf(record_fp, "window %d %d\n", width, height);
+}
+
+static void RecordSourceMove(int source, const R3Vector& displacement)
+{
+  if (!record_fp) return;
+  fprintf(record_fp, "move %d %.17g %.17g %.17g\n", source, displacement.X(), displacement.Y(), displacement.Z());
+}
+
+// records the viewer's camera if it changed since it was last recorded
+static void RecordCamera(void)
+{
+  static R3Point origin(RN_INFINITY, RN_INFINITY, RN_INFINITY);
+  static R3Vector towards(0, 0, 0), up(0, 0, 0);
+  if (!record_fp) return;
+  const R3Camera& camera = viewer->Camera();
+  if ((camera.Origin() == origin) && (camera.Towards() == towards) && (camera.Up() == up)) return;
+  origin = camera.Origin();
+  towards = camera.Towards();
+  up = camera.Up();
+  fprintf(record_fp, "camera %.17g %.17g %.17g  %.17g %.17g %.17g  %.17g %.17g %.17g\n",
+    origin.X(), origin.Y(), origin.Z(), towards.X(), towards.Y(), towards.Z(), up.X(), up.Y(), up.Z());
+}
+
+// returns the value below which the given fraction of the sorted values lie
+static double Percentile(const double *values, int n, double fraction)
+{
+  if (n == 0) return 0;
+  int k = (int) ceil(fraction * n) - 1;
+  if (k < 0) k = 0;
+  if (k >= n) k = n - 1;
+  return values[k];
+}
+
+static int CompareSeconds(const void *data1, const void *data2)
+{
+  double seconds1 = *((const double *) data1);
+  double seconds2 = *((const double *) data2);
+  if (seconds1 < seconds2) return -1;
+  else if (seconds1 > seconds2) return 1;
+  else return 0;
+}
+
+// prints percentiles of the seconds events took, sorting them
+static void PrintLatencies(const char *name, double *seconds, int n)
+{
+  if (n == 0) return;
+  qsort(seconds, n, sizeof(double), CompareSeconds);
+  printf("  %s = %.2f ms p50, %.2f ms p95, %.2f ms p99, %.2f ms max\n", name,
+    1000 * Percentile(seconds, n, 0.5), 1000 * Percentile(seconds, n, 0.95),
+    1000 * Percentile(seconds, n, 0.99), 1000 * seconds[n - 1]);
+}
+
+// an event played back from a trace, with its cost
+struct ReplayEvent {
+  int camera;             // camera move, or source move
+  double seconds;         // until the grid caught up
+  double first_seconds;   // until the first level of a background update, or -1
+  long long allocations;
+};
+
+// plays back the moves of a trace, one after another: each is timed until
+//   the grid has caught up with it, including the background update or the
+//   lazy tiles it causes, and until the first level of a background update
+static int ReplayTrace(const char *filename, R3Scene *scene)
+{
+  FILE *fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "Unable to open trace file %s\n", filename);
+    return 0;
+  }
+
+  int nevents = 0, nallocated = 64;
+  ReplayEvent *events = (ReplayEvent *) malloc(nallocated * sizeof(ReplayEvent));
+  char keyword[64];
+  int line_number = 0;
+  RNBoolean error = FALSE;
+  while (!error && (fscanf(fp, "%63s", keyword) == 1)) {
+    line_number++;
+    if (keyword[0] == '#') {
+      int c;
+      while (((c = fgetc(fp)) != EOF) && (c != '\n'));
+      continue;
+    }
+    if (nevents == nallocated) {
+      nallocated *= 2;
+      events = (ReplayEvent *) realloc(events, nallocated * sizeof(ReplayEvent));
+    }
+    ReplayEvent& event = events[nevents];
+    event.first_seconds = -1;
+
+    if (!strcmp(keyword, "window")) {
+      int width, height;
+      if (fscanf(fp, "%d%d", &width, &height) != 2) { error = TRUE; break; }
+      viewer->ResizeViewport(0, 0, width, height);
+      scene->SetViewport(viewer->Viewport());
+    }
+    else if (!strcmp(keyword, "move")) {
+      int source;
+      double dx, dy, dz;
+      if ((fscanf(fp, "%d%lf%lf%lf", &source, &dx, &dy, &dz) != 4) ||
+          (source < 0) || (source >= scene->NRadSources())) { error = TRUE; break; }
+      long long allocations = num_allocations;
+      count_allocations = TRUE;
+      RNTime event_time;
+      event_time.Read();
+      MoveRadiator(scene->RadSource(source), R3Vector(dx, dy, dz), scene);
+      if (background_updates) {
+        RNBoolean received, pending;
+        do {
+          pending = ReceiveFieldUpdate(&received);
+          if (received && (event.first_seconds < 0)) event.first_seconds = event_time.Elapsed();
+          if (pending && !received) RNSleep(0.0002);
+        } while (pending);
+      }
+      else if (lazy_evaluation) {
+        UpdateLazyTiles(scene, viewer);
+      }
+      event.camera = FALSE;
+      event.seconds = event_time.Elapsed();
+      count_allocations = FALSE;
+      event.allocations = num_allocations - allocations;
+      nevents++;
+    }
+    else if (!strcmp(keyword, "camera")) {
+      double v[9];
+      for (int k = 0; k < 9; k++)
+        if (fscanf(fp, "%lf", &v[k]) != 1) error = TRUE;
+      if (error) break;
+      long long allocations = num_allocations;
+      count_allocations = TRUE;
+      RNTime event_time;
+      event_time.Read();
+      R3Camera camera = viewer->Camera();
+      camera.Reposition(R3Point(v[0], v[1], v[2]));
+      camera.Reorient(R3Vector(v[3], v[4], v[5]), R3Vector(v[6], v[7], v[8]));
+      viewer->SetCamera(camera);
+      if (lazy_evaluation) UpdateLazyTiles(scene, viewer);
+      event.camera = TRUE;
+      event.seconds = event_time.Elapsed();
+      count_allocations = FALSE;
+      event.allocations = num_allocations - allocations;
+      nevents++;
+    }
+    else {
+      error = TRUE;
+    }
+  }
+  fclose(fp);
+  if (error) {
+    fprintf(stderr, "Invalid %s in trace %s, entry %d\n", keyword, filename, line_number);
+    free(events);
+    return 0;
+  }
+
+  // print latencies of each kind of event, and allocations
+  double *seconds = new double [3 * nevents + 1];
+  double *move_seconds = seconds, *first_seconds = seconds + nevents, *camera_seconds = seconds + 2 * nevents;
+  int nmoves = 0, nfirst = 0, ncameras = 0;
+  long long total_allocations = 0, max_allocations = 0;
+  for (int i = 0; i < nevents; i++) {
+    if (events[i].camera) camera_seconds[ncameras++] = events[i].seconds;
+    else move_seconds[nmoves++] = events[i].seconds;
+    if (events[i].first_seconds >= 0) first_seconds[nfirst++] = events[i].first_seconds;
+    total_allocations += events[i].allocations;
+    if (events[i].allocations > max_allocations) max_allocations = events[i].allocations;
+  }
+  printf("Replayed %s: %d source moves, %d camera moves\n", filename, nmoves, ncameras);
+  PrintLatencies("Source moves", move_seconds, nmoves);
+  PrintLatencies("First level", first_seconds, nfirst);
+  if (lazy_evaluation) PrintLatencies("Camera moves", camera_seconds, ncameras);
+#if defined(__GNUC__)
+  if (nevents > 0)
+    printf("  Allocations = %.1f per event, %lld max\n", (double) total_allocations / nevents, max_allocations);
+#endif
+  fflush(stdout);
+
+  delete [] seconds;
+  free(events);
+  return 1;
+}
+
+
+
 ////////////////////////////////////////////////////////////////////////
 // Draw functions
 ////////////////////////////////////////////////////////////////////////
@@ -489,6 +1761,19 @@ DrawSphere(R3Scene *scene, R3Point position, RNScalar value)
 /* draws the grid */
 static void DrawGrid(R3Scene *scene)
 {
+  // draw visible tiles only, at their stride
+  if (lazy_evaluation) {
+    UpdateLazyTiles(scene, viewer);
+    for (int tile = 0; tile < lazy_ntx * lazy_nty; tile++) {
+      int stride = lazy_draw_stride[tile];
+      if (!stride) continue;
+      int ix0 = (tile / lazy_nty) * LAZY_TILE_SIZE, iy0 = (tile % lazy_nty) * LAZY_TILE_SIZE;
+      for (int ix = ix0; (ix < ix0 + LAZY_TILE_SIZE) && (ix < grid_nx); ix += stride)
+        for (int iy = iy0; (iy < iy0 + LAZY_TILE_SIZE) && (iy < grid_ny); iy += stride)
+          DrawSphere(scene, getGridPosition(ix, iy), getGridValue(ix, iy));
+    }
+    return;
+  }
 
   for (int ix = 0; ix < grid_nx; ix++)
     for (int iy = 0; iy < grid_ny; iy++)
@@ -497,12 +1782,40 @@ static void DrawGrid(R3Scene *scene)
 
 
 
+/* draws the timers and counters of the profile, top left */
+static void DrawProfile(void)
+{
+  char buffer[256];
+  int y = GLUTwindow_height - 20;
+  for (int k = 0; k < RNNProfileTimers(); k++, y -= 15) {
+    sprintf(buffer, "%s: %.2f ms last, %.1f ms total, %d times", RNProfileTimerName(k),
+      1000 * RNProfileTimerLastSeconds(k), 1000 * RNProfileTimerSeconds(k), RNProfileTimerCount(k));
+    DrawText(R2Point(10, y), buffer);
+  }
+  for (int k = 0; k < RNNProfileCounters(); k++, y -= 15) {
+    const RNProfileCounter *counter = RNKthProfileCounter(k);
+    sprintf(buffer, "%s: %lld", counter->Name(), counter->Count());
+    DrawText(R2Point(10, y), buffer);
+  }
+}
+
+
+
 ////////////////////////////////////////////////////////////////////////
 // Glut user interface functions
 ////////////////////////////////////////////////////////////////////////
 
 void GLUTStop(void)
 {
+  // Stop background updates
+  StopFieldUpdates();
+
+  // Close trace
+  if (record_fp) fclose(record_fp);
+
+  // Write profile
+  if (profile_name) RNWriteProfile(profile_name);
+
   // Destroy window 
   glutDestroyWindow(GLUTwindow);
 
@@ -516,6 +1829,7 @@ void GLUTRedraw(void)
 {
   // Check scene
   if (!scene) return;
+  RNScopedTimer timer("Draw");
 
   // Set viewing transformation
   viewer->Camera().Load();
@@ -600,8 +1914,16 @@ void GLUTRedraw(void)
     }
   }  
 
+  // Draw profile
+  if (show_profile) {
+    glDisable(GL_LIGHTING);
+    glColor3d(1.0, 1.0, 1.0);
+    DrawProfile();
+  }
+
   // Capture screenshot image 
   if (screenshot_image_name) {
+    RNScopedTimer screenshot_timer("Screenshot");
     if (print_verbose) printf("Creating image %s\n", screenshot_image_name);
     R2Image image(GLUTwindow_width, GLUTwindow_height, 3);
     image.Capture();
@@ -615,6 +1937,18 @@ void GLUTRedraw(void)
 
 
 
+void GLUTIdle(void)
+{
+  // Draw the latest level of a background update, until the last arrives
+  RNBoolean received;
+  RNBoolean pending = ReceiveFieldUpdate(&received);
+  if (received) glutPostRedisplay();
+  if (!pending) glutIdleFunc(NULL);
+  else if (!received) RNSleep(0.005);
+}
+
+
+
 void GLUTResize(int w, int h)
 {
   // Resize window
@@ -629,6 +1963,7 @@ void GLUTResize(int w, int h)
   // Remember window size 
   GLUTwindow_width = w;
   GLUTwindow_height = h;
+  RecordWindow(w, h);
 
   // Redraw
   glutPostRedisplay();
@@ -653,6 +1988,7 @@ void GLUTMotion(int x, int y)
   else if (GLUTbutton[1]) viewer->ScaleWorld(1.0, center, x, y, dx, dy);
   else if (GLUTbutton[2]) viewer->TranslateWorld(1.0, center, x, y, dx, dy);
   if (GLUTbutton[0] || GLUTbutton[1] || GLUTbutton[2]) glutPostRedisplay();
+  RecordCamera();
 
   // Remember mouse position 
   GLUTmouse[0] = x;
@@ -782,6 +2118,13 @@ void GLUTKeyboard(unsigned char key, int x, int y)
     show_sources = !show_sources;
     break;
 
+  case 'P':
+  case 'p':
+    // Show the profile, recording it from now on
+    show_profile = !show_profile;
+    if (show_profile && !RNIsProfileEnabled()) RNEnableProfile();
+    break;
+
   case 'R':
   case 'r':
     show_rays = !show_rays;
@@ -811,6 +2154,7 @@ void GLUTKeyboard(unsigned char key, int x, int y)
     }
     else {
       moveVector.SetZ(0.0);
+      RecordSourceMove(current_rad_source, moveVector);
       MoveRadiator(scene->RadSource(current_rad_source), moveVector, scene);
     }
 
@@ -824,6 +2168,7 @@ void GLUTKeyboard(unsigned char key, int x, int y)
     }
     else {
       moveVector.SetZ(0.0);
+      RecordSourceMove(current_rad_source, moveVector);
       MoveRadiator(scene->RadSource(current_rad_source), moveVector, scene);
     }
 
@@ -837,6 +2182,7 @@ void GLUTKeyboard(unsigned char key, int x, int y)
     }
     else {
       moveVector.SetZ(0.0);
+      RecordSourceMove(current_rad_source, moveVector);
       MoveRadiator(scene->RadSource(current_rad_source), moveVector, scene);
     }
 
@@ -850,6 +2196,7 @@ void GLUTKeyboard(unsigned char key, int x, int y)
     }
     else {
       moveVector.SetZ(0.0);
+      RecordSourceMove(current_rad_source, moveVector);
       MoveRadiator(scene->RadSource(current_rad_source), moveVector, scene);
     }
     break; }
@@ -866,6 +2213,12 @@ void GLUTKeyboard(unsigned char key, int x, int y)
   // Remember modifiers 
   GLUTmodifiers = glutGetModifiers();
 
+  // Wait for a background update, if one was requested
+  if (background_updates) glutIdleFunc(GLUTIdle);
+
+  // Record camera, if moved
+  RecordCamera();
+
   // Redraw
   glutPostRedisplay();  
 }
@@ -932,6 +2285,7 @@ static R3Scene *
 ReadScene(char *filename)
 {
   // Start statistics
+  RNScopedTimer timer("Load scene");
   RNTime start_time;
   start_time.Read();
 
@@ -986,6 +2340,21 @@ WriteImage(R2Image *image, const char *filename)
 
 
 
+static int
+WriteGrid(const char *filename)
+{
+  // Copy grid values into an R2Grid mapping grid point (ix, iy) to its world position
+  R2Grid output(grid_nx, grid_ny, GridWorldToGrid(grid_x0, grid_y0, grid_dx, grid_dy));
+  for (int ix = 0; ix < grid_nx; ix++)
+    for (int iy = 0; iy < grid_ny; iy++)
+      output.SetGridValue(ix, iy, getGridValue(ix, iy));
+
+  // Write values or colormap, depending on the extension
+  return WriteGridFile(output, filename, print_verbose);
+}
+
+
+
 ////////////////////////////////////////////////////////////////////////
 // Program argument parsing
 ////////////////////////////////////////////////////////////////////////
@@ -1011,6 +2380,30 @@ ParseArgs(int argc, char **argv)
         argc--; argv++; grid_nx = atoi(*argv); 
         argc--; argv++; grid_ny = atoi(*argv); 
       }
+      else if (!strcmp(*argv, "-threads")) { 
+        argc--; argv++; num_threads = atoi(*argv); 
+      }
+      else if (!strcmp(*argv, "-tiles")) { 
+        grid_layout_type = GRIDLAYOUT_TILES; 
+      }
+      else if (!strcmp(*argv, "-record")) { 
+        argc--; argv++; record_trace_name = *argv; 
+      }
+      else if (!strcmp(*argv, "-replay")) { 
+        argc--; argv++; replay_trace_name = *argv; 
+      }
+      else if (!strcmp(*argv, "-lazy")) { 
+        lazy_evaluation = 1; 
+      }
+      else if (!strcmp(*argv, "-profile")) { 
+        argc--; argv++; profile_name = *argv; 
+      }
+      else if (!strcmp(*argv, "-cache")) { 
+        argc--; argv++; cache_directory = *argv; 
+      }
+      else if (!strcmp(*argv, "-adaptive")) { 
+        argc--; argv++; adaptive_tolerance = atof(*argv); 
+      }
       else { 
         fprintf(stderr, "Invalid program argument: %s", *argv); 
         exit(1); 
@@ -1025,9 +2418,15 @@ ParseArgs(int argc, char **argv)
     }
   }
 
+  // Check options the cache cannot be used with
+  if (cache_directory && (lazy_evaluation || (adaptive_tolerance >= 0))) {
+    fprintf(stderr, "-cache cannot be combined with -lazy or -adaptive\n");
+    return 0;
+  }
+
   // Check scene filename
   if (!input_scene_name) {
-    fprintf(stderr, "Usage: photonmap inputscenefile [outputimagefile] [-resolution <int> <int>] [-v]\n");
+    fprintf(stderr, "Usage: radiationbf inputscenefile [outputfile] [-gdim <int> <int>] [-gr <float>] [-threads <int>] [-tiles] [-adaptive <float>] [-lazy] [-record <file> | -replay <file>] [-profile <file>] [-cache <directory>] [-v]\n");
     return 0;
   }
 
@@ -1046,24 +2445,111 @@ int main(int argc, char **argv)
   // Parse program arguments
   if (!ParseArgs(argc, argv)) exit(-1);
 
+  // Record timers and counters from the start
+  if (profile_name) RNEnableProfile();
+
+  // Start worker threads (-threads 0 uses every processor)
+  if (num_threads != 1) thread_pool = new RNThreadPool(num_threads);
+
   // Read scene
+  RNTime read_time;
+  read_time.Read();
   scene = ReadScene(input_scene_name);
   if (!scene) exit(-1);
+  double read_seconds = read_time.Elapsed();
 
+  // Compile walls
+  RNTime walls_time;
+  walls_time.Read();
+  walls.Compile(scene);
+  double walls_seconds = walls_time.Elapsed();
+  if (print_verbose) {
+    printf("Compiled walls ...\n");
+    printf("  Time = %.2f seconds\n", walls_seconds);
+    printf("  # Walls = %d\n", walls.NWalls());
+    fflush(stdout);
+  }
 
+  // Run without a window if an output file was given
+  if (output_image_name) {
+    // Compute grid (every point is written, so none is left lazy)
+    lazy_evaluation = 0;
+    RNTime grid_time;
+    grid_time.Read();
+    initGrid(scene);
+    double grid_seconds = grid_time.Elapsed();
+
+    // Write grid
+    RNTime write_time;
+    write_time.Read();
+    if (!WriteGrid(output_image_name)) exit(-1);
+    double write_seconds = write_time.Elapsed();
+
+    // Print timings
+    printf("%s: %d sources, %d x %d grid\n", input_scene_name, scene->NRadSources(), grid_nx, grid_ny);
+    printf("  Read = %.3f seconds\n", read_seconds);
+    printf("  Walls = %.3f seconds\n", walls_seconds);
+    printf("  Grid = %.3f seconds\n", grid_seconds);
+    printf("  Write = %.3f seconds\n", write_seconds);
+    if (adaptive_tolerance >= 0)
+      printf("  # Evaluated = %d of %d points\n", adaptive_evaluations, grid_nx * grid_ny);
+    if (cache_directory)
+      printf("  # Cached = %d of %d sources\n", field_cache_hits, field_cache_hits + field_cache_misses);
+    if (print_verbose) {
+      printf("  # Queries = %lld\n", query_statistics.nqueries);
+      printf("  # Nodes tested = %lld\n", query_statistics.nnodes);
+      printf("  # Shapes tested = %lld\n", query_statistics.nshapes);
+    }
+    fflush(stdout);
+
+    // Write profile
+    if (profile_name && !RNWriteProfile(profile_name)) exit(-1);
+  }
+  else if (replay_trace_name) {
+    // Play back a trace without a window, as the viewer would
+    keep_source_fields = UsesFieldUpdates();
+    initGrid(scene);
+    viewer = new R3Viewer(scene->Viewer());
+    StartFieldUpdates(scene);
+    if (!ReplayTrace(replay_trace_name, scene)) exit(-1);
+    StopFieldUpdates();
+    if (print_verbose) {
+      printf("  # Queries = %lld\n", query_statistics.nqueries);
+      printf("  # Nodes tested = %lld\n", query_statistics.nnodes);
+      printf("  # Shapes tested = %lld\n", query_statistics.nshapes);
+    }
+    if (profile_name && !RNWriteProfile(profile_name)) exit(-1);
+  }
   else {
+    keep_source_fields = UsesFieldUpdates();
     initGrid(scene);
     num_rad_sources = scene->NRadSources();
 
     if (!num_rad_sources)
       movement = 0;
 
+    // Recompute the grid in the background when sources move (lazy
+    //   evaluation recomputes only what is drawn, when it is drawn)
+    StartFieldUpdates(scene);
+
     // Initialize GLUT
     GLUTInit(&argc, argv);
 
     // Create viewer
     viewer = new R3Viewer(scene->Viewer());
     if (!viewer) exit(-1);
+
+    // Start trace with the initial window and camera
+    if (record_trace_name) {
+      record_fp = fopen(record_trace_name, "w");
+      if (!record_fp) {
+        fprintf(stderr, "Unable to open trace file %s\n", record_trace_name);
+        exit(-1);
+      }
+      fprintf(record_fp, "# radiationbf trace of %s\n", input_scene_name);
+      RecordWindow(GLUTwindow_width, GLUTwindow_height);
+      RecordCamera();
+    }
     
     // Run GLUT interface
     GLUTMainLoop();
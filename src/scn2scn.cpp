@@ -0,0 +1,147 @@
+// Source file for the scene conversion program
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Include files
+////////////////////////////////////////////////////////////////////////
+
+#include "R3Graphics/R3Graphics.h"
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Global variables
+////////////////////////////////////////////////////////////////////////
+
+// Program variables
+
+static char *input_scene_name = NULL;
+static char *output_scene_name = NULL;
+static int print_verbose = 0;
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Input/output
+////////////////////////////////////////////////////////////////////////
+
+static R3Scene *
+ReadScene(const char *filename)
+{
+  // Start statistics
+  RNTime start_time;
+  start_time.Read();
+
+  // Allocate scene
+  R3Scene *scene = new R3Scene();
+  if (!scene) {
+    fprintf(stderr, "Unable to allocate scene for %s\n", filename);
+    return NULL;
+  }
+
+  // Read scene from file
+  if (!scene->ReadFile(filename)) {
+    delete scene;
+    return NULL;
+  }
+
+  // Print statistics
+  if (print_verbose) {
+    printf("Read scene from %s ...\n", filename);
+    printf("  Time = %.3f seconds\n", start_time.Elapsed());
+    printf("  # Nodes = %d\n", scene->NNodes());
+    printf("  # Lights = %d\n", scene->NLights());
+    printf("  # Sources = %d\n", scene->NRadSources());
+    fflush(stdout);
+  }
+
+  // Return scene
+  return scene;
+}
+
+
+
+static int
+WriteScene(R3Scene *scene, const char *filename)
+{
+  // Start statistics
+  RNTime start_time;
+  start_time.Read();
+
+  // Write scene to file
+  if (!scene->WriteFile(filename)) return 0;
+
+  // Print statistics
+  if (print_verbose) {
+    printf("Wrote scene to %s ...\n", filename);
+    printf("  Time = %.3f seconds\n", start_time.Elapsed());
+    fflush(stdout);
+  }
+
+  // Return success
+  return 1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Program argument parsing
+////////////////////////////////////////////////////////////////////////
+
+static int
+ParseArgs(int argc, char **argv)
+{
+  // Parse arguments
+  argc--; argv++;
+  while (argc > 0) {
+    if ((*argv)[0] == '-') {
+      if (!strcmp(*argv, "-v")) {
+        print_verbose = 1;
+      }
+      else {
+        fprintf(stderr, "Invalid program argument: %s", *argv);
+        exit(1);
+      }
+      argv++; argc--;
+    }
+    else {
+      if (!input_scene_name) input_scene_name = *argv;
+      else if (!output_scene_name) output_scene_name = *argv;
+      else { fprintf(stderr, "Invalid program argument: %s", *argv); exit(1); }
+      argv++; argc--;
+    }
+  }
+
+  // Check scene filenames
+  if (!input_scene_name || !output_scene_name) {
+    fprintf(stderr, "Usage: scn2scn inputscenefile outputscenefile [-v]\n");
+    fprintf(stderr, "  (e.g., scn2scn site.scn site.scb, to load site.scb without parsing)\n");
+    return 0;
+  }
+
+  // Return OK status
+  return 1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Main program
+////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+  // Parse program arguments
+  if (!ParseArgs(argc, argv)) exit(-1);
+
+  // Read scene
+  R3Scene *scene = ReadScene(input_scene_name);
+  if (!scene) exit(-1);
+
+  // Write scene
+  if (!WriteScene(scene, output_scene_name)) exit(-1);
+
+  // Return success
+  return 0;
+}